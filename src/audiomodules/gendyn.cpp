@@ -2,7 +2,6 @@
 #include "plugin.hpp"
 #include <functional>
 #include <atomic>
-#include <random>
 #include "helperwidgets.h"
 
 inline double custom_log(double value, double base)
@@ -23,6 +22,8 @@ enum Distributions
 		DIST_Uniform,
 		DIST_Gauss,
 		DIST_Cauchy,
+		DIST_Logistic,
+		DIST_HypCos,
 		LASTDIST
 	};
 enum ResetModes
@@ -44,14 +45,130 @@ inline float avg(float a, float b)
 	return a + (b - a) / 2.0f;
 }
 
-class GendynNode
+// Inverse cumulative distribution functions of the random walk step distributions, tabulated
+// so that the steps can be drawn 4 at a time from uniform random numbers
+class GendynDistributionTables
 {
 public:
-	GendynNode() {}
-	float m_x_prim = 0.0f;
-	float m_y_prim = 0.0f;
-	float m_x_sec = 0.0f;
-	float m_y_sec = 0.0f;
+	static const int tableSize = 1024;
+	static const GendynDistributionTables& get()
+	{
+		static GendynDistributionTables tables;
+		return tables;
+	}
+	// u must be in [0,1)
+	simd::float_4 lookup(int dist, simd::float_4 u) const
+	{
+		const float* table = m_tables[dist];
+		simd::float_4 pos = u * (float)tableSize;
+		simd::float_4 result;
+		for (int i = 0; i < 4; ++i)
+		{
+			int index = pos[i];
+			float frac = pos[i] - index;
+			result[i] = table[index] + (table[index + 1] - table[index]) * frac;
+		}
+		return result;
+	}
+private:
+	GendynDistributionTables()
+	{
+		for (int i = 0; i <= tableSize; ++i)
+		{
+			// the infinite tails are cut half a table step from the ends
+			double u = (double)i / tableSize;
+			u = std::min(std::max(u, 0.5 / tableSize), 1.0 - 0.5 / tableSize);
+			m_tables[DIST_Uniform][i] = 2.0 * u - 1.0;
+			m_tables[DIST_Gauss][i] = inverseNormal(u);
+			m_tables[DIST_Cauchy][i] = std::tan(M_PI * (u - 0.5));
+			m_tables[DIST_Logistic][i] = std::log(u / (1.0 - u));
+			m_tables[DIST_HypCos][i] = std::log(std::tan(M_PI * 0.5 * u));
+		}
+	}
+	static double inverseNormal(double u)
+	{
+		double lo = -10.0;
+		double hi = 10.0;
+		for (int i = 0; i < 64; ++i)
+		{
+			double mid = 0.5 * (lo + hi);
+			if (0.5 * std::erfc(-mid / std::sqrt(2.0)) < u)
+				lo = mid;
+			else hi = mid;
+		}
+		return 0.5 * (lo + hi);
+	}
+	float m_tables[LASTDIST][tableSize + 1];
+};
+
+// Residuals of the minimum phase band limited step (minBLEP) and ramp (minBLAMP), shared by
+// all the oscillators. The residuals are tabulated for the sample positions following the
+// discontinuity, at overSampling fractional offsets.
+class GendynBlepTables
+{
+public:
+	static const int zeroCrossings = 16;
+	static const int overSampling = 32;
+	static const int residualLength = 2 * zeroCrossings;
+	static const GendynBlepTables& get()
+	{
+		static GendynBlepTables tables;
+		return tables;
+	}
+	// Adds the residuals of a jump and of a slope change, that happened offset (0..1) samples
+	// before out[0], into out[0..residualLength-1]
+	void addResiduals(float* out, float offset, float jump, float slopeChange) const
+	{
+		float pos = offset * overSampling;
+		int index = pos;
+		index = index < overSampling - 1 ? index : overSampling - 1;
+		float frac = pos - index;
+		const float* step0 = m_step[index];
+		const float* step1 = m_step[index + 1];
+		const float* ramp0 = m_ramp[index];
+		const float* ramp1 = m_ramp[index + 1];
+		for (int i = 0; i < residualLength; i += 4)
+		{
+			simd::float_4 st = simd::float_4::load(&step0[i]);
+			st += (simd::float_4::load(&step1[i]) - st) * frac;
+			simd::float_4 ra = simd::float_4::load(&ramp0[i]);
+			ra += (simd::float_4::load(&ramp1[i]) - ra) * frac;
+			simd::float_4 o = simd::float_4::load(&out[i]) + jump * st + slopeChange * ra;
+			o.store(&out[i]);
+		}
+	}
+	// The band limited ramp settles to a ramp delayed by -getRampTail() samples. The tables
+	// have the tail removed so that they decay to zero, users add getRampTail() times the
+	// current slope to the output instead.
+	float getRampTail() const { return m_rampTail; }
+private:
+	GendynBlepTables()
+	{
+		const int n = 2 * zeroCrossings * overSampling;
+		std::vector<float> impulse(n);
+		dsp::minBlepImpulse(zeroCrossings, overSampling, impulse.data());
+		// step response and its integral at the oversampled positions, past the end
+		// the step has settled to 1
+		std::vector<double> step(n + overSampling + 1, 1.0);
+		std::vector<double> ramp(n + overSampling + 1, 0.0);
+		for (int i = 0; i < n; ++i)
+			step[i] = impulse[i];
+		for (int i = 1; i < (int)ramp.size(); ++i)
+			ramp[i] = ramp[i - 1] + 0.5 * (step[i - 1] + step[i]) / overSampling;
+		m_rampTail = ramp[n - 1] - (double)(n - 1) / overSampling;
+		for (int i = 0; i <= overSampling; ++i)
+		{
+			for (int j = 0; j < residualLength; ++j)
+			{
+				int k = i + j * overSampling;
+				m_step[i][j] = step[k] - 1.0;
+				m_ramp[i][j] = ramp[k] - (double)k / overSampling - m_rampTail;
+			}
+		}
+	}
+	alignas(16) float m_step[overSampling + 1][residualLength];
+	alignas(16) float m_ramp[overSampling + 1][residualLength];
+	float m_rampTail = 0.0f;
 };
 
 class DCBlocker
@@ -73,25 +190,29 @@ private:
 class GendynOsc
 {
 public:
+	static const int maxNodes = 128;
 	GendynOsc()
 	{
-		m_nodes.resize(128);
-		for (int i = 0; i < 128; ++i)
+		for (int i = 0; i < maxNodes; ++i)
 		{
-			m_nodes[i].m_x_prim = avg(m_time_primary_high_barrier, m_time_primary_high_barrier);
-			m_nodes[i].m_x_sec = avg(m_time_secondary_low_barrier, m_time_secondary_high_barrier);
-
+			m_x_prim[i] = avg(m_time_primary_high_barrier, m_time_primary_high_barrier);
+			m_x_sec[i] = avg(m_time_secondary_low_barrier, m_time_secondary_high_barrier);
+			m_y_prim[i] = 0.0f;
+			m_y_sec[i] = 0.0f;
 		}
-		m_cur_dur = m_nodes.front().m_x_sec;
-		m_cur_y0 = m_nodes.front().m_y_sec;
-		m_cur_y1 = m_nodes[1].m_y_sec;
-		m_next_segment_time = m_nodes[0].m_x_sec;
+		updateReciprocals();
+		m_cur_dur = m_x_sec[0];
+		m_cur_y0 = m_y_sec[0];
+		m_cur_y1 = m_y_sec[1];
+		m_cur_slope = (m_cur_y1 - m_cur_y0) * m_recip_x[0];
+		m_next_segment_time = m_x_sec[0];
         setSampleRate(44100.0f);
 	}
 	void setRandomSeed(int s)
 	{
-		m_rand = std::mt19937(s);
+		m_rand.setSeed(s);
 	}
+	// Renders sample by sample, processBlock gives the same output faster
 	void process(float* buf, int nframes)
 	{
 		for (int i = 0; i < nframes; ++i)
@@ -104,77 +225,98 @@ public:
 			s = m_hpfilt.process(s);
             buf[i] = s; //clamp(s,-1.0f,1.0f);
 			m_phase += 1.0;
-			//m_segment_phase += 1.0;
 			if (m_phase >= m_next_segment_time)
-			{
-				++m_cur_node;
-				
-				if (m_cur_node < m_num_segs - 1)
-				{
-					m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-					m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-					m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
-					m_next_segment_time = m_cur_dur;
-				}
-				if (m_cur_node == m_num_segs - 1)
-				{
-					m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-					m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-					m_next_segment_time = m_cur_dur;
-					updateTable();
-					m_cur_y1 = m_nodes.front().m_y_sec;
-                    m_cur_node = 0;
-				}
-                /*
-				if (m_cur_node == m_num_segs)
-				{
-					m_cur_node = 0;
-					m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-					m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-					m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
-					m_next_segment_time = m_cur_dur;
-					
-				}
-                */
-				m_phase = 0.0;
-			}
+				nextSegment();
+		}
+	}
+	// Renders the segments 4 samples at a time using the slope of the current segment
+	void processBlock(float* buf, int nframes)
+	{
+		if (m_bandLimited)
+		{
+			for (int i = 0; i < nframes; i += maxBandLimitedFrames)
+				processBandLimited(&buf[i], std::min(maxBandLimitedFrames, nframes - i));
+			for (int i = 0; i < nframes; ++i)
+				buf[i] = m_hpfilt.process(buf[i]);
+			return;
+		}
+		const simd::float_4 ramp(0.0f, 1.0f, 2.0f, 3.0f);
+		int pos = 0;
+		while (pos < nframes)
+		{
+			// the phase runs in whole samples from 0 until it reaches the segment time
+			int segleft = std::ceil(m_next_segment_time - m_phase);
+			int n = std::min(std::max(segleft, 1), nframes - pos);
+			float y0 = m_cur_y0;
+			float slope = m_cur_slope;
+			float phase = m_phase;
+			int k = 0;
+			for (; k + 4 <= n; k += 4)
+				(y0 + slope * (phase + k + ramp)).store(&buf[pos + k]);
+			for (; k < n; ++k)
+				buf[pos + k] = y0 + slope * (phase + k);
+			pos += n;
+			m_phase += n;
+			if (m_phase >= m_next_segment_time)
+				nextSegment();
+		}
+		for (int i = 0; i < nframes; ++i)
+			buf[i] = m_hpfilt.process(buf[i]);
+	}
+	// Band limiting renders the breakpoints at their fractional positions and corrects the
+	// corners with the minBLAMP residuals
+	void setBandLimited(bool b)
+	{
+		if (b != m_bandLimited)
+		{
+			m_bandLimited = b;
+			for (auto& e : m_residuals)
+				e = 0.0f;
 		}
 	}
 	void resetTable()
 	{
-		std::uniform_real_distribution<float> ampdist{m_amp_secondary_low_barrier,m_amp_secondary_high_barrier};
-		std::uniform_real_distribution<float> timedist{m_time_secondary_low_barrier,m_time_secondary_high_barrier};
-		std::uniform_real_distribution<float> unidist(0.0,1.0);
+		float oldValue = m_cur_y0 + m_cur_slope * m_phase;
+		float oldSlope = m_cur_slope;
+		alignas(16) float timeuni[maxNodes];
+		alignas(16) float ampuni[maxNodes];
+		for (int i = 0; i < m_num_segs; i += 4)
+		{
+			m_rand.nextFloat().store(&timeuni[i]);
+			m_rand.nextFloat().store(&ampuni[i]);
+		}
 		for (int i = 0; i < m_num_segs; ++i)
 		{
-			m_nodes[i].m_x_prim = avg(m_time_primary_low_barrier,m_time_primary_high_barrier);
+			m_x_prim[i] = avg(m_time_primary_low_barrier,m_time_primary_high_barrier);
 			if (m_timeResetMode == RM_Avg)
-				m_nodes[i].m_x_sec = avg(m_time_secondary_low_barrier,m_time_secondary_high_barrier);
+				m_x_sec[i] = avg(m_time_secondary_low_barrier,m_time_secondary_high_barrier);
 			else if (m_timeResetMode == RM_BinaryRandom)
 			{
-				if (unidist(m_rand)<0.5)
-					m_nodes[i].m_x_sec = m_time_secondary_low_barrier;
-				else m_nodes[i].m_x_sec = m_time_secondary_high_barrier;
+				if (timeuni[i]<0.5)
+					m_x_sec[i] = m_time_secondary_low_barrier;
+				else m_x_sec[i] = m_time_secondary_high_barrier;
 			}
 			else
 			{
-				m_nodes[i].m_x_sec = m_sampleRate/m_center_frequency/m_num_segs;
+				m_x_sec[i] = m_sampleRate/m_center_frequency/m_num_segs;
 			}
-			m_nodes[i].m_y_prim = 0.0f;
+			m_y_prim[i] = 0.0f;
 			if (m_ampResetMode == RM_Zeros)
-				m_nodes[i].m_y_sec = 0.0f;
+				m_y_sec[i] = 0.0f;
 			else if (m_ampResetMode == RM_UniformRandom)
-				m_nodes[i].m_y_sec = ampdist(m_rand);
+				m_y_sec[i] = rescale(ampuni[i],0.0f,1.0f,m_amp_secondary_low_barrier,m_amp_secondary_high_barrier);
 			else
-				m_nodes[i].m_y_sec = 0.0f;
+				m_y_sec[i] = 0.0f;
 		}
+		updateReciprocals();
 		m_cur_node = 0;
         m_phase = 0.0;
-		m_next_segment_time = m_nodes[0].m_x_sec;
-		//m_segment_phase = 0.0;
-		m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-		m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-		m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
+		m_next_segment_time = m_x_sec[0];
+		m_cur_dur = m_x_sec[m_cur_node];
+		m_cur_y0 = m_y_sec[m_cur_node];
+		m_cur_y1 = m_y_sec[m_cur_node + 1];
+		m_cur_slope = (m_cur_y1 - m_cur_y0) * m_recip_x[m_cur_node];
+		addRestartResiduals(oldValue, oldSlope);
 	}
 	void setFrequencies(float center, float a, float b)
 	{
@@ -187,56 +329,45 @@ public:
 		m_time_secondary_low_barrier = clamp(m_sampleRate/hz/m_num_segs,1.0,128.0f);
 		sanitizeRange(m_time_secondary_low_barrier,m_time_secondary_high_barrier,1.0f);
 	}
+	// Runs the random walks of the used breakpoints, 4 breakpoints at a time
 	void updateTable()
 	{
-		if (m_amp_flux < 0.25f)
-        {
-            float norm = rescale(m_amp_flux,0.0f,0.25f,0.0f,1.0f);
-            //m_amp_dev = norm*
-        } else if (m_amp_flux>=0.25f && m_amp_flux<0.5f)
-        {
-
-        } else if (m_amp_flux>=0.5f && m_amp_flux<0.75f)
-        {
-
-        } else 
-        {
-
-        }
-        
         m_amp_primary_low_barrier = -rescale(m_amp_flux,0.0f,1.0f,0.01,1.0f);
         m_amp_primary_high_barrier = -m_amp_primary_low_barrier;
         m_amp_dev = m_amp_flux * (m_amp_primary_high_barrier-m_amp_primary_low_barrier);
-        std::normal_distribution<float> timedist(m_time_mean, m_time_dev);
-		std::normal_distribution<float> ampdist(m_amp_mean, m_amp_dev);
-		float segAcc = 0.0f;
-		for (int i = 0; i < m_num_segs; ++i)
+		const GendynDistributionTables& dists = GendynDistributionTables::get();
+		float secbar0 = m_time_secondary_low_barrier;
+		float secbar1 = m_time_secondary_high_barrier;
+		sanitizeRange(secbar0,secbar1,1.0f);
+		simd::float_4 segAcc = 0.0f;
+		for (int i = 0; i < m_num_segs; i += 4)
 		{
-			float x_p = m_nodes[i].m_x_prim;
-			x_p += timedist(m_rand);
-			x_p = reflect_value(m_time_primary_low_barrier, x_p,m_time_primary_high_barrier);
-			float x_s = m_nodes[i].m_x_sec;
-			x_s += x_p;
-			float secbar0 = m_time_secondary_low_barrier;
-			float secbar1 = m_time_secondary_high_barrier;
-			sanitizeRange(secbar0,secbar1,1.0f);
-			x_s = reflect_value(secbar0, x_s, secbar1);
-			m_nodes[i].m_x_prim = x_p;
-			m_nodes[i].m_x_sec = x_s;
-			segAcc+=m_nodes[i].m_x_sec;
-			float y_p = m_nodes[i].m_y_prim;
-			y_p += ampdist(m_rand);
-			y_p = clamp(y_p,m_amp_primary_low_barrier, m_amp_primary_high_barrier);
-			float y_s = m_nodes[i].m_y_sec;
-			y_s += y_p;
-			y_s = reflect_value(m_amp_secondary_low_barrier, y_s, m_amp_secondary_high_barrier);
-			m_nodes[i].m_y_prim = y_p;
-			m_nodes[i].m_y_sec = y_s;
+			// the breakpoints after the used ones are left as they are
+			simd::float_4 used = simd::float_4(i, i + 1, i + 2, i + 3) < (float)m_num_segs;
+			simd::float_4 x_p = simd::float_4::load(&m_x_prim[i]);
+			x_p += m_time_mean + m_time_dev * dists.lookup(m_time_distribution, m_rand.nextFloat());
+			x_p = reflect_value_simd(m_time_primary_low_barrier, x_p, m_time_primary_high_barrier);
+			simd::float_4 x_s = simd::float_4::load(&m_x_sec[i]) + x_p;
+			x_s = reflect_value_simd(secbar0, x_s, secbar1);
+			simd::float_4 y_p = simd::float_4::load(&m_y_prim[i]);
+			y_p += m_amp_mean + m_amp_dev * dists.lookup(DIST_Gauss, m_rand.nextFloat());
+			y_p = simd::clamp(y_p, m_amp_primary_low_barrier, m_amp_primary_high_barrier);
+			simd::float_4 y_s = simd::float_4::load(&m_y_sec[i]) + y_p;
+			y_s = reflect_value_simd(m_amp_secondary_low_barrier, y_s, m_amp_secondary_high_barrier);
+			simd::ifelse(used, x_p, simd::float_4::load(&m_x_prim[i])).store(&m_x_prim[i]);
+			simd::ifelse(used, x_s, simd::float_4::load(&m_x_sec[i])).store(&m_x_sec[i]);
+			simd::ifelse(used, y_p, simd::float_4::load(&m_y_prim[i])).store(&m_y_prim[i]);
+			simd::ifelse(used, y_s, simd::float_4::load(&m_y_sec[i])).store(&m_y_sec[i]);
+			segAcc += simd::ifelse(used, x_s, 0.0f);
 		}
-		float freq = m_sampleRate/segAcc;
+		updateReciprocals();
+		float freq = m_sampleRate/(segAcc[0]+segAcc[1]+segAcc[2]+segAcc[3]);
 		float volts = custom_log(freq/rack::dsp::FREQ_C4,2.0f);
         m_curFrequencyVolts = clamp(volts,-5.0,5.0);
-		//m_next_segment_time = m_nodes[0].m_x_sec;
+	}
+	void setTimeDistribution(int d)
+	{
+		m_time_distribution = clamp(d,0,LASTDIST-1);
 	}
 	int m_num_segs = 11;
 	float m_time_primary_low_barrier = -1.0;
@@ -256,15 +387,19 @@ public:
     {
         if (n!=m_num_segs)
         {
+            float oldValue = m_cur_y0 + m_cur_slope * m_phase;
+            float oldSlope = m_cur_slope;
             m_num_segs = clamp(n,3,64);
             //if (m_num_segs>=m_cur_node)
 			{
 				m_cur_node = 0;
             	m_phase = 0.0;
-				m_cur_dur = m_nodes[m_cur_node].m_x_sec;
-				m_cur_y0 = m_nodes[m_cur_node].m_y_sec;
-				m_cur_y1 = m_nodes[m_cur_node + 1].m_y_sec;
+				m_cur_dur = m_x_sec[m_cur_node];
+				m_cur_y0 = m_y_sec[m_cur_node];
+				m_cur_y1 = m_y_sec[m_cur_node + 1];
+				m_cur_slope = (m_cur_y1 - m_cur_y0) * m_recip_x[m_cur_node];
 			}
+            addRestartResiduals(oldValue, oldSlope);
         }
     }
 	void setSampleRate(float s)
@@ -283,15 +418,107 @@ public:
         m_amp_flux = f;
     }
 private:
+	void nextSegment()
+	{
+		++m_cur_node;
+		if (m_cur_node < m_num_segs - 1)
+		{
+			m_cur_dur = m_x_sec[m_cur_node];
+			m_cur_y0 = m_y_sec[m_cur_node];
+			m_cur_y1 = m_y_sec[m_cur_node + 1];
+			m_cur_slope = (m_cur_y1 - m_cur_y0) * m_recip_x[m_cur_node];
+			m_next_segment_time = m_cur_dur;
+		}
+		if (m_cur_node == m_num_segs - 1)
+		{
+			m_cur_dur = m_x_sec[m_cur_node];
+			m_cur_y0 = m_y_sec[m_cur_node];
+			float recip = m_recip_x[m_cur_node];
+			m_next_segment_time = m_cur_dur;
+			updateTable();
+			m_cur_y1 = m_y_sec[0];
+			m_cur_slope = (m_cur_y1 - m_cur_y0) * recip;
+            m_cur_node = 0;
+		}
+		m_phase = 0.0;
+	}
+	// Renders at most maxBandLimitedFrames frames, not high pass filtered
+	void processBandLimited(float* buf, int nframes)
+	{
+		const GendynBlepTables& bleps = GendynBlepTables::get();
+		const simd::float_4 ramp(0.0f, 1.0f, 2.0f, 3.0f);
+		// the ramp tail of the residuals is added as a phase offset
+		const float tail = bleps.getRampTail();
+		int pos = 0;
+		while (pos < nframes)
+		{
+			int segleft = std::ceil(m_next_segment_time - m_phase);
+			int n = std::min(std::max(segleft, 1), nframes - pos);
+			float y0 = m_cur_y0;
+			float slope = m_cur_slope;
+			float phase = m_phase + tail;
+			int k = 0;
+			for (; k + 4 <= n; k += 4)
+				(y0 + slope * (phase + k + ramp)).store(&buf[pos + k]);
+			for (; k < n; ++k)
+				buf[pos + k] = y0 + slope * (phase + k);
+			pos += n;
+			m_phase += n;
+			// the phase is carried over to the next segments, so the corners happen between
+			// the samples. After the last segment the output jumps to the second breakpoint.
+			while (m_phase >= m_next_segment_time)
+			{
+				double excess = m_phase - m_next_segment_time;
+				float oldEnd = m_cur_y0 + m_cur_slope * (float)m_next_segment_time;
+				float oldSlope = m_cur_slope;
+				nextSegment();
+				m_phase = excess;
+				bleps.addResiduals(&m_residuals[pos], excess, m_cur_y0 - oldEnd,
+					m_cur_slope - oldSlope);
+			}
+		}
+		for (int i = 0; i < nframes; ++i)
+			buf[i] += m_residuals[i];
+		const int len = GendynBlepTables::residualLength;
+		for (int i = 0; i < len; ++i)
+			m_residuals[i] = m_residuals[i + nframes];
+		for (int i = len; i < len + nframes; ++i)
+			m_residuals[i] = 0.0f;
+	}
+	// The oscillator restarts from the first breakpoint at the next sample
+	void addRestartResiduals(float oldValue, float oldSlope)
+	{
+		if (!m_bandLimited)
+			return;
+		GendynBlepTables::get().addResiduals(m_residuals, 0.0f, m_cur_y0 - oldValue,
+			m_cur_slope - oldSlope);
+	}
+	void updateReciprocals()
+	{
+		for (int i = 0; i < maxNodes; i += 4)
+			(1.0f / simd::float_4::load(&m_x_sec[i])).store(&m_recip_x[i]);
+	}
 	int m_cur_node = 0;
 	double m_phase = 0.0;
 	//double m_segment_phase = 0.0;
 	double m_next_segment_time = 0.0;
-	std::vector<GendynNode> m_nodes;
-	std::mt19937 m_rand;
+	// the breakpoints, as separate arrays for the SIMD processing
+	alignas(16) float m_x_prim[maxNodes];
+	alignas(16) float m_y_prim[maxNodes];
+	alignas(16) float m_x_sec[maxNodes];
+	alignas(16) float m_y_sec[maxNodes];
+	// 1/m_x_sec, updated when the breakpoints change
+	alignas(16) float m_recip_x[maxNodes];
+	SimdXorShift32 m_rand;
+	int m_time_distribution = DIST_Gauss;
+	bool m_bandLimited = false;
+	static const int maxBandLimitedFrames = 32;
+	// overlap-add buffer of the residuals, starts at the next sample to be output
+	alignas(16) float m_residuals[maxBandLimitedFrames + GendynBlepTables::residualLength] = {};
 	float m_cur_dur = 0.0;
 	float m_cur_y0 = 0.0;
 	float m_cur_y1 = 0.0;
+	float m_cur_slope = 0.0;
 	float m_sampleRate = 0.0f;
     float m_amp_primary_low_barrier = -0.05;
 	float m_amp_primary_high_barrier = 0.05;
@@ -322,6 +549,7 @@ public:
         PAR_AMP_BEHAVIOR,
 		PAR_PolyphonyVoices,
 		PAR_CenterFrequency,
+        PAR_BANDLIMITED,
         PAR_LAST
     };
     enum INPUTS
@@ -343,7 +571,11 @@ public:
 private:
     GendynOsc m_oscs[16];
 	dsp::SchmittTrigger m_reset_trigger;
-	dsp::ClockDivider m_divider;
+	// the voices are rendered in blocks, the parameters are updated at the block starts
+	static const int blockSize = 16;
+	float m_outblock[16][blockSize] = {};
+	int m_blockpos = blockSize;
+	int m_blockNumVoices = 0;
 };
 
 class GendynWidget : public ModuleWidget
@@ -360,7 +592,8 @@ GendynModule::GendynModule()
         m_oscs[i].setRandomSeed(i);
     config(PARAMS::PAR_LAST,IN_LAST,OUT_LAST);
     configParam(PAR_NUM_SEGS,3.0,64.0,10.0,"Num segments");
-    configParam(PAR_TIME_DISTRIBUTION,0.0,LASTDIST-1,1.0,"Time distribution");
+    configSwitch(PAR_TIME_DISTRIBUTION,0.0,LASTDIST-1,DIST_Gauss,"Time distribution",
+        {"Uniform","Gauss","Cauchy","Logistic","Hyperbolic cosine"});
     configParam(PAR_TimeMean,-5.0,5.0,0.0,"Time mean");
     configParam(PAR_TIME_RESET_MODE,0.0,LASTRM,RM_Avg,"Time reset mode");
     configParam(PAR_TimeDeviation,0.0,5.0,0.1,"Time deviation");
@@ -372,7 +605,7 @@ GendynModule::GendynModule()
     configParam(PAR_PolyphonyVoices,0.0,16.0,0,"Polyphony voices");
     configParam(PAR_CenterFrequency,-54.f, 54.f, 0.f, "Center frequency", " Hz", dsp::FREQ_SEMITONE, dsp::FREQ_C4);
     configParam(PAR_AMP_BEHAVIOR,0.0,1.0f,0.1f,"Amplitude flux");
-    m_divider.setDivision(16);
+    configSwitch(PAR_BANDLIMITED,0.0f,1.0f,0.0f,"Band limited",{"Off","On"});
 }
 
 std::string GendynModule::getDebugMessage()
@@ -411,11 +644,12 @@ void GendynModule::process(const ProcessArgs& args)
     sectimebarhigh = clamp(sectimebarhigh,1.0,64.0);
     sanitizeRange(sectimebarlow,sectimebarhigh,1.0f);
     
-    if (m_divider.process())
+    if (m_blockpos == blockSize || shouldReset)
     {
         for (int i=0;i<numvoices;++i)
         {
             m_oscs[i].setSampleRate(args.sampleRate);
+            m_oscs[i].setBandLimited(params[PAR_BANDLIMITED].getValue() > 0.5f);
             
             m_oscs[i].setNumSegments(numsegs);
             m_oscs[i].m_time_dev = timedev;
@@ -437,33 +671,38 @@ void GendynModule::process(const ProcessArgs& args)
             m_oscs[i].m_time_primary_high_barrier = bar1;
             float alux = params[PAR_AMP_BEHAVIOR].getValue();
             m_oscs[i].setAmplitudeFlux(alux);
+            m_oscs[i].setTimeDistribution(params[PAR_TIME_DISTRIBUTION].getValue());
         }
-    }
-    if (shouldReset == true)
-    {
-        for (int i=0;i<numvoices;++i)
+        if (shouldReset == true)
         {
-            m_oscs[i].m_ampResetMode = params[PAR_AMP_RESET_MODE].getValue();
-            m_oscs[i].m_timeResetMode = params[PAR_TIME_RESET_MODE].getValue();
-            float pitch = params[PAR_CenterFrequency].getValue();
-            pitch += rescale(inputs[IN_PITCH].getVoltage(i),-5.0f,5.0f,-60.0f,60.0f);
-            pitch = clamp(pitch,-60.0f,60.0f);
-            float centerfreq = dsp::FREQ_C4*pow(2.0f,1.0f/12.0f*pitch);
-            m_oscs[i].setFrequencies(centerfreq,params[PAR_TimeSecondaryBarrierLow].getValue(),
-                params[PAR_TimeSecondaryBarrierHigh].getValue());
-            m_oscs[i].resetTable();
+            for (int i=0;i<numvoices;++i)
+            {
+                m_oscs[i].m_ampResetMode = params[PAR_AMP_RESET_MODE].getValue();
+                m_oscs[i].m_timeResetMode = params[PAR_TIME_RESET_MODE].getValue();
+                float pitch = params[PAR_CenterFrequency].getValue();
+                pitch += rescale(inputs[IN_PITCH].getVoltage(i),-5.0f,5.0f,-60.0f,60.0f);
+                pitch = clamp(pitch,-60.0f,60.0f);
+                float centerfreq = dsp::FREQ_C4*pow(2.0f,1.0f/12.0f*pitch);
+                m_oscs[i].setFrequencies(centerfreq,params[PAR_TimeSecondaryBarrierLow].getValue(),
+                    params[PAR_TimeSecondaryBarrierHigh].getValue());
+                m_oscs[i].resetTable();
+            }
         }
+        for (int i=0;i<numvoices;++i)
+            m_oscs[i].processBlock(m_outblock[i],blockSize);
+        m_blockNumVoices = numvoices;
+        m_blockpos = 0;
     }
     for (int i=0;i<numvoices;++i)
     {
         float outsample = 0.0f;
-        m_oscs[i].process(&outsample,1);
-        
+        // voices added during the block start at the next block
+        if (i<m_blockNumVoices)
+            outsample = m_outblock[i][m_blockpos];
         outputs[1].setVoltage(m_oscs[i].m_curFrequencyVolts,i);
         outputs[0].setVoltage(outsample*5.0f,i);
     }
-    
-    
+    ++m_blockpos;
 }
 
 GendynWidget::GendynWidget(GendynModule* m)
@@ -473,6 +712,7 @@ GendynWidget::GendynWidget(GendynModule* m)
     auto port = new PortWithBackGround(m,this,GendynModule::OUT_AUDIO,1,30,"AUDIO OUT",true);
     port = new PortWithBackGround(m,this,GendynModule::OUT_PITCH,31,30,"PITCH OUT",true);
     port = new PortWithBackGround(m,this,GendynModule::IN_RESET,62,30,"RESET",false);
+    addParam(createParam<CKSS>(Vec(95.0, 32.0), module, GendynModule::PAR_BANDLIMITED));
     float xc = 1.0f;
     float yc = 80.0f;
     addChild(new KnobInAttnWidget(this,"PITCH",GendynModule::PAR_CenterFrequency,
@@ -480,6 +720,7 @@ GendynWidget::GendynWidget(GendynModule* m)
     xc += 82.0f;
     addChild(new KnobInAttnWidget(this,"PITCH FLUX",GendynModule::PAR_TimeDeviation,
             -1,-1,xc,yc));
+    addParam(createParam<Trimpot>(Vec(xc+57.f, yc+0.0f), module, GendynModule::PAR_TIME_DISTRIBUTION));
     xc += 82.0f;
     addChild(new KnobInAttnWidget(this,"PITCH MIN",GendynModule::PAR_TimeSecondaryBarrierLow,
             -1,-1,xc,yc));
@@ -20,6 +20,7 @@
 #include <mutex>
 #include "dr_wav.h"
 #include "choc_SingleReaderSingleWriterFIFO.h"
+#include "commandqueue.h"
 
 #ifndef RAPIHEADLESS
 
@@ -121,8 +122,7 @@ public:
             "Playrate controls region scan position",
             "Scrub"});
         getParamQuantity(PAR_PLAYBACKMODE)->randomizeEnabled = false;
-        exFIFO.reset(64);
-        exFIFODiv.setDivision(32768);
+        exFIFODiv.setDivision(256);
     }
     json_t* dataToJson() override
     {
@@ -176,11 +176,7 @@ public:
     {
         if (exFIFODiv.process())
         {
-            std::function<void(void)> func;
-            while (exFIFO.pop(func))
-            {
-                func();
-            }
+            exFIFO.drain([this](const Command& cmd) { handleCommand(cmd); },maxCommandsPerDrain);
             exFIFODiv.reset();
         }
         float prate = params[PAR_PLAYRATE].getValue();
@@ -352,12 +348,6 @@ public:
         {
             m_eng.addMarker();
         }
-
-        if (m_next_marker_action == ACT_RESET_RECORD_HEAD)
-        {
-            drsrc->resetRecording();
-            m_next_marker_action = ACT_NONE;
-        }
         
         graindebugcounter = m_eng.m_gm->grainCounter;
     }
@@ -404,8 +394,39 @@ public:
         ACT_ADD_EQ_MARKERS,
         ACT_LAST
     };
-    std::atomic<int> m_next_marker_action{ACT_NONE};
-    choc::fifo::SingleReaderSingleWriterFIFO<std::function<void(void)>> exFIFO;
+    // Sent from the GUI to the audio thread. The payload union has the arguments of the
+    // actions that need them.
+    struct Command
+    {
+        ACTIONS action = ACT_NONE;
+        union
+        {
+            int numMarkers;
+        };
+    };
+    static Command makeCommand(ACTIONS action, int numMarkers = 0)
+    {
+        Command cmd;
+        cmd.action = action;
+        cmd.numMarkers = numMarkers;
+        return cmd;
+    }
+    void handleCommand(const Command& cmd)
+    {
+        auto drsrc = dynamic_cast<MultiBufferSource*>(m_eng.m_srcs[0].get());
+        if (cmd.action == ACT_CLEAR_ALL_MARKERS)
+            m_eng.clearMarkers();
+        else if (cmd.action == ACT_RESET_RECORD_HEAD)
+            drsrc->resetRecording();
+        else if (cmd.action == ACT_CLEAR_ALL_AUDIO)
+            drsrc->clearAudio(-1,-1,0);
+        else if (cmd.action == ACT_CLEAR_REGION)
+            clearRegionAudio();
+        else if (cmd.action == ACT_ADD_EQ_MARKERS)
+            m_eng.addEquidistantMarkers(cmd.numMarkers);
+    }
+    static const int maxCommandsPerDrain = 4;
+    CommandQueue<Command,64> exFIFO;
     GrainEngine m_eng;
     int m_interpolation_mode = 0;
 private:
@@ -632,16 +653,6 @@ public:
     }
 };
 
-template<typename F,typename FIFO>
-inline rack::MenuItem* createSafeMenuItem(F func,std::string text,FIFO& fifo)
-{
-    auto item = createMenuItem([func,&fifo]() 
-    { 
-        fifo.push(func);
-    },text);
-    return item;
-}
-
 class XGranularWidget : public rack::ModuleWidget
 {
 public:
@@ -663,21 +674,14 @@ public:
             targmenu->addChild(normItem);
             auto revItem = createMenuItem([this,drsrc](){ drsrc->reverse(); },"Reverse audio");
             targmenu->addChild(revItem);
-            auto clearall = createMenuItem([this,drsrc]()
+            auto clearall = createMenuItem([this]()
             { 
-                m_gm->exFIFO.push([this,drsrc]()
-                {
-                    drsrc->clearAudio(-1,-1,0);
-                });
-                 
+                m_gm->exFIFO.push(XGranularModule::makeCommand(XGranularModule::ACT_CLEAR_ALL_AUDIO));
             },"Clear all audio");
             targmenu->addChild(clearall);
             auto clearregion = createMenuItem([this]()
             { 
-                m_gm->exFIFO.push([this]()
-                {
-                    m_gm->clearRegionAudio();
-                });
+                m_gm->exFIFO.push(XGranularModule::makeCommand(XGranularModule::ACT_CLEAR_REGION));
             }
             ,"Clear active region audio");
             targmenu->addChild(clearregion);
@@ -685,10 +689,10 @@ public:
         auto procaudiomenu = createSubmenuItem("Process audio","",procaudiomenufunc);
         menu->addChild(procaudiomenu);
         
-        auto clearmarksItem = createSafeMenuItem([this]()
+        auto clearmarksItem = createMenuItem([this]()
         {
-            m_gm->m_eng.clearMarkers();
-        },"Clear all markers",m_gm->exFIFO);
+            m_gm->exFIFO.push(XGranularModule::makeCommand(XGranularModule::ACT_CLEAR_ALL_MARKERS));
+        },"Clear all markers");
         menu->addChild(clearmarksItem);
         
         
@@ -699,10 +703,7 @@ public:
             {
                 auto it = createMenuItem([this,i,temp]()
                 {    
-                    m_gm->exFIFO.push([this,i,temp]()
-                    {
-                        m_gm->m_eng.addEquidistantMarkers(temp[i]);
-                    });
+                    m_gm->exFIFO.push(XGranularModule::makeCommand(XGranularModule::ACT_ADD_EQ_MARKERS,temp[i]));
                 },std::to_string(temp[i])+" markers");
                 targmenu->addChild(it);
             }
@@ -711,7 +712,7 @@ public:
         menu->addChild(markermenu);
         
         auto resetrec = createMenuItem([this]()
-        { m_gm->m_next_marker_action = XGranularModule::ACT_RESET_RECORD_HEAD; },"Reset record state");
+        { m_gm->exFIFO.push(XGranularModule::makeCommand(XGranularModule::ACT_RESET_RECORD_HEAD)); },"Reset record state");
         menu->addChild(resetrec);
         
         auto scrubopt = createMenuItem([this]()
@@ -730,6 +731,16 @@ public:
         }
         ,"Compensate volume for scrub mode",CHECKMARK(m_gm->m_eng.m_scrubber->m_compensate_volume == 1));
         menu->addChild(scrubopt);
+        // commands that didn't fit in the queue were dropped, so the user should know about them
+        int overflows = m_gm->exFIFO.getOverflowCount();
+        int deferrals = m_gm->exFIFO.getDeferralCount();
+        if (overflows > 0 || deferrals > 0)
+        {
+            MenuLabel* queueLabel = new MenuLabel();
+            queueLabel->text = "Dropped actions : "+std::to_string(overflows)
+                +", delayed : "+std::to_string(deferrals);
+            menu->addChild(queueLabel);
+        }
     }
     XGranularWidget(XGranularModule* m)
     {
@@ -808,9 +819,10 @@ public:
                 rectext =  "STOPPED  ";
             else rectext = "SCRUBBING";
             double scrubrate = m_gm->m_eng.m_scrubber->m_smoothed_out_gain;
-            sprintf(buf,"%d %d %f %s %d %f %f",
+            sprintf(buf,"%d %d %f %s %d %f %f Q %d/%d",
                 m_gm->graindebugcounter,m_gm->m_eng.m_gm->m_grainsUsed,scrubrate,
-                rectext.c_str(),src.m_peak_updates_counter,m_gm->m_curLoopSelect,m_gm->m_cur_playspeed);
+                rectext.c_str(),src.m_peak_updates_counter,m_gm->m_curLoopSelect,m_gm->m_cur_playspeed,
+                m_gm->exFIFO.getOverflowCount(),m_gm->exFIFO.getDeferralCount());
             nvgFontSize(args.vg, 15);
             nvgFontFaceId(args.vg, getDefaultFont(0)->handle);
             nvgTextLetterSpacing(args.vg, -1);
@@ -840,6 +852,7 @@ Model* modelXGranular = createModel<XGranularModule, XGranularWidget>("XGranular
 #include "claphost.h"
 #include <ncurses.h>
 #include "nocturncontrol.h"
+#include "halfband.h"
 
 class AudioEngine
 {
@@ -861,6 +874,7 @@ public:
         m_drywetsmoother.setParameters(rack::dsp::BiquadFilter::LOWPASS_1POLE,10.0f/44100.0,1.0,1.0f);
         m_wsmorphsmoother.setParameters(rack::dsp::BiquadFilter::LOWPASS_1POLE,10.0f/44100.0,1.0,1.0f);
         m_mastergainsmoother.setParameters(rack::dsp::BiquadFilter::LOWPASS_1POLE,10.0f/44100.0,1.0,1.0f);
+        m_wsoversampler.setFactor(2);
         PaError err;
         err = Pa_Initialize();
         if (err == paNoError)
@@ -1046,10 +1060,18 @@ public:
             procbuf[0] = m_dc_blockers[0].process(procbuf[0]);
             procbuf[1] = m_dc_blockers[1].process(procbuf[1]);
             float outgain = m_mastergainsmoother.process(mastergain);
-            // clip/saturate (would ideally need some oversampling for this...)
+            // clip/saturate at 2x the sample rate, both channels in the same oversampler
             float morpha = m_wsmorphsmoother.process(m_par_waveshapemorph);
-            procbuf[0] = waveShape(procbuf[0]*outgain,1.0f);
-            procbuf[1] = waveShape(procbuf[1]*outgain,1.0f);
+            simd::float_4 osbuf[2];
+            m_wsoversampler.upsample(simd::float_4(procbuf[0]*outgain,procbuf[1]*outgain,0.0f,0.0f),osbuf);
+            for (int j=0;j<2;++j)
+            {
+                osbuf[j][0] = waveShape(osbuf[j][0],1.0f);
+                osbuf[j][1] = waveShape(osbuf[j][1],1.0f);
+            }
+            simd::float_4 shaped = m_wsoversampler.downsample(osbuf);
+            procbuf[0] = shaped[0];
+            procbuf[1] = shaped[1];
             float mid = 0.5f*(procbuf[0]+procbuf[1]);
             float side = 0.5f*(procbuf[1]-procbuf[0]);
             side *= panspread;  
@@ -1198,6 +1220,7 @@ public:
     dsp::BiquadFilter m_drywetsmoother;
     dsp::BiquadFilter m_wsmorphsmoother;
     dsp::BiquadFilter m_mastergainsmoother;
+    HalfBandOversampler m_wsoversampler;
     
     choc::fifo::SingleReaderSingleWriterFIFO<std::function<void(void)>> exFIFO;
     dsp::SlewLimiter m_cpu_smoother;
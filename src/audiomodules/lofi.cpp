@@ -1,5 +1,6 @@
 #include "plugin.hpp"
 #include "helperwidgets.h"
+#include "halfband.h"
 #include <random>
 
 inline float sign(float in)
@@ -180,90 +181,200 @@ private:
     int m_repeatLen = 0;
 };
 
-inline float sin_dist(float in)
+// Shared tables of the distortion shapers, the sine and the random staircase curve
+class LOFIShaperTables
 {
-    return std::sin(3.141592653*2*in);
-}
+public:
+    static const int sineSize = 4096;
+    static const int randSize = 4096;
+    static const LOFIShaperTables& get()
+    {
+        static LOFIShaperTables tables;
+        return tables;
+    }
+    // sin(2*pi*x)
+    simd::float_4 sine(simd::float_4 x) const
+    {
+        simd::float_4 pos = (x-simd::floor(x))*(float)sineSize;
+        simd::float_4 result;
+        for (int i=0;i<4;++i)
+        {
+            int index = std::min((int)pos[i],sineSize-1);
+            float frac = pos[i]-index;
+            result[i] = m_sine[index]+(m_sine[index+1]-m_sine[index])*frac;
+        }
+        return result;
+    }
+    // The random curve covers the -32..32 input range, so that it works as a noise source
+    // with high drive
+    simd::float_4 rand(simd::float_4 x) const
+    {
+        simd::float_4 pos = (simd::clamp(x,-32.0f,32.0f)+32.0f)*(float)(randSize/64-1);
+        simd::float_4 result;
+        for (int i=0;i<4;++i)
+            result[i] = m_rand[std::min((int)pos[i],randSize-1)];
+        return result;
+    }
+private:
+    LOFIShaperTables()
+    {
+        for (int i=0;i<sineSize+1;++i)
+            m_sine[i] = std::sin(2.0*g_pi/sineSize*i);
+        std::mt19937 gen(912477);
+        std::uniform_int_distribution<int> dist(-30,30);
+        for (int i=0;i<randSize;++i)
+            m_rand[i] = rescale(dist(gen),-30,30,-1.0f,1.0f);
+    }
+    float m_sine[sineSize+1];
+    float m_rand[randSize];
+};
+
+// The distortion shapers process 4 samples at a time. The smooth shapers have a first order
+// antiderivative antialiased version, which needs the previous input sample of each lane.
+// Below the input difference threshold the shaper is evaluated at the midpoint.
+const float g_adaaThreshold = 1.0e-3f;
 
-inline float sym_reflect(float in)
+struct SoftClipShaper
 {
-    return sign(in)*2.0f*std::fabs(in/2.0f-std::round(in/2.0f));
-}
+    static simd::float_4 process(simd::float_4 x, const LOFIShaperTables&)
+    {
+        x = simd::clamp(x,-1.0f,1.0f);
+        return x-x*x*x*(1.0f/3.0f);
+    }
+    static simd::float_4 antiderivative(simd::float_4 x)
+    {
+        simd::float_4 c = simd::clamp(x,-1.0f,1.0f);
+        simd::float_4 inside = c*c*(0.5f-c*c*(1.0f/12.0f));
+        simd::float_4 outside = (2.0f/3.0f)*simd::abs(x)-0.25f;
+        return simd::ifelse(simd::abs(x)<=1.0f,inside,outside);
+    }
+    static simd::float_4 processAA(simd::float_4 x, simd::float_4 xprev, const LOFIShaperTables& t)
+    {
+        simd::float_4 dx = x-xprev;
+        simd::float_4 aa = (antiderivative(x)-antiderivative(xprev))/dx;
+        simd::float_4 result = simd::ifelse(simd::abs(dx)<g_adaaThreshold,process(0.5f*(x+xprev),t),aa);
+        // the antiderivative loses precision for large inputs, but both samples clipping
+        // to the same side gives the clipped value anyway
+        result = simd::ifelse((x>1.0f)&(xprev>1.0f),2.0f/3.0f,result);
+        return simd::ifelse((x<-1.0f)&(xprev<-1.0f),-2.0f/3.0f,result);
+    }
+};
 
-inline float sym_wrap(float in)
+struct HardClipShaper
 {
-    return 2.0f*(in/2.0f-std::round(in/2.0f));
-}
+    static simd::float_4 process(simd::float_4 x, const LOFIShaperTables&)
+    {
+        return simd::clamp(x,-1.0f,1.0f);
+    }
+    static simd::float_4 processAA(simd::float_4 x, simd::float_4, const LOFIShaperTables& t)
+    {
+        return process(x,t);
+    }
+};
 
-struct RandShaper
+struct ReflectShaper
 {
-    std::vector<float> m_shapefunc;
-    RandShaper()
+    static simd::float_4 process(simd::float_4 x, const LOFIShaperTables&)
     {
-        m_shapefunc.resize(4096);
-        std::mt19937 gen(912477);
-        std::uniform_int_distribution<int> dist(-30,30);
-        for (int i=0;i<m_shapefunc.size();++i)
-            m_shapefunc[i]=rescale(dist(gen),-30,30,-1.0f,1.0f);
+        simd::float_4 h = 0.5f*x;
+        simd::float_4 sign = simd::ifelse(x<0.0f,-1.0f,1.0f);
+        return sign*2.0f*simd::abs(h-simd::floor(h+0.5f));
     }
-    inline float process(float in)
+    static simd::float_4 processAA(simd::float_4 x, simd::float_4, const LOFIShaperTables& t)
     {
-        in = clamp(in,-32.0f,32.0f)+32.0f;
-        int index = in * (m_shapefunc.size()/64-1);
-        index = clamp(index,0,m_shapefunc.size()-1);
-        return m_shapefunc[index];    
+        return process(x,t);
     }
 };
 
-inline float distort(float in, float th, float type, RandShaper& rshaper)
+struct WrapShaper
 {
-    int index0 = std::floor(type);
-    int index1 = index0+1;
-    float frac = type-index0;
-    float distsamples[7];
-    if (index0 == 0)
-    {
-        distsamples[0] = soft_clip(in);
-        distsamples[1] = clamp(in,-th,th);
+    static simd::float_4 process(simd::float_4 x, const LOFIShaperTables&)
+    {
+        simd::float_4 h = 0.5f*x;
+        return 2.0f*(h-simd::floor(h+0.5f));
     }
-    else if (index0 == 1)
+    static simd::float_4 processAA(simd::float_4 x, simd::float_4, const LOFIShaperTables& t)
     {
-        distsamples[1] = clamp(in,-th,th);
-        distsamples[2] = sym_reflect(in);
+        return process(x,t);
     }
-    else if (index0 == 2)
+};
+
+struct SineShaper
+{
+    static simd::float_4 process(simd::float_4 x, const LOFIShaperTables& t)
     {
-        distsamples[2] = sym_reflect(in);
-        distsamples[3] = sym_wrap(in);
+        return t.sine(x);
     }
-    else if (index0 == 3)
-    {
-        distsamples[3] = sym_wrap(in);
-        //distsamples[3] = wrap_value(-th,in,th);
-        if (frac>0.0f) 
-            distsamples[4] = sin_dist(in);
-        else
-            distsamples[4] = distsamples[3];
-    } 
-    else if (index0 == 4)
-    {
-        distsamples[4] = sin_dist(in);
-        if (frac>0.0f)
-            distsamples[5] = rshaper.process(in);
-        else
-            distsamples[5] = distsamples[4];
+    // the antiderivative -cos(2*pi*x)/(2*pi) is periodic, so it stays small
+    static simd::float_4 processAA(simd::float_4 x, simd::float_4 xprev, const LOFIShaperTables& t)
+    {
+        simd::float_4 dx = x-xprev;
+        simd::float_4 aa = (t.sine(xprev+0.25f)-t.sine(x+0.25f))*(float)(1.0/(2.0*g_pi))/dx;
+        return simd::ifelse(simd::abs(dx)<g_adaaThreshold,t.sine(0.5f*(x+xprev)),aa);
     }
-    else if (index0 == 5)
+};
+
+struct RandomShaper
+{
+    static simd::float_4 process(simd::float_4 x, const LOFIShaperTables& t)
     {
-        distsamples[5] = rshaper.process(in);
-        distsamples[6] = distsamples[5];
+        return t.rand(x);
     }
-    
-    float y0 = distsamples[index0];
-    float y1 = distsamples[index1];
+    static simd::float_4 processAA(simd::float_4 x, simd::float_4, const LOFIShaperTables& t)
+    {
+        return t.rand(x);
+    }
+};
+
+// The distortion type morphs between adjacent shapers. The shaper pair is resolved into a
+// function once per processed sample, so that the oversampled loop doesn't branch on the type.
+typedef simd::float_4 (*DistortFunc)(simd::float_4 x, simd::float_4 xprev, float frac);
+
+template<class Shaper, bool Antialiased>
+inline simd::float_4 distortSingle(simd::float_4 x, simd::float_4 xprev, float)
+{
+    const LOFIShaperTables& t = LOFIShaperTables::get();
+    return Antialiased ? Shaper::processAA(x,xprev,t) : Shaper::process(x,t);
+}
+
+template<class Shaper0, class Shaper1, bool Antialiased>
+inline simd::float_4 distortPair(simd::float_4 x, simd::float_4 xprev, float frac)
+{
+    const LOFIShaperTables& t = LOFIShaperTables::get();
+    simd::float_4 y0 = Antialiased ? Shaper0::processAA(x,xprev,t) : Shaper0::process(x,t);
+    simd::float_4 y1 = Antialiased ? Shaper1::processAA(x,xprev,t) : Shaper1::process(x,t);
     return y0+(y1-y0)*frac;
 }
 
+// type is 0..5, the fractional part goes to frac
+template<bool Antialiased>
+inline DistortFunc getDistortFunc(float type, float& frac)
+{
+    static const DistortFunc singles[6] =
+    {
+        distortSingle<SoftClipShaper,Antialiased>,
+        distortSingle<HardClipShaper,Antialiased>,
+        distortSingle<ReflectShaper,Antialiased>,
+        distortSingle<WrapShaper,Antialiased>,
+        distortSingle<SineShaper,Antialiased>,
+        distortSingle<RandomShaper,Antialiased>
+    };
+    static const DistortFunc pairs[5] =
+    {
+        distortPair<SoftClipShaper,HardClipShaper,Antialiased>,
+        distortPair<HardClipShaper,ReflectShaper,Antialiased>,
+        distortPair<ReflectShaper,WrapShaper,Antialiased>,
+        distortPair<WrapShaper,SineShaper,Antialiased>,
+        distortPair<SineShaper,RandomShaper,Antialiased>
+    };
+    type = type < 0.0f ? 0.0f : (type > 5.0f ? 5.0f : type);
+    int index = type;
+    frac = type-index;
+    if (frac == 0.0f || index == 5)
+        return singles[index];
+    return pairs[index];
+}
+
 inline float getBitDepthFromNormalized(float x)
 {
     if (x>=0.1 && x<=0.9)
@@ -275,24 +386,46 @@ inline float getBitDepthFromNormalized(float x)
     return 16.0f;           
 }
 
-template<int Factor, int Qual>
+// Runs the distortion at 8x or 16x the sample rate. The engine is mono, so only the first
+// channel of the half-band oversampler carries the signal.
 struct OverSampler
 {
     OverSampler()
     {
-        for (int i=0;i<Factor;++i)
+        for (int i=0;i<HalfBandOversampler::maxFactor+1;++i)
             buffer[i] = 0.0f;
+        m_oversampler.setFactor(8);
     }
-    float process(float in, float th, float type, RandShaper& shaper)
+    void setFactor(int f)
     {
-        us.process(in,buffer);
-        for (int i=0;i<Factor;++i)
-            buffer[i] = distort(buffer[i],th,type,shaper);
-        return 2.0f*ds.process(buffer);
+        m_oversampler.setFactor(f);
     }
-    dsp::Upsampler<Factor,Qual> us;
-    dsp::Decimator<Factor,Qual> ds;
-    float buffer[Factor];
+    float getLatency() const
+    {
+        return m_oversampler.getLatency();
+    }
+    float process(float in, DistortFunc func, float frac)
+    {
+        int factor = m_oversampler.getFactor();
+        simd::float_4 osbuf[HalfBandOversampler::maxFactor];
+        m_oversampler.upsample(simd::float_4(in),osbuf);
+        // the shapers take 4 consecutive samples, buffer[0] is the last sample of the
+        // previous call for the antialiased shapers
+        for (int i=0;i<factor;++i)
+            buffer[i+1] = osbuf[i][0];
+        for (int i=0;i<factor;i+=4)
+        {
+            simd::float_4 x = simd::float_4::load(&buffer[i+1]);
+            simd::float_4 xprev = simd::float_4::load(&buffer[i]);
+            simd::float_4 y = func(x,xprev,frac);
+            for (int j=0;j<4;++j)
+                osbuf[i+j] = y[j];
+        }
+        buffer[0] = buffer[factor];
+        return m_oversampler.downsample(osbuf)[0];
+    }
+    HalfBandOversampler m_oversampler;
+    float buffer[HalfBandOversampler::maxFactor+1];
 };
 
 class LOFIEngine
@@ -307,27 +440,25 @@ public:
         in+=dcoffs;
         float driven = drive*in;
         float oversampledriven = 0.0f;
+        float frac = 0.0f;
+        DistortFunc distfunc = getDistortFunc<false>(dtype,frac);
+        m_oversampler.setFactor(osquality == 0 ? 8 : 16);
         if (oversample>0.0f) // only oversample when oversampled signal is going to be mixed in
         {
-            /*
-            float osarr[8];
-            m_upsampler.process(driven,osarr);
-            for (int i=0;i<8;++i)
-                osarr[i] = distort(osarr[i],1.0f,dtype,m_randshaper);
-            oversampledriven = 2.0f*m_downsampler.process(osarr);
-            */
-           switch(osquality) 
-           {
-                case 0:
-                    oversampledriven = m_oversampler1.process(driven,1.0f,dtype,m_randshaper);
-                    break;
-                case 1:
-                    oversampledriven = m_oversampler2.process(driven,1.0f,dtype,m_randshaper);
-                    break;
-           }
+            DistortFunc osfunc = getDistortFunc<true>(dtype,frac);
+            oversampledriven = m_oversampler.process(driven,osfunc,frac);
         }
         
-        driven = distort(driven,1.0f,dtype,m_randshaper);
+        driven = distfunc(driven,driven,frac)[0];
+        // delayed by the oversampler latency while the oversampled signal is mixed in, so that
+        // mixing the paths doesn't comb filter. Without oversampling the output has no latency.
+        m_delayLine[m_delayPos] = driven;
+        if (oversample>0.0f)
+        {
+            int delay = std::round(m_oversampler.getLatency());
+            driven = m_delayLine[(m_delayPos-delay) & (delayLineSize-1)];
+        }
+        m_delayPos = (m_delayPos+1) & (delayLineSize-1);
         float drivemix = (1.0f-oversample) * driven + oversample * oversampledriven;
         m_reducer.setRates(insamplerate,insamplerate/srdiv);
         float reduced = m_reducer.process(drivemix);
@@ -341,15 +472,12 @@ public:
         return clamp(glitch,-1.0f,1.0f);
     }
     bool glitchActive() { return m_glitcher.glitchActive(); }
-    RandShaper m_randshaper;
 private:
     SampleRateReducer m_reducer;
-    dsp::Upsampler<8,2> m_upsampler;
-    dsp::Decimator<8,2> m_downsampler;
-    OverSampler<8,2> m_oversampler1;
-    OverSampler<8,4> m_oversampler2;
-    OverSampler<16,2> m_oversampler3;
-    OverSampler<16,4> m_oversampler4;
+    OverSampler m_oversampler;
+    static const int delayLineSize = 64;
+    float m_delayLine[delayLineSize] = {};
+    int m_delayPos = 0;
     GlitchGenerator m_glitcher;
     
 };
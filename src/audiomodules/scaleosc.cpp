@@ -19,7 +19,10 @@
 #include <osdialog.h>
 #endif
 #include <thread>
+#include <map>
+#include <sys/stat.h>
 #include "scalehelpers.h"
+#include "halfband.h"
 
 std::vector<std::string> split(const std::string& s, const std::string& separator, size_t maxTokens) {
 	if (separator.empty())
@@ -225,6 +228,54 @@ inline simd::float_4 chebyshev(simd::float_4 x, const std::array<float,CoeffSz>&
 	return out;
 }
 
+// The Chebyshev waveshaper curves of the morph rows, tabulated over the -1..1 input range.
+// The morph interpolates the polynomial coefficients linearly, so interpolating between the
+// curves of two rows gives the same result as evaluating the interpolated polynomial.
+class ChebyShaperTable
+{
+public:
+    static const int tableSize = 2048;
+    static const int maxRows = 9;
+    ChebyShaperTable(const float coeffs[][16], int numrows)
+    {
+        m_numRows = std::min(numrows,(int)maxRows);
+        std::array<float,16> rowcoeffs;
+        for (int i=0;i<m_numRows;++i)
+        {
+            for (int j=0;j<16;++j)
+                rowcoeffs[j] = coeffs[i][j];
+            // 4 entries at a time, this is run for every ScaleOscillator instance
+            for (int j=0;j<tableSize;j+=4)
+            {
+                simd::float_4 x = simd::float_4(j,j+1,j+2,j+3)*(2.0f/tableSize)-1.0f;
+                chebyshev(x,rowcoeffs,16).store(&m_table[i][j]);
+            }
+            m_table[i][tableSize] = chebyshev(1.0f,rowcoeffs,16);
+        }
+    }
+    // Bilinear lookup between the rows row and row+1
+    simd::float_4 process(simd::float_4 x, int row, float rowfrac) const
+    {
+        int row1 = std::min(row+1,m_numRows-1);
+        simd::float_4 pos = (simd::clamp(x,-1.0f,1.0f)+1.0f)*(0.5f*tableSize);
+        simd::float_4 result;
+        for (int i=0;i<4;++i)
+        {
+            int index = std::min((int)pos[i],tableSize-1);
+            float frac = pos[i]-index;
+            float y0 = m_table[row][index];
+            float y1 = m_table[row1][index];
+            y0 += (m_table[row][index+1]-y0)*frac;
+            y1 += (m_table[row1][index+1]-y1)*frac;
+            result[i] = y0+(y1-y0)*rowfrac;
+        }
+        return simd::clamp(result,-1.0f,1.0f);
+    }
+private:
+    float m_table[maxRows][tableSize+1];
+    int m_numRows = 0;
+};
+
 inline simd::float_4 fmodex(simd::float_4 x, float y=1.0f)
 {
     x = simd::fmod(x,y);
@@ -243,8 +294,7 @@ inline simd::float_4 reflectx(simd::float_4 x)
     return -1.0f + 2.0f * simd::abs(temp3-1.0f);
 }
 
-template<typename GridT>
-inline void quantize_to_scale(float x, const std::vector<GridT>& g,
+inline void quantize_to_scale(float x, const QuantizeScale& g,
     float& out1, float& out2, float& outdiff)
 {
     if (g.empty()) // special handling for no scale
@@ -262,14 +312,14 @@ inline void quantize_to_scale(float x, const std::vector<GridT>& g,
         outdiff = m*(1.0f/maxd);
         return;
     }
-    auto t1=std::upper_bound(std::begin(g),std::end(g),x);
-    if (t1<std::end(g)-1)
+    size_t t1 = g.upperBound(x);
+    if (t1+1<g.size())
     {
-        auto t0=std::begin(g);
-        if (t1>std::begin(g))
-            t0=t1-1;
-        out1 = *t0;
-        out2 = *t1;
+        size_t t0 = 0;
+        if (t1>0)
+            t0 = t1-1;
+        out1 = g[t0];
+        out2 = g[t1];
         if (out1 == out2)
         {
             outdiff = 0.0f;
@@ -278,8 +328,8 @@ inline void quantize_to_scale(float x, const std::vector<GridT>& g,
         outdiff = rescale(x,out1,out2,0.0,1.0);
         return;
     }
-    out1 = g.back();
-    out2 = g.back();
+    out1 = g[g.size()-1];
+    out2 = g[g.size()-1];
     outdiff = 1.0f;
 }
 
@@ -343,10 +393,10 @@ public:
     {
         amt = clamp(amt,0.0f,1.0f);
         m_warp_mode = mode;
-        m_warp_steps = std::pow(2.0f,2.0f+(1.0f-amt)*4.0f);
+        m_warp_steps = fastExp2(2.0f+(1.0f-amt)*4.0f);
         if (m_warp_mode<2)
-            m_warp = std::pow(amt,2.0f);
-        else m_warp = 1.0f-std::pow(1.0f-amt,2.0f);
+            m_warp = amt*amt;
+        else m_warp = 1.0f-(1.0f-amt)*(1.0f-amt);
     }
     simd::float_4 processSample(float)
     {
@@ -497,6 +547,7 @@ public:
         double root_freq = dsp::FREQ_C4/16.0;
         try
             {
+                path = fn;
                 auto thescale = Tunings::readSCLFile(fn);
                 pitches = semitonesFromScalaScale<double>(thescale,0.0,128.0);
                 name = thescale.name;
@@ -509,81 +560,90 @@ public:
     }
     std::vector<double> pitches;
     std::string name;
+    std::string path;
+    // built from pitches by makeSharedScale
+    std::shared_ptr<const QuantizeScale> prepared;
 };
 
+inline std::shared_ptr<const KlangScale> makeSharedScale(KlangScale scale)
+{
+    scale.prepared = std::make_shared<const QuantizeScale>(scale.pitches);
+    return std::make_shared<const KlangScale>(std::move(scale));
+}
+
 class KlangScaleBank
 {
 public:
-    std::vector<KlangScale> scales;
+    std::vector<std::shared_ptr<const KlangScale>> scales;
     std::string description;
 };
 
-class ScaleOscillator
+// Process-wide store of the parsed scales, shared by all the ScaleOscillator instances.
+// Scala files are parsed once and parsed again only if their modification time has changed.
+// The built-in banks are built on a background thread and then handed to the audio threads
+// with an atomic pointer. They are never modified or freed after that.
+class ScalaScaleRepository
 {
 public:
-    float m_gain_smooth_amt = 0.999f;
-    KlangScale fallBackScale;
-    alignas(16) std::array<float,32> mChebyCoeffs;
-    KlangScale& getScaleChecked(int banknum, int scalenum)
+    static const int numBuiltinBanks = 3;
+    static ScalaScaleRepository& get()
+    {
+        static ScalaScaleRepository repo;
+        return repo;
+    }
+    ~ScalaScaleRepository()
+    {
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+    std::shared_ptr<const KlangScale> getScale(const std::string& path)
+    {
+        time_t mtime = 0;
+        struct stat st;
+        if (stat(path.c_str(),&st) == 0)
+            mtime = st.st_mtime;
+        std::lock_guard<std::mutex> locker(m_mutex);
+        auto it = m_cache.find(path);
+        if (it != m_cache.end() && it->second.first == mtime)
+            return it->second.second;
+        auto scale = makeSharedScale(KlangScale(path));
+        m_cache[path] = std::make_pair(mtime,scale);
+        return scale;
+    }
+    // Starts building the built-in banks, later calls do nothing
+    void requestBuiltinBanks(std::string dir)
     {
-        if (banknum>=0 && banknum<m_all_banks.size())
+        std::call_once(m_started,[this,dir]()
         {
-            auto& curbank = m_all_banks[banknum];
-            if (scalenum>=0 && scalenum<curbank.scales.size())
+            m_thread = std::thread([this,dir]()
             {
-                return curbank.scales[scalenum];
-            }
-        }
-        return fallBackScale;
+                m_builtin_storage = buildBuiltinBanks(dir);
+                m_builtins.store(m_builtin_storage.get());
+            });
+        });
     }
-    KlangScale& getCurrentScale()
+    // Returns nullptr until the banks have been built, can be called from the audio thread
+    const std::vector<KlangScaleBank>* getBuiltinBanks() const
     {
-        return getScaleChecked(m_cur_bank,m_curScale);
+        return m_builtins.load();
     }
-    std::string getScaleName()
+    void waitForBuiltinBanks() const
     {
-        auto& s = getCurrentScale();
-        if (s.name.empty()==false)
-            return s.name;
-        return "Invalid scale index";
+        while (getBuiltinBanks() == nullptr)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
-    
-    
-    ScaleOscillator()
+private:
+    ScalaScaleRepository() {}
+    std::unique_ptr<std::vector<KlangScaleBank>> buildBuiltinBanks(std::string dir)
     {
-        for (int i=0;i<mChebyCoeffs.size();++i)
-            mChebyCoeffs[i] = 0.0f;
-        m_fold_smoother.setAmount(0.99);
-        for (int i=0;i<m_oscils.size();++i)
-        {
-            m_oscils[i].prepare(1,44100.0f);
-            m_osc_gain_smoothers[i*2+0].setAmount(m_gain_smooth_amt);
-            m_osc_gain_smoothers[i*2+1].setAmount(m_gain_smooth_amt);
-            m_osc_freq_smoothers[i*2+0].setAmount(0.99);
-            m_osc_freq_smoothers[i*2+1].setAmount(0.99);
-            m_osc_gains[i*2+0] = 1.0f;
-            m_osc_gains[i*2+1] = 1.0f;
-            m_osc_freqs[i*2+0] = 440.0f;
-            m_osc_freqs[i*2+1] = 440.0f;
-            fms[i] = 0.0f;
-            m_unquant_freqs[i] = 1.0f;
-        }
-        m_norm_smoother.setAmount(0.999);
-        
+        std::unique_ptr<std::vector<KlangScaleBank>> banks(new std::vector<KlangScaleBank>);
         KlangScaleBank bank_a;
         bank_a.description = "Just intoned stacked intervals";
         KlangScale continuumScale;
         continuumScale.name = "Continuum";
-        bank_a.scales.push_back(continuumScale);
+        bank_a.scales.push_back(makeSharedScale(continuumScale));
         
         std::vector<std::string> scalafiles;
-        #ifndef RAPIHEADLESS
-        std::string dir = asset::plugin(pluginInstance, "res/scala_scales");
-        #else
-        //std::string dir = "/Users/teemu/codeprojects/vcv/XenakiosModules/res/scala_scales";
-        std::string dir = "../../res/scala_scales";
-        
-        #endif
         scalafiles.push_back(dir+"/syntonic_comma.scl");
         scalafiles.push_back(dir+"/major_tone_ji.scl");
         scalafiles.push_back(dir+"/minor_third_ji.scl");
@@ -600,9 +660,9 @@ public:
 
         for(auto& fn : scalafiles)
         {
-            bank_a.scales.emplace_back(fn);
+            bank_a.scales.push_back(getScale(fn));
         }
-        m_all_banks.push_back(bank_a);
+        banks->push_back(bank_a);
         scalafiles.clear();
         KlangScaleBank bank_b;
         bank_b.description = "Sundry scales";
@@ -630,7 +690,7 @@ public:
         scalafiles.push_back(dir+"/weird01.scl");
         for(auto& fn : scalafiles)
         {
-            bank_b.scales.emplace_back(fn);
+            bank_b.scales.push_back(getScale(fn));
         }
         double root_freq = dsp::FREQ_C4/8.0;
         double freq = root_freq;
@@ -646,7 +706,7 @@ public:
             scale.pitches.push_back(p);
             ++i;
         }
-        bank_b.scales.push_back(scale);
+        bank_b.scales.push_back(makeSharedScale(scale));
         freq = root_freq;
         scale = KlangScale();
         scale.name = "Pi divided by 8";
@@ -663,7 +723,7 @@ public:
             scale.pitches.push_back(p);
             ++i;
         }
-        bank_b.scales.push_back(scale);
+        bank_b.scales.push_back(makeSharedScale(scale));
 
         scale = KlangScale();
         scale.name = "Pi divided by 13";
@@ -678,7 +738,7 @@ public:
             scale.pitches.push_back(p);
             ++i;
         }
-        bank_b.scales.push_back(scale);
+        bank_b.scales.push_back(makeSharedScale(scale));
 
         scale = KlangScale();
         scale.name = "e divided by 9";
@@ -693,9 +753,9 @@ public:
             scale.pitches.push_back(p);
             ++i;
         }
-        bank_b.scales.push_back(scale);
+        bank_b.scales.push_back(makeSharedScale(scale));
 
-        m_all_banks.push_back(bank_b);
+        banks->push_back(bank_b);
         scalafiles.clear();
         
         KlangScaleBank bank_c;
@@ -711,26 +771,120 @@ public:
         
         for(auto& fn : scalafiles)
         {
-            bank_c.scales.emplace_back(fn);
+            bank_c.scales.push_back(getScale(fn));
+        }
+        banks->push_back(bank_c);
+        return banks;
+    }
+    std::mutex m_mutex;
+    std::map<std::string,std::pair<time_t,std::shared_ptr<const KlangScale>>> m_cache;
+    std::unique_ptr<std::vector<KlangScaleBank>> m_builtin_storage;
+    std::atomic<const std::vector<KlangScaleBank>*> m_builtins{nullptr};
+    std::once_flag m_started;
+    std::thread m_thread;
+};
+
+// Immutable snapshot of the user scale bank, read by the audio thread
+class KlangScaleSet
+{
+public:
+    std::vector<std::vector<std::shared_ptr<const QuantizeScale>>> banks;
+    QuantizeScale fallBack;
+    const QuantizeScale* get(int banknum, int scalenum) const
+    {
+        if (banknum>=0 && banknum<banks.size())
+        {
+            auto& curbank = banks[banknum];
+            if (scalenum>=0 && scalenum<curbank.size())
+                return curbank[scalenum].get();
+        }
+        return &fallBack;
+    }
+};
+
+class ScaleOscillator
+{
+public:
+    float m_gain_smooth_amt = 0.999f;
+    KlangScale fallBackScale;
+    alignas(16) std::array<float,32> mChebyCoeffs;
+    // Returns nullptr while the built-in banks are still loading
+    const KlangScaleBank* getBank(int banknum)
+    {
+        if (banknum == ScalaScaleRepository::numBuiltinBanks)
+            return &m_userBank;
+        auto builtins = ScalaScaleRepository::get().getBuiltinBanks();
+        if (builtins && banknum>=0 && banknum<builtins->size())
+            return &(*builtins)[banknum];
+        return nullptr;
+    }
+    int getNumScales(int banknum)
+    {
+        auto bank = getBank(banknum);
+        if (bank)
+            return bank->scales.size();
+        return 0;
+    }
+    const KlangScale& getScaleChecked(int banknum, int scalenum)
+    {
+        auto bank = getBank(banknum);
+        if (bank && scalenum>=0 && scalenum<bank->scales.size())
+            return *bank->scales[scalenum];
+        return fallBackScale;
+    }
+    const KlangScale& getCurrentScale()
+    {
+        return getScaleChecked(m_cur_bank,m_curScale);
+    }
+    std::string getScaleName()
+    {
+        if (getBank(m_cur_bank)==nullptr)
+            return "Loading scales...";
+        auto& s = getCurrentScale();
+        if (s.name.empty()==false)
+            return s.name;
+        return "Invalid scale index";
+    }
+    
+    
+    ScaleOscillator()
+    {
+        for (int i=0;i<mChebyCoeffs.size();++i)
+            mChebyCoeffs[i] = 0.0f;
+        m_fold_smoother.setAmount(0.99);
+        for (int i=0;i<m_oscils.size();++i)
+        {
+            m_oscils[i].prepare(1,44100.0f);
+            m_osc_gains[i*2+0] = 1.0f;
+            m_osc_gains[i*2+1] = 1.0f;
+            m_osc_freqs[i*2+0] = 440.0f;
+            m_osc_freqs[i*2+1] = 440.0f;
+            fms[i] = 0.0f;
+            m_unquant_freqs[i] = 1.0f;
         }
-        m_all_banks.push_back(bank_c);
-        KlangScaleBank bank_d;
-        bank_d.description = "User bank";
         for (int i=0;i<8;++i)
         {
-            bank_d.scales.push_back(KlangScale());
-            bank_d.scales.back().name = "Slot "+std::to_string(i+1);
+            m_osc_gain_smoothers[i].setAmount(m_gain_smooth_amt);
+            m_osc_freq_smoothers[i].setAmount(0.99);
         }
-        m_all_banks.push_back(bank_d);
+        m_norm_smoother.setAmount(0.999);
         
-        m_scale.reserve(2048);
-        m_scale = getScaleChecked(0,1).pitches;
-        for (int i=0;i<mExpFMPowerTable.size();++i)
+        m_userBank.description = "User bank";
+        for (int i=0;i<8;++i)
         {
-            float x = rescale(i,0,mExpFMPowerTable.size()-1,-60.0f,60.0f);
-            x = std::pow(2.0f,x/12.0f);
-            mExpFMPowerTable[i] = x;
+            KlangScale scale;
+            scale.name = "Slot "+std::to_string(i+1);
+            m_userBank.scales.push_back(makeSharedScale(scale));
         }
+        #ifndef RAPIHEADLESS
+        std::string dir = asset::plugin(pluginInstance, "res/scala_scales");
+        #else
+        //std::string dir = "/Users/teemu/codeprojects/vcv/XenakiosModules/res/scala_scales";
+        std::string dir = "../../res/scala_scales";
+        
+        #endif
+        ScalaScaleRepository::get().requestBuiltinBanks(dir);
+        publishScales();
         mChebyMorphSmoother.setAmount(0.999);
         for (int i=0;i<chebyMorphCount+1;++i)
         {
@@ -756,12 +910,9 @@ public:
     }
     inline float getExpFMDepth(float semitones)
     {
-        float x = rescale(semitones,-60.0f,60.0f,0.0f,(float)mExpFMPowerTable.size()-1);
-        int index = x;
-        index = clamp(index,0,mExpFMPowerTable.size()-1);
-        return mExpFMPowerTable[index];
+        return fastExp2(semitones*(1.0f/12.0f));
     }
-    int getNumBanks() { return m_all_banks.size(); }
+    int getNumBanks() { return ScalaScaleRepository::numBuiltinBanks+1; }
     void loadChebyshevCoefficients(std::string fn)
     {
         // fill default morph table in case opening the file fails
@@ -829,6 +980,7 @@ public:
                 }
             }
         }
+        m_chebyTables.publish(std::make_shared<const ChebyShaperTable>(chebyMorphCoeffs,chebyMorphCount+1));
     }
     int m_pitchQuantizeMode = 0;
     void setPitchQuantizeMode(int m)
@@ -841,11 +993,8 @@ public:
         int lastoscili = m_active_oscils-1;
         if (lastoscili==0)
             lastoscili = 1;
-        if (mDoScaleChange==true)
-        {
-            mDoScaleChange = false;
-            m_scale = mScaleToChangeTo;
-        }
+        m_scale = lookupScale(m_cur_bank,m_curScale);
+        const QuantizeScale& scale = *m_scale;
         double rootf = rack::dsp::FREQ_C4/16.0;
         for (int i=0;i<m_active_oscils;++i)
         {
@@ -867,32 +1016,32 @@ public:
             if (m_pitchQuantizeMode == 0)
             {
                 pitch = 36.0f + rescale(normpos,0.0f,1.0f, m_root_pitch,m_root_pitch+(96.0f*m_spread));
-                quantize_to_scale(pitch,m_scale,p0,p1,diff);
+                quantize_to_scale(pitch,scale,p0,p1,diff);
             }
             else if (m_pitchQuantizeMode == 1) // get pitch directly from scale
             {
-                if (m_scale.empty() == false)
+                if (scale.empty() == false)
                 {
-                    float steproot = rescale(m_root_pitch,-36.0f,36.0f,0.0f,(m_scale.size()-1));
-                    float scalestepf = steproot + rescale(normpos,0.0f , 1.0f , 0.0f, (m_scale.size()-1)*m_spread);
-                    scalestepf = clamp(scalestepf,0.0f,m_scale.size()-1);
+                    float steproot = rescale(m_root_pitch,-36.0f,36.0f,0.0f,(scale.size()-1));
+                    float scalestepf = steproot + rescale(normpos,0.0f , 1.0f , 0.0f, (scale.size()-1)*m_spread);
+                    scalestepf = clamp(scalestepf,0.0f,scale.size()-1);
                     int scalestepi0 = scalestepf;
                     int scalestepi1 = scalestepi0 + 1;
-                    if (scalestepi1>m_scale.size()-1)
-                        scalestepi1 = m_scale.size()-1;
+                    if (scalestepi1>scale.size()-1)
+                        scalestepi1 = scale.size()-1;
                     diff = scalestepf-(int)scalestepf;
-                    p0 = m_scale[scalestepi0];
-                    p1 = m_scale[scalestepi1];
+                    p0 = scale[scalestepi0];
+                    p1 = scale[scalestepi1];
                 } else
                 {
                     pitch = 36.0f + rescale(normpos,0.0f,1.0f, m_root_pitch,m_root_pitch+(72.0f*m_spread));
-                    quantize_to_scale(pitch,m_scale,p0,p1,diff);
+                    quantize_to_scale(pitch,scale,p0,p1,diff);
                 }
                 
             }
             m_unquant_freqs[i] = pitch;
-            float f0 = rootf*std::pow(dsp::FREQ_SEMITONE,p0);
-            float f1 = rootf*std::pow(dsp::FREQ_SEMITONE,p1);
+            float f0 = rootf*fastExp2(p0*(1.0f/12.0f));
+            float f1 = rootf*fastExp2(p1*(1.0f/12.0f));
             if (mXFadeMode == 0)
                 xfades[i] = 0.0f;
             else if (mXFadeMode == 1)
@@ -1001,193 +1150,71 @@ public:
         }
     }
     std::array<float,16> fms;
+    static const int maxBlockSize = 64;
     void processNextFrame(float* outbuf, float samplerate)
     {
-        int oscilsused = 0;
-        int lastosci = m_active_oscils-1;
-        if (m_fm_algo<2)
-        {
-            float hz0 = m_osc_freq_smoothers[0].process(m_osc_freqs[0]);
-            float hz1 = m_osc_freq_smoothers[1].process(m_osc_freqs[1]);
-            m_oscils[0].setFrequencies(hz0,hz1,samplerate);
-        }
-            
-        else
+        float* outs[16];
+        for (int i=0;i<16;++i)
+            outs[i] = &outbuf[i];
+        processBlock(outs,1,samplerate);
+    }
+    // Renders nframes (at most maxBlockSize) samples of each of the 16 oscillators into out[0..15].
+    // The oscillator frequencies and gains set by updateOscFrequencies are used for the whole block.
+    void processBlock(float** out, int nframes, float samplerate)
+    {
+        nframes = std::min(nframes,maxBlockSize);
+        int osfactor = m_fold_oversampling.load();
+        if (osfactor != m_oversamplers[0].getFactor())
         {
-            float hz0 = m_osc_freq_smoothers[lastosci*2+0].process(m_osc_freqs[lastosci*2+0]);
-            float hz1 = m_osc_freq_smoothers[lastosci*2+1].process(m_osc_freqs[lastosci*2+1]);
-            m_oscils[lastosci].setFrequencies(hz0,hz1,samplerate);
+            for (auto& e : m_oversamplers)
+                e.setFactor(osfactor);
         }
-        float smorph = mChebyMorphSmoother.process(mChebyMorph);
-        if (m_fold_algo == 1) // && smorph>0.00001f)
+        for (int i=0;i<8;++i)
         {
-            const int h = chebyMorphCount-1;
-            int i0 = smorph * h;
-            int i1 = i0 + 1;
-            float temp = smorph * h;
-            float xfrac = temp - (int)temp;
-            /*
-            for (int i=0;i<16;++i)
-            {
-                float y0 = chebyMorphCoeffs[i0][i];
-                float y1 = chebyMorphCoeffs[i1][i];
-                float interpolated = y0+(y1-y0)*xfrac;
-                mChebyCoeffs[i] = interpolated;
-            }
-            */
-            
-            for (int i=0;i<16;i+=4)
-            {
-                simd::float_4 y0 = simd::float_4::load(&chebyMorphCoeffs[i0][i]);
-                simd::float_4 y1 = simd::float_4::load(&chebyMorphCoeffs[i1][i]);
-                simd::float_4 interpolated = y0 + (y1 - y0) * xfrac;
-                interpolated.store(&mChebyCoeffs[i]);
-            }
-            
-           /*
-           float xs0 = 0.0f;
-           float ys0 = rescale(smorph,0.0f,1.0f,1.0f,0.0f);
-           float xs1 = rescale(smorph,0.0f,1.0f,0.01f,1.0f);
-           float ys1 = 0.0f; //rescale(smorph,0.0f,1.0f,0.00f,0.25f);
-           //float gainshape = rescale(smorph,0.0f,1.0f,1.0f,0.125f);
-           float csum = 0.0f;
-           for (int i=0;i<16;++i)
-           {
-               float z0 = rescale((float)i,0,15,0.0f,1.0f);
-               float interpolated = rescale(z0,xs0,xs1,ys0,ys1);
-               mChebyCoeffs[i] = clamp(interpolated,0.0f,1.0f);
-               csum += mChebyCoeffs[i];
-           }
-           csum = 1.0f/csum;
-           for (int i=0;i<16;++i)
-           {
-               mChebyCoeffs[i] *= csum;
-           }
-           */
-            auto bfunc=[](float x, float middle, float width)
-            {
-                const float maxlev = 0.5f;
-                if (x<=0.0f)
-                    return maxlev;
-                float result = 0.0f;
-                float left = middle-width;
-                float right = middle+width;
-                if (x>=left && x<middle)
-                {
-                    result = rescale(x,left,middle,0.0f,maxlev);
-                } else if (x>=middle && x<right)
-                {
-                    result = rescale(x,middle,right,maxlev,0.0f);
-                }
-                if (left<0.0f)
-                {
-                    //float gain = rescale(middle,0.0f,right,0.0f,1.0f);
-                    //result *= gain;
-                }
-                    
-                return result;
-                return 0.0f;
-            };
-            float bs = 0.0f;
-            float zzz = rescale(smorph,0.0f,1.0f,-0.25f,1.0f);
-            for (int i=0;i<16;++i)
-            {
-                float x = rescale((float)i,0,15,0.0f,1.0f);
-                x = bfunc(x,zzz,0.25f);
-                //mChebyCoeffs[i] = clamp(x,0.0f,1.0f);
-                //bs += mChebyCoeffs[i];
-            }
-            //bs = 1.0f/bs;
-            //for (int i=0;i<16;++i)
-            //    mChebyCoeffs[i] *= bs;
-            
+            m_osc_freq_smoothers[i].setTarget(simd::float_4::load(&m_osc_freqs[i*4]));
+            m_osc_gain_smoothers[i].setTarget(simd::float_4::load(&m_osc_gains[i*4]));
         }
-        
-        //float foldgain = m_fold_smoother.process((1.0f+m_fold*8.0f));
-        float foldgain = m_fold_smoother.process(m_fold);
-        for (int i=0;i<m_oscils.size();++i)
+        if (m_ext_fm)
+            dispatchOscillatorBlock<true>(nframes,samplerate);
+        else
+            dispatchOscillatorBlock<false>(nframes,samplerate);
+        for (int k=0;k<nframes;++k)
         {
-            float gain0 = m_osc_gain_smoothers[i*2+0].process(m_osc_gains[i*2+0]);
-            float gain1 = m_osc_gain_smoothers[i*2+1].process(m_osc_gains[i*2+1]);
-            simd::float_4 ss = m_oscils[i].processSample(0.0f);
-            float s0 = ss[0];
-            float s1 = ss[1];
-            fms[i] = s0;
-            float s2 = s0 * gain0 + s1 * gain1;
-            outbuf[i] = s2;
+            m_foldgains[k] = m_fold_smoother.process(m_fold);
+            m_morphs[k] = mChebyMorphSmoother.process(mChebyMorph);
         }
         if (m_fold_algo == 0)
         {
-            float foldg = (1.0f+foldgain*8.0f);
-            for (int i=0;i<m_oscils.size();i+=4)
+            foldBlock(nframes,[this](simd::float_4 x, int, int k)
             {
-                simd::float_4 x = simd::float_4::load(&outbuf[i]);
-                x = reflectx(x*foldg);
-                x.store(&outbuf[i]);
-            }
+                return reflectx(x*(1.0f+m_foldgains[k]*8.0f));
+            });
         } 
-        else if (m_fold_algo == 1) // && smorph>0.00001f)
+        else if (m_fold_algo == 1)
         {
-            for (int i=0;i<m_oscils.size();i+=4)
+            const ChebyShaperTable* table = m_chebyTables.acquire();
+            const int h = chebyMorphCount-1;
+            foldBlock(nframes,[this,table,h](simd::float_4 x, int, int k) -> simd::float_4
             {
-                simd::float_4 x = simd::float_4::load(&outbuf[i]);
-                x = chebyshev(x,mChebyCoeffs,16);
-                x = clamp(x,simd::float_4(-1.0f),simd::float_4(1.0f));
-                x.store(&outbuf[i]);
-            }
+                float temp = m_morphs[k] * h;
+                int row = temp;
+                return table->process(x,row,temp-row);
+            });
+            // for the GUI
+            updateChebyCoeffs(m_morphs[nframes-1]);
         } else if (m_fold_algo == 2)
         {
-            float foldg = (0.15f+foldgain*4.0f);
-            for (int i=0;i<m_oscils.size();i+=4)
+            foldBlock(nframes,[this](simd::float_4 x, int group, int k) -> simd::float_4
             {
-                simd::float_4 x = simd::float_4::load(&outbuf[i]);
-                x *= foldg;
-                x = ADAA<westCoastFoldADAA,0,1>(&mShaperStates[i],x.v);
-                x.store(&outbuf[i]);
-            }
+                x *= (0.15f+m_foldgains[k]*4.0f);
+                return simd::float_4(ADAA<westCoastFoldADAA,0,1>(&mShaperStates[group*4],x.v));
+            });
         }
-        int fm_mode = m_fm_algo;
-        auto fmfunc = [this](int mode, float& basefreq, int mi)
-        {
-            if (mode == 0)
-                basefreq += fms[mi]*m_fm_amt*basefreq*2.0f;
-            else if (mode == 1)
-                basefreq *= getExpFMDepth(fms[mi]*m_fm_amt*60.0f);
-                //basefreq *= std::pow(dsp::FREQ_SEMITONE,fms[mi]*m_fm_amt*60.0f);
-            else if (mode == 2)
-                basefreq += dsp::FREQ_C4*fms[mi]*m_fm_amt*5.0f;  
-        };
-        
-        if (fm_mode == 0)
-        {
-            for (int i=1;i<m_active_oscils;++i)
-            {
-                float hz0 = m_osc_freq_smoothers[i*2+0].process(m_osc_freqs[i*2+0]);
-                fmfunc(m_fm_mod_mode,hz0,0);
-                float hz1 = m_osc_freq_smoothers[i*2+1].process(m_osc_freqs[i*2+1]);
-                fmfunc(m_fm_mod_mode,hz1,0);
-                m_oscils[i].setFrequencies(hz0,hz1,samplerate);
-            }
-        } else if (fm_mode == 1)
-        {
-            for (int i=1;i<m_active_oscils;++i)
-            {
-                float hz0 = m_osc_freq_smoothers[i*2+0].process(m_osc_freqs[i*2+0]);
-                fmfunc(m_fm_mod_mode,hz0,i-1);
-                float hz1 = m_osc_freq_smoothers[i*2+1].process(m_osc_freqs[i*2+1]);
-                fmfunc(m_fm_mod_mode,hz1,i-1);
-                m_oscils[i].setFrequencies(hz0,hz1,samplerate);
-            }
-        } else if (fm_mode == 2)
+        for (int i=0;i<16;++i)
         {
-            for (int i=0;i<m_active_oscils-1;++i)
-            {
-                float hz0 = m_osc_freq_smoothers[i*2+0].process(m_osc_freqs[i*2+0]);
-                fmfunc(m_fm_mod_mode,hz0,lastosci);
-                float hz1 = m_osc_freq_smoothers[i*2+1].process(m_osc_freqs[i*2+1]);
-                fmfunc(m_fm_mod_mode,hz1,lastosci);
-                m_oscils[i].setFrequencies(hz0,hz1,samplerate);
-            }
+            float* dest = out[i];
+            for (int k=0;k<nframes;++k)
+                dest[k] = m_blockbuf[k*16+i];
         }
     }
     int m_curScale = 0;
@@ -1198,41 +1225,55 @@ public:
         
         x = clamp(x,0.0f,1.0f);
         m_cur_scale_norm = x;
-        auto& bank = m_all_banks[m_cur_bank];
-        int i = x * (bank.scales.size()-1);
-        if (i!=m_curScale)
-        {
-            m_curScale = i;
-            m_scale = getScaleChecked(m_cur_bank,m_curScale).pitches;
+        int numscales = getNumScales(m_cur_bank);
+        int i = 0;
+        if (numscales>0)
+            i = x * (numscales-1);
+        m_curScale = i;
+    }
+    // Call from the audio thread. The built-in scales are never freed, the user bank scales
+    // stay valid until the next call.
+    const QuantizeScale* lookupScale(int banknum, int scalenum)
+    {
+        if (banknum == ScalaScaleRepository::numBuiltinBanks)
+            return m_scaleSets.acquire()->get(0,scalenum);
+        auto builtins = ScalaScaleRepository::get().getBuiltinBanks();
+        if (builtins && banknum>=0 && banknum<builtins->size())
+        {
+            auto& bank = (*builtins)[banknum];
+            if (scalenum>=0 && scalenum<bank.scales.size())
+                return bank.scales[scalenum]->prepared.get();
         }
+        return &m_fallBackQuantizer;
+    }
+    // Builds an immutable snapshot of the user bank and hands it to the audio thread.
+    // Must not be called from the audio thread.
+    void publishScales()
+    {
+        auto set = std::make_shared<KlangScaleSet>();
+        set->banks.emplace_back();
+        for (auto& sc : m_userBank.scales)
+            set->banks.back().push_back(sc->prepared);
+        m_scaleSets.publish(set);
     }
     void loadScaleFromFile(std::string fn)
     {
-        if (m_cur_bank == m_all_banks.size()-1)
+        if (m_cur_bank == ScalaScaleRepository::numBuiltinBanks 
+            && m_curScale>=0 && m_curScale<m_userBank.scales.size())
         {
-            KlangScale scale(fn);
-            auto& s = getScaleChecked(m_cur_bank,m_curScale);
-            if (s.name.empty()==false)
-            {
-                s = scale;
-                mScaleToChangeTo = scale.pitches;
-                mDoScaleChange = true;
-                // sleep here so that we won't get back here while the switch is done in the audio thread
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
+            m_userBank.scales[m_curScale] = ScalaScaleRepository::get().getScale(fn);
+            publishScales();
         }
-        
-        
     }
     json_t* dataToJson() 
     {
         json_t* resultJ = json_object();
         json_t* slotsJ = json_array();
-        auto& bank = m_all_banks.back();
-        for (int i=0;i<bank.scales.size();++i)
+        for (int i=0;i<m_userBank.scales.size();++i)
         {
-            auto& scale = bank.scales[i];
-            auto stringj = json_string(scale.name.c_str());
+            auto& scale = *m_userBank.scales[i];
+            auto& id = scale.path.empty() ? scale.name : scale.path;
+            auto stringj = json_string(id.c_str());
             json_array_append(slotsJ,stringj);
         }
         json_object_set(resultJ,"userscalafiles",slotsJ);
@@ -1242,9 +1283,8 @@ public:
     {
         if (!root)
             return;
-        auto& bank = m_all_banks.back();
         auto slotsJ = json_object_get(root,"userscalafiles");
-        int lastbindex = m_all_banks.size()-1;
+        bool changed = false;
         if (slotsJ)
         {
             int sz = json_array_size(slotsJ);
@@ -1254,26 +1294,20 @@ public:
                 if (sj)
                 {
                     std::string fn(json_string_value(sj));
-                    if (i<bank.scales.size())
+                    if (i<m_userBank.scales.size())
                     {
-                        auto& temp = getScaleChecked(lastbindex,i);
-                        if (temp.name!=fn)
+                        auto& temp = *m_userBank.scales[i];
+                        if (temp.name!=fn && temp.path!=fn)
                         {
-                            KlangScale scale(fn);
-                            if (scale.name.empty()==false)
-                            {
-                                bank.scales[i] = scale;
-                                if (m_cur_bank == lastbindex && i == m_curScale)
-                                {
-                                    mScaleToChangeTo = scale.pitches;
-                                    mDoScaleChange = true;
-                                }
-                            }
+                            m_userBank.scales[i] = ScalaScaleRepository::get().getScale(fn);
+                            changed = true;
                         }
                     }
                 }
             }
         }
+        if (changed)
+            publishScales();
     }
     std::string mCustomScaleFileName;
     float m_norm_fm_amt = 0.0f;
@@ -1281,7 +1315,7 @@ public:
     {
         a = clamp(a,0.0f,1.0f);
         m_norm_fm_amt = a;
-        m_fm_amt = std::pow(a,2.0f);
+        m_fm_amt = a*a;
     }
     float getFMAmount() const { return m_norm_fm_amt; }
     int m_warp_mode = 0;
@@ -1312,7 +1346,7 @@ public:
     {
         p = clamp(p,-36.0f,36.0f);
         m_stored_pitch_offs = p;
-        m_freqratio = std::pow(dsp::FREQ_SEMITONE,p);
+        m_freqratio = fastExp2(p*(1.0f/12.0f));
     }
     float getPitchOffset() const { return m_stored_pitch_offs; }
     void setBalance(float b)
@@ -1372,7 +1406,7 @@ public:
         {
             float shaped = 1.0f-std::pow(1.0f-s,3.0f);
             shaped = rescale(shaped,0.0f,1.0f,0.99f,0.99999f);
-            for (int i=0;i<m_osc_freq_smoothers.size();++i)
+            for (int i=0;i<8;++i)
                 m_osc_freq_smoothers[i].setAmount(shaped);
             m_freq_smooth = s;
         }
@@ -1397,33 +1431,190 @@ public:
     }
     void setScaleBank(int b)
     {
-        b = clamp(b,0,m_all_banks.size()-1);
-        if (m_cur_bank!=b)
-        {
-            m_cur_bank = b;
-            m_scale = getScaleChecked(m_cur_bank,m_curScale).pitches;
-        }
-        
+        b = clamp(b,0,getNumBanks()-1);
+        m_cur_bank = b;
     }
     void setFoldAlgo(int a)
     {
         m_fold_algo = clamp(a,0,2);
     }
+    // 1, 2 or 4 times oversampling of the folding. Can be called from any thread, the
+    // oversamplers are switched at the start of the next processBlock call.
+    void setFoldOversampling(int f)
+    {
+        m_fold_oversampling.store(f <= 1 ? 1 : (f < 4 ? 2 : 4));
+    }
+    int getFoldOversampling() const { return m_fold_oversampling.load(); }
+    // Modulator signals for the 16 oscillators, 16 values per frame for the frames of the next
+    // processBlock call. The modulators are added to the internal FM and scaled by the FM amount.
+    // Pass nullptr to disable.
+    void setExternalFM(const float* fm)
+    {
+        m_ext_fm = fm;
+    }
+    // Pitches (in octaves from C4) and gains of the 16 oscillators as set by updateOscFrequencies.
+    // The crossfaded frequency pair of each oscillator is combined into one pitch weighted by the gains.
+    void getPartials(simd::float_4* pitches, simd::float_4* gains)
+    {
+        for (int i=0;i<4;++i)
+        {
+            const float* f = &m_osc_freqs[i*8];
+            const float* g = &m_osc_gains[i*8];
+            simd::float_4 f0(f[0],f[2],f[4],f[6]);
+            simd::float_4 f1(f[1],f[3],f[5],f[7]);
+            simd::float_4 g0(g[0],g[2],g[4],g[6]);
+            simd::float_4 g1(g[1],g[3],g[5],g[7]);
+            simd::float_4 p0 = simd::log2(simd::fmax(f0,1.0f)*(1.0f/dsp::FREQ_C4));
+            simd::float_4 p1 = simd::log2(simd::fmax(f1,1.0f)*(1.0f/dsp::FREQ_C4));
+            simd::float_4 gsum = g0+g1;
+            simd::float_4 w = simd::ifelse(gsum>0.0f,g1/gsum,0.0f);
+            pitches[i] = p0+(p1-p0)*w;
+            gains[i] = gsum;
+        }
+    }
     OnePoleFilter m_norm_smoother;
-    std::array<float,32> m_osc_gains;
-    std::array<float,32> m_osc_freqs;
+    alignas(16) std::array<float,32> m_osc_gains;
+    alignas(16) std::array<float,32> m_osc_freqs;
     std::array<float,32> m_unquant_freqs;
 private:
+    void updateChebyCoeffs(float smorph)
+    {
+        const int h = chebyMorphCount-1;
+        int i0 = smorph * h;
+        int i1 = i0 + 1;
+        float temp = smorph * h;
+        float xfrac = temp - (int)temp;
+        for (int i=0;i<16;i+=4)
+        {
+            simd::float_4 y0 = simd::float_4::load(&chebyMorphCoeffs[i0][i]);
+            simd::float_4 y1 = simd::float_4::load(&chebyMorphCoeffs[i1][i]);
+            simd::float_4 interpolated = y0 + (y1 - y0) * xfrac;
+            interpolated.store(&mChebyCoeffs[i]);
+        }
+    }
+    // fm holds the modulator outputs for the frequency pairs of 2 oscillators
+    template<int FMMode>
+    inline simd::float_4 applyFM(simd::float_4 basefreqs, simd::float_4 fm)
+    {
+        if (FMMode == 0)
+            return basefreqs + fm*m_fm_amt*basefreqs*2.0f;
+        if (FMMode == 1)
+            return basefreqs * Exp2Table::exp2(fm*(m_fm_amt*5.0f));
+        return basefreqs + fm*(dsp::FREQ_C4*m_fm_amt*5.0f);
+    }
+    // Runs the oscillators and the frequency modulation into m_blockbuf, before the folding
+    // Applies the shaper to m_blockbuf at the oversampled rate, 4 oscillators at a time
+    template<typename F>
+    void foldBlock(int nframes, F shaper)
+    {
+        int factor = m_oversamplers[0].getFactor();
+        simd::float_4 osbuf[HalfBandOversampler::maxFactor];
+        for (int k=0;k<nframes;++k)
+        {
+            float* frame = &m_blockbuf[k*16];
+            for (int g=0;g<4;++g)
+            {
+                simd::float_4 x = simd::float_4::load(&frame[g*4]);
+                m_oversamplers[g].upsample(x,osbuf);
+                for (int j=0;j<factor;++j)
+                    osbuf[j] = shaper(osbuf[j],g,k);
+                m_oversamplers[g].downsample(osbuf).store(&frame[g*4]);
+            }
+        }
+    }
+    template<bool ExternalFM>
+    void dispatchOscillatorBlock(int nframes, float samplerate)
+    {
+        if (m_fm_mod_mode == 0)
+            processOscillatorBlock<0,ExternalFM>(nframes,samplerate);
+        else if (m_fm_mod_mode == 1)
+            processOscillatorBlock<1,ExternalFM>(nframes,samplerate);
+        else
+            processOscillatorBlock<2,ExternalFM>(nframes,samplerate);
+    }
+    template<int FMMode, bool ExternalFM>
+    void processOscillatorBlock(int nframes, float samplerate)
+    {
+        int lastosci = m_active_oscils-1;
+        // the oscillators that are modulated and which oscillator modulates them
+        int firstmod = 1;
+        int lastmod = m_active_oscils;
+        if (m_fm_algo == 2)
+        {
+            firstmod = 0;
+            lastmod = m_active_oscils-1;
+        }
+        int unmodulated = m_fm_algo < 2 ? 0 : lastosci;
+        alignas(16) float hzs[32];
+        alignas(16) float gains[32];
+        for (int k=0;k<nframes;++k)
+        {
+            for (int i=0;i<8;++i)
+            {
+                m_osc_freq_smoothers[i].process().store(&hzs[i*4]);
+                m_osc_gain_smoothers[i].process().store(&gains[i*4]);
+            }
+            const float* ext = ExternalFM ? &m_ext_fm[k*16] : nullptr;
+            if (ExternalFM)
+            {
+                simd::float_4 hz(hzs[unmodulated*2+0],hzs[unmodulated*2+1],0.0f,0.0f);
+                hz = applyFM<FMMode>(hz,simd::float_4(ext[unmodulated]));
+                m_oscils[unmodulated].setFrequencies(hz[0],hz[1],samplerate);
+            }
+            else
+                m_oscils[unmodulated].setFrequencies(hzs[unmodulated*2+0],hzs[unmodulated*2+1],samplerate);
+            float* frame = &m_blockbuf[k*16];
+            for (int i=0;i<16;++i)
+            {
+                simd::float_4 ss = m_oscils[i].processSample(0.0f);
+                fms[i] = ss[0];
+                frame[i] = ss[0] * gains[i*2+0] + ss[1] * gains[i*2+1];
+            }
+            for (int i=firstmod & ~1;i<lastmod;i+=2)
+            {
+                float fm0 = fms[lastosci];
+                float fm1 = fm0;
+                if (m_fm_algo == 0)
+                {
+                    fm0 = fms[0];
+                    fm1 = fm0;
+                }
+                else if (m_fm_algo == 1)
+                {
+                    fm0 = fms[std::max(i-1,0)];
+                    fm1 = fms[i];
+                }
+                if (ExternalFM)
+                {
+                    fm0 += ext[i];
+                    fm1 += ext[i+1];
+                }
+                simd::float_4 hz = simd::float_4::load(&hzs[i*2]);
+                hz = applyFM<FMMode>(hz,simd::float_4(fm0,fm0,fm1,fm1));
+                if (i>=firstmod)
+                    m_oscils[i].setFrequencies(hz[0],hz[1],samplerate);
+                if (i+1<lastmod)
+                    m_oscils[i+1].setFrequencies(hz[2],hz[3],samplerate);
+            }
+        }
+    }
     alignas(16) std::array<SIMDSimpleOsc,16> m_oscils;
     
-    
-    std::array<OnePoleFilter,32> m_osc_gain_smoothers;
-    std::array<OnePoleFilter,32> m_osc_freq_smoothers;
+    // smoothers for the 32 frequencies and gains, 4 at a time
+    SimdOnePoleFilter m_osc_gain_smoothers[8];
+    SimdOnePoleFilter m_osc_freq_smoothers[8];
+    alignas(16) float m_blockbuf[maxBlockSize*16];
+    float m_foldgains[maxBlockSize];
+    float m_morphs[maxBlockSize];
+    const float* m_ext_fm = nullptr;
+    HalfBandOversampler m_oversamplers[4];
+    std::atomic<int> m_fold_oversampling{1};
+    ImmutableHandoff<ChebyShaperTable> m_chebyTables;
     
     alignas(16) QuadFilterWaveshaperState mShaperStates[16];    
 
     OnePoleFilter m_fold_smoother;
-    std::vector<double> m_scale;
+    const QuantizeScale* m_scale = nullptr;
     float m_spread = 1.0f;
     float m_root_pitch = 0.0f;
     float m_freqratio = 1.0f;
@@ -1441,13 +1632,11 @@ private:
     bool mFreeze_enabled = false;
     int mFreeze_mode = 0;
     int m_fm_mod_mode = 0;
-    std::vector<KlangScaleBank> m_all_banks;
+    KlangScaleBank m_userBank;
+    QuantizeScale m_fallBackQuantizer;
     int m_cur_bank = 0;
     int mFreezeRunCount = 0;
-    spinlock m_lock;
-    std::atomic<bool> mDoScaleChange{false};
-    std::vector<double> mScaleToChangeTo;
-    std::array<float,4096> mExpFMPowerTable;
+    ImmutableHandoff<KlangScaleSet> m_scaleSets;
 };
 
 #ifndef RAPIHEADLESS
@@ -1458,6 +1647,8 @@ public:
     enum OUTPUTS
     {
         OUT_AUDIO_1,
+        OUT_PARTIAL_PITCH,
+        OUT_PARTIAL_GAIN,
         OUT_LAST
     };
     enum INPUTS
@@ -1474,6 +1665,7 @@ public:
         IN_SCALE,
         IN_FREEZE,
         IN_SPREAD_DIST,
+        IN_FM_POLY,
         IN_LAST
     };
     enum PARAMETERS
@@ -1561,7 +1753,10 @@ public:
         configParam(PAR_FOLD_MODE,0,2,0,"Fold mode");
         getParamQuantity(PAR_FOLD_MODE)->snapEnabled = true;
         configParam(PAR_HIPASSFREQ,10.0f,200.0f,10.0f,"Low cut filter frequency");
-        m_pardiv.setDivision(16);
+        configInput(IN_FM_POLY,"Polyphonic FM (per oscillator, scaled by FM amount)");
+        configOutput(OUT_PARTIAL_PITCH,"Oscillator pitches (V/Oct)");
+        configOutput(OUT_PARTIAL_GAIN,"Oscillator gains");
+        m_pardiv.setDivision(blockSize);
     }
     float m_samplerate = 0.0f;
     inline float getModParValue(int parId, int inId, int attnId=-1, bool doClamp=false, float clampMin = 0.0f, float clampMax = 0.0f)
@@ -1585,8 +1780,8 @@ public:
             // we don't want to calculate the coeffs for all filter instances, because they are the same
             float normfreq = hphz/args.sampleRate;
             float q = sqrt(2.0)/2.0;
-            m_hpfilts[0].setParameters(rack::dsp::BiquadFilter::HIGHPASS,normfreq,q,1.0f);
-            for (int i=1;i<16;++i)
+            m_hpfilts[0].setParameters(dsp::TBiquadFilter<simd::float_4>::HIGHPASS,normfreq,q,1.0f);
+            for (int i=1;i<4;++i)
             {
                 m_hpfilts[i].a[0] = m_hpfilts[0].a[0];
                 m_hpfilts[i].a[1] = m_hpfilts[0].a[1];
@@ -1664,31 +1859,69 @@ public:
             m_osc.setFreezeMode(freezeMode);
             
             m_osc.updateOscFrequencies();
+            if (outputs[OUT_PARTIAL_PITCH].isConnected() || outputs[OUT_PARTIAL_GAIN].isConnected())
+            {
+                simd::float_4 pitches[4];
+                simd::float_4 gains[4];
+                m_osc.getPartials(pitches,gains);
+                int numPartials = m_osc.getOscCount();
+                outputs[OUT_PARTIAL_PITCH].setChannels(numPartials);
+                outputs[OUT_PARTIAL_GAIN].setChannels(numPartials);
+                for (int i=0;i<numPartials;i+=4)
+                {
+                    outputs[OUT_PARTIAL_PITCH].setVoltageSimd(pitches[i/4],i);
+                    outputs[OUT_PARTIAL_GAIN].setVoltageSimd(gains[i/4]*10.0f,i);
+                }
+            }
         }
-        alignas(16) float outs[16];
-        m_osc.processNextFrame(outs,args.sampleRate);
-        int numOutputs = params[PAR_NUM_OUTPUTS].getValue();
-        int numOscs = m_osc.getOscCount();
+        // the outputs are rendered in blocks of the parameter update interval
+        if (m_blockpos == blockSize)
+            renderBlock();
+        int numOutputs = m_blockNumOutputs;
         outputs[OUT_AUDIO_1].setChannels(numOutputs);
-        
-        float mixed[16];
         for (int i=0;i<numOutputs;++i)
-            mixed[i] = 0.0f;
-        for (int i=0;i<16;++i)
+            outputs[OUT_AUDIO_1].setVoltage(m_outblock[i][m_blockpos],i);
+        // the block has already been rendered, so the external FM is applied one block later
+        if (inputs[IN_FM_POLY].isConnected())
         {
-            int outindex = i % numOutputs;
-            mixed[outindex] += outs[i];
-            
+            float* dest = &m_fmblock[m_blockpos*16];
+            for (int i=0;i<16;i+=4)
+                (inputs[IN_FM_POLY].getPolyVoltageSimd<simd::float_4>(i)*0.2f).store(&dest[i]);
         }
+        ++m_blockpos;
+    }
+    // Renders the oscillators for the next blockSize samples, mixes them to the outputs
+    // and applies the low cut filters
+    void renderBlock()
+    {
+        alignas(16) float oscbufs[16][blockSize];
+        float* outs[16];
+        for (int i=0;i<16;++i)
+            outs[i] = oscbufs[i];
+        m_osc.setExternalFM(inputs[IN_FM_POLY].isConnected() ? m_fmblock : nullptr);
+        m_osc.processBlock(outs,blockSize,m_samplerate);
+        int numOutputs = params[PAR_NUM_OUTPUTS].getValue();
+        int numOscs = m_osc.getOscCount();
         float nnosc = rescale((float)numOscs,1,16,0.0f,1.0f);
         float normscaler = 0.25f+0.75f*std::pow(1.0f-nnosc,3.0f);
-        float outgain = m_osc.m_norm_smoother.process(normscaler);
-        for (int i=0;i<numOutputs;++i)
+        for (int k=0;k<blockSize;++k)
         {
-            float outsample = mixed[i]*5.0f*outgain;
-            outsample = m_hpfilts[i].process(outsample);
-            outputs[OUT_AUDIO_1].setVoltage(outsample,i);
+            alignas(16) float mixed[16];
+            for (int i=0;i<16;++i)
+                mixed[i] = 0.0f;
+            for (int i=0;i<16;++i)
+                mixed[i % numOutputs] += oscbufs[i][k];
+            simd::float_4 outgain = 5.0f*m_osc.m_norm_smoother.process(normscaler);
+            for (int i=0;i<numOutputs;i+=4)
+            {
+                simd::float_4 x = simd::float_4::load(&mixed[i])*outgain;
+                x = m_hpfilts[i/4].process(x);
+                for (int j=0;j<4;++j)
+                    m_outblock[i+j][k] = x[j];
+            }
         }
+        m_blockNumOutputs = numOutputs;
+        m_blockpos = 0;
     }
     json_t* dataToJson() override
     {
@@ -1699,17 +1932,24 @@ public:
             json_object_set(resultJ,"osccustomdata0",ob);
         }
         json_object_set(resultJ,"directscale",json_integer(m_osc.m_pitchQuantizeMode));
+        json_object_set(resultJ,"foldoversampling",json_integer(m_osc.getFoldOversampling()));
         return resultJ;
     }
     void dataFromJson(json_t* root) override
     {
         if (auto ob = json_object_get(root,"osccustomdata0")) m_osc.dataFromJson(ob);
         if (auto ij = json_object_get(root,"directscale")) m_osc.m_pitchQuantizeMode = json_integer_value(ij);
+        if (auto ij = json_object_get(root,"foldoversampling")) m_osc.setFoldOversampling(json_integer_value(ij));
     }
     
     alignas(16) ScaleOscillator m_osc;
     dsp::ClockDivider m_pardiv;
-    dsp::TBiquadFilter<float> m_hpfilts[16];
+    dsp::TBiquadFilter<simd::float_4> m_hpfilts[4];
+    static const int blockSize = 16;
+    float m_outblock[16][blockSize] = {};
+    alignas(16) float m_fmblock[blockSize*16] = {};
+    int m_blockpos = blockSize;
+    int m_blockNumOutputs = 1;
     dsp::SchmittTrigger m_freezeTrigger;
 };
 
@@ -1763,6 +2003,16 @@ public:
             else themod->m_osc.m_pitchQuantizeMode = 0;
         },"Use scale steps directly",CHECKMARK(tick));
         menu->addChild(quantitem);
+        menu->addChild(createSubmenuItem("Fold oversampling","",[=](Menu* submenu)
+        {
+            for (int factor : {1,2,4})
+            {
+                submenu->addChild(createMenuItem([=]()
+                {
+                    themod->m_osc.setFoldOversampling(factor);
+                },std::to_string(factor)+"x",CHECKMARK(themod->m_osc.getFoldOversampling()==factor)));
+            }
+        }));
     }
     XScaleOscWidget(XScaleOsc* m)
     {
@@ -1840,6 +2090,9 @@ public:
         addParam(createParam<CKSS>(Vec(35.0, 32.0), module, XScaleOsc::PAR_FREEZE_ENABLED));
         addInput(createInput<PJ301MPort>(Vec(35.0f, 55.0f), module, XScaleOsc::IN_FREEZE));
         addParam(createParam<CKSSThree>(Vec(64.0, 32.0), module, XScaleOsc::PAR_FREEZE_MODE));
+        new PortWithBackGround(m,this,XScaleOsc::IN_FM_POLY,254,30,"POLY FM",false);
+        new PortWithBackGround(m,this,XScaleOsc::OUT_PARTIAL_PITCH,285,30,"OSC PITCH",true);
+        new PortWithBackGround(m,this,XScaleOsc::OUT_PARTIAL_GAIN,316,30,"OSC GAIN",true);
     }
     
     float myoffs = 0.0f;
@@ -1926,30 +2179,43 @@ static int patestCallback( const void *inputBuffer, void *outputBuffer,
 {
     ScaleOscillator* osc = (ScaleOscillator*)userData;
     float* obuf = (float*)outputBuffer;
-    alignas(16) float oscbuf[16];
-    memset(oscbuf,0,16*4);
+    const int blockSize = 32;
+    alignas(16) float oscbufs[16][blockSize];
+    float* oscouts[16];
+    for (int i=0;i<16;++i)
+        oscouts[i] = oscbufs[i];
     int oscCount = 6;
     osc->setOscCount(oscCount);
     
     osc->setFreezeEnabled(false);
     osc->setPitchQuantizeMode(0);
-    osc->updateOscFrequencies();
-    for (int i=0;i<framesPerBuffer;++i)
-    {
-        osc->processNextFrame(oscbuf,44100);
-        float outs[2] = {0.0f,0.0f};
-        for (int j=0;j<oscCount;++j)
-        {
-            //outs[j % 2] += oscbuf[j] * 0.2f;
-            float panpos = rescale(j,0,oscCount,-g_pan_spread,g_pan_spread);
-            panpos = rescale(panpos,-1.0f,1.0f,0.0f,1.0f);
-            float gain_left = panpos;
-            float gain_right = 1.0f-panpos;
-            outs[0] += oscbuf[j] * 0.2f * gain_left;
-            outs[1] += oscbuf[j] * 0.2f * gain_right;
+    float gains_left[16];
+    float gains_right[16];
+    for (int j=0;j<oscCount;++j)
+    {
+        float panpos = rescale(j,0,oscCount,-g_pan_spread,g_pan_spread);
+        panpos = rescale(panpos,-1.0f,1.0f,0.0f,1.0f);
+        gains_left[j] = panpos * 0.2f;
+        gains_right[j] = (1.0f-panpos) * 0.2f;
+    }
+    int pos = 0;
+    while (pos<framesPerBuffer)
+    {
+        int nframes = std::min<int>(blockSize,framesPerBuffer-pos);
+        osc->updateOscFrequencies();
+        osc->processBlock(oscouts,nframes,44100);
+        for (int i=0;i<nframes;++i)
+        {
+            float outs[2] = {0.0f,0.0f};
+            for (int j=0;j<oscCount;++j)
+            {
+                outs[0] += oscbufs[j][i] * gains_left[j];
+                outs[1] += oscbufs[j][i] * gains_right[j];
+            }
+            obuf[(pos+i)*2+0] = outs[0];
+            obuf[(pos+i)*2+1] = outs[1];
         }
-        obuf[i*2+0] = outs[0];
-        obuf[i*2+1] = outs[1];
+        pos += nframes;
     }
     if (g_quit == true)
         return paComplete;
@@ -2051,6 +2317,7 @@ int main(int argc, char** argv)
     double SAMPLE_RATE = 44100;
     std::cout << "Starting headless KLANG\n";
     
+    ScalaScaleRepository::get().waitForBuiltinBanks();
     osc.setScaleBank(1);
     osc.setScale(0.3);
     osc.setBalance(0.4);
@@ -11,16 +11,31 @@ public:
         ENUMS(PAR_GATE_LEN, 8),
         PAR_LAST
     };
+    enum INPUTS
+    {
+        IN_POLY_RATE,
+        IN_LAST
+    };
+    enum OUTPUTS
+    {
+        ENUMS(OUT_GATE, 8),
+        ENUMS(OUT_INTERVAL, 8),
+        OUT_POLY_GATE,
+        OUT_POLY_TIMESTAMP,
+        OUT_LAST
+    };
     RandomClockModule();
     void process(const ProcessArgs& args) override;
     float m_curDensity = 0.0f;
 private:
     RandomClock m_clocks[8];
+    RandomClockBank m_bank;
+    dsp::ClockDivider m_bankDivider;
 };
 
 RandomClockModule::RandomClockModule()
 {
-    config(PAR_LAST,1,16);
+    config(PAR_LAST,IN_LAST,OUT_LAST);
     configParam(0,0.0f,1.0f,0.1,"Master density"); // master clock density
     float defmult = rescale(1.0f,0.1f,10.0f,0.0f,1.0f);
     for (int i=0;i<8;++i)
@@ -31,6 +46,10 @@ RandomClockModule::RandomClockModule()
         // >0.5 && <=1.0 stochastic distribution favoring short and long values
         configParam(PAR_GATE_LEN+i,0.0,1.0f,0.25f,"Gate length "+std::to_string(i+1)); 
     }
+    configInput(IN_POLY_RATE,"Polyphonic rate CV (V/Oct)");
+    configOutput(OUT_POLY_GATE,"Polyphonic gates");
+    configOutput(OUT_POLY_TIMESTAMP,"Polyphonic sub-sample trigger times");
+    m_bankDivider.setDivision(16);
 }
 
 
@@ -76,7 +95,36 @@ void RandomClockModule::process(const ProcessArgs& args)
             outputs[i+8].setVoltage(m_clocks[i].getCurrentInterval());
         }
     }
-    
+    if (outputs[OUT_POLY_GATE].isConnected() || outputs[OUT_POLY_TIMESTAMP].isConnected())
+    {
+        // the lane count follows the rate CV input, lane i uses the knobs of clock i % 8
+        int numlanes = RandomClockBank::numLanes;
+        if (inputs[IN_POLY_RATE].isConnected())
+            numlanes = inputs[IN_POLY_RATE].getChannels();
+        if (m_bankDivider.process())
+        {
+            for (int i=0;i<numlanes;i+=4)
+            {
+                simd::float_4 cv = inputs[IN_POLY_RATE].getPolyVoltageSimd<simd::float_4>(i);
+                simd::float_4 ratemul = simd::pow(2.0f,simd::clamp(cv,-5.0f,5.0f));
+                for (int j=0;j<4;++j)
+                {
+                    int k = (i+j) % 8;
+                    float multip = rescale(params[PAR_DENSITY_MULTIP+k].getValue(),0.0f,1.0f,0.1f,10.0f);
+                    m_bank.setDensity(i+j,masterdensity*multip*ratemul[j]);
+                    m_bank.setGateLen(i+j,params[PAR_GATE_LEN+k].getValue());
+                }
+            }
+        }
+        for (int i=0;i<numlanes;i+=4)
+        {
+            simd::float_4 gates = m_bank.process(i/4,args.sampleTime);
+            outputs[OUT_POLY_GATE].setVoltageSimd(gates*10.0f,i);
+            outputs[OUT_POLY_TIMESTAMP].setVoltageSimd(m_bank.getTimeStamps(i/4)*10.0f,i);
+        }
+        outputs[OUT_POLY_GATE].setChannels(numlanes);
+        outputs[OUT_POLY_TIMESTAMP].setChannels(numlanes);
+    }
 }
 
 RandomClockWidget::RandomClockWidget(RandomClockModule* m)
@@ -92,6 +140,9 @@ RandomClockWidget::RandomClockWidget(RandomClockModule* m)
         addOutput(createOutput<PJ301MPort>(Vec(95,30+30*i), module, i+8));
     }
     addParam(createParam<RoundBlackKnob>(Vec(5, 30+30*8), module, RandomClockModule::PAR_MASTER_DENSITY));    
+    addInput(createInput<PJ301MPort>(Vec(5,305), module, RandomClockModule::IN_POLY_RATE));
+    addOutput(createOutput<PJ301MPort>(Vec(65,305), module, RandomClockModule::OUT_POLY_GATE));
+    addOutput(createOutput<PJ301MPort>(Vec(95,305), module, RandomClockModule::OUT_POLY_TIMESTAMP));
     
 }
 
@@ -31,7 +31,7 @@ public:
                 float k_b = 0.5f;
                 float k_x = 1.0f-powf((1.0f-random::uniform()),1.0f/k_b);
                 k_x = powf(k_x,1.0f/k_a);
-                m_cur_gate_len = rescale(k_x,0.0f,1.0f,0.01,0.99f);
+                m_cur_gate_len = rescale(k_x,0.0f,1.0f,0.01f,0.99f);
             }
             
         } else
@@ -88,6 +88,129 @@ private:
     float m_cur_gate_len = 0.5f;
 };
 
+// 16 random clocks processed 4 at a time. The unit exponential intervals and the Kumaraswamy
+// gate lengths are drawn in batches with float_4 into a ring per lane, so the events themselves
+// only scale the stored values by the density. The clock phases carry the overshoot past the
+// event, and the position of the event within the sample is kept as a sub-sample timestamp.
+class RandomClockBank
+{
+public:
+    static const int numLanes = 16;
+    static const int ringSize = 16;
+    RandomClockBank()
+    {
+        for (int i=0;i<numLanes;++i)
+        {
+            m_density[i] = 1.0f;
+            m_gate_len_par[i] = 0.25f;
+            m_ringpos[i] = ringSize;
+        }
+        for (int i=0;i<numLanes/4;++i)
+        {
+            m_phase[i] = 0.0f;
+            m_offset[i] = 0.0f;
+            for (int j=0;j<4;++j)
+                startEvent(i*4+j,0.0f);
+        }
+    }
+    void setDensity(int lane, float d)
+    {
+        m_density[lane] = clamp(d,0.01f,200.0f);
+    }
+    void setGateLen(int lane, float gl)
+    {
+        m_gate_len_par[lane] = clamp(gl,0.0f,1.0f);
+    }
+    // Returns the gates of the 4 lanes of the group as 0 or 1
+    simd::float_4 process(int group, float timeDelta)
+    {
+        simd::float_4 phase = m_phase[group] + timeDelta;
+        int events = simd::movemask(phase >= m_interval[group]);
+        if (events)
+        {
+            for (int j=0;j<4;++j)
+            {
+                if (events & (1 << j))
+                {
+                    float over = phase[j]-m_interval[group][j];
+                    m_offset[group][j] = clamp(1.0f-over/timeDelta,0.0f,1.0f);
+                    phase[j] = over;
+                    startEvent(group*4+j,over);
+                }
+            }
+        }
+        m_phase[group] = phase;
+        return simd::ifelse(phase < m_gate_end[group],1.0f,0.0f);
+    }
+    // Position of the latest event within its sample, 0 is the start of the sample
+    simd::float_4 getTimeStamps(int group) const { return m_offset[group]; }
+    simd::float_4 getCurrentIntervals(int group) const { return m_interval[group]; }
+private:
+    void startEvent(int lane, float phase)
+    {
+        int g = lane/4;
+        int j = lane & 3;
+        float interval = 1.0f/m_density[lane];
+        // like RandomClock, redraw intervals outside of the limited range
+        for (int i=0;i<100;++i)
+        {
+            float td = nextVariate(lane,m_exp)/m_density[lane];
+            if (td>=0.005f && td<10.0f && td>phase)
+            {
+                interval = td;
+                break;
+            }
+        }
+        float glen = 0.0f;
+        if (m_gate_len_par[lane]<0.5f)
+            glen = rescale(m_gate_len_par[lane],0.0f,0.5f,0.01f,0.99f);
+        else
+            glen = rescale(nextVariate(lane,m_kumaraswamy),0.0f,1.0f,0.01f,0.99f);
+        m_interval[g][j] = interval;
+        m_gate_end[g][j] = interval*glen;
+    }
+    float nextVariate(int lane, float (*ring)[ringSize])
+    {
+        if (m_ringpos[lane] == ringSize)
+            refill(lane);
+        float r = ring[lane][m_ringpos[lane]];
+        // both rings are consumed in step, the unused value of the other ring is skipped
+        ++m_ringpos[lane];
+        return r;
+    }
+    void refill(int lane)
+    {
+        // Kumaraswamy distribution
+        // (1.0 - ( 1.0 - math.random() ) ^ (1.0/b))^(1.0/a)
+        const float k_a = 0.3f;
+        const float k_b = 0.5f;
+        for (int i=0;i<ringSize;i+=4)
+        {
+            simd::float_4 u1, u2;
+            for (int j=0;j<4;++j)
+            {
+                u1[j] = random::uniform();
+                u2[j] = random::uniform();
+            }
+            simd::float_4 ex = -simd::log(u1);
+            simd::float_4 kx = 1.0f-simd::exp(simd::log(1.0f-u2)*(1.0f/k_b));
+            kx = simd::exp(simd::log(kx)*(1.0f/k_a));
+            ex.store(&m_exp[lane][i]);
+            kx.store(&m_kumaraswamy[lane][i]);
+        }
+        m_ringpos[lane] = 0;
+    }
+    simd::float_4 m_phase[numLanes/4];
+    simd::float_4 m_interval[numLanes/4];
+    simd::float_4 m_gate_end[numLanes/4];
+    simd::float_4 m_offset[numLanes/4];
+    float m_density[numLanes];
+    float m_gate_len_par[numLanes];
+    float m_exp[numLanes][ringSize];
+    float m_kumaraswamy[numLanes][ringSize];
+    int m_ringpos[numLanes];
+};
+
 inline float pulse_wave(float frequency, float duty, float phase)
 {
     if (duty>=1.0f)
@@ -5,50 +5,83 @@
 
 ModulationShaper g_shaper;
 
-class XLFO
+// 16 triangle LFOs shaped by g_shaper, processed as four groups of simd::float_4 lanes.
+// The lanes share the master phase and add their own phase deviation when their rates
+// are modulated.
+class XLFOBank
 {
 public:
-    XLFO() 
+    XLFOBank() 
     {
-        m_offsetSmoother.setAmount(0.99);
+        for (int i=0;i<4;++i)
+        {
+            m_smoothedOffsets[i] = 0.0f;
+            m_freqmultips[i] = 1.0f;
+            m_phaseDevs[i] = 0.0f;
+            m_resetStates[i] = 0.0f;
+        }
     }
-    float process(float masterphase)
+    simd::float_4 process(int group, double masterphase, simd::float_4 offset, float slope, float shape)
     {
-        float smoothedOffs = m_offsetSmoother.process(m_offset);
-        float out = adjustable_triangle((smoothedOffs+masterphase)*m_freqmultip,m_slope);
-        /*
-        if (m_shape<0.5f)
-            out = std::pow(out,rescale(m_shape,0.0f,0.5f,8.0f,1.0f));
-        else 
-            out = 1.0f-std::pow(1.0f-out,rescale(m_shape,0.5f,1.0f,1.0f,8.0f));
-        */
-        out = g_shaper.process(m_shape,out);        
-
-        return -1.0+2.0f*out;
+        m_smoothedOffsets[group] = offset * (1.0f-0.99f) + m_smoothedOffsets[group] * 0.99f;
+        simd::float_4 in = (m_smoothedOffsets[group] + (float)masterphase + m_phaseDevs[group]) * m_freqmultips[group];
+        in = in - simd::floor(in);
+        // adjustable_triangle, same operations as the scalar rescale calls
+        simd::float_4 up = in / slope;
+        simd::float_4 down = 1.0f - (in - slope) / (1.0f - slope);
+        simd::float_4 tri = simd::ifelse(in < slope, up, down);
+        // ModulationShaper::process with the table lookups gathered per lane
+        float z = shape*(msnumtables-1);
+        int xindex0 = shape*(msnumtables-1);
+        const float* table0 = g_shaper.getTable(xindex0);
+        const float* table1 = g_shaper.getTable(xindex0+1);
+        simd::float_4 yindexf = simd::trunc(tri*(float)(mstablesize-1));
+        simd::float_4 x_a0, x_a1, x_b0;
+        for (int i=0;i<4;++i)
+        {
+            int yindex0 = yindexf[i];
+            x_a0[i] = table0[yindex0];
+            x_a1[i] = table0[yindex0+1];
+            x_b0[i] = table1[yindex0];
+        }
+        simd::float_4 xfrac = (tri*(float)mstablesize)-yindexf;
+        simd::float_4 x_interp0 = x_a0+(x_a1-x_a0) * xfrac;
+        float yfrac = z-(int)z;
+        simd::float_4 out = x_interp0+(x_b0-x_interp0) * yfrac;
+        return -1.0f+2.0f*out;
     }
-    void setFrequencyMultiplier(float r)
+    // Lanes with rate modulation run at ratio times the master rate
+    void advanceLanes(int group, float masterdelta, simd::float_4 ratio)
     {
-        m_freqmultip = r;
+        simd::float_4 dev = m_phaseDevs[group] + masterdelta * (ratio - 1.0f);
+        m_phaseDevs[group] = dev - simd::floor(dev);
     }
-    void setOffset(float offs)
+    // Rising edges restart the lanes at the current master phase 0
+    void processResets(int group, double masterphase, simd::float_4 resetvoltage)
     {
-        m_offset = offs;
+        simd::float_4 trig = (resetvoltage >= 1.0f) & (m_resetStates[group] < 0.5f);
+        m_resetStates[group] = simd::ifelse(resetvoltage >= 1.0f, 1.0f, 
+            simd::ifelse(resetvoltage <= 0.0f, 0.0f, m_resetStates[group]));
+        if (simd::movemask(trig))
+        {
+            simd::float_4 dev = 1.0f - (float)masterphase;
+            m_phaseDevs[group] = simd::ifelse(trig, dev - simd::floor(dev), m_phaseDevs[group]);
+        }
     }
-    void setSlope(float s)
+    void setFrequencyMultiplier(int index, float r)
     {
-        m_slope = s;
+        m_freqmultips[index / 4][index % 4] = r;
     }
-    void setShape(float s)
+    void resetPhases()
     {
-        m_shape = s;
+        for (int i=0;i<4;++i)
+            m_phaseDevs[i] = 0.0f;
     }
 private:
-    // double m_phase = 0.0f;
-    double m_freqmultip = 1.0f;
-    double m_offset = 0.0f;
-    float m_slope = 0.5f;
-    float m_shape = 0.5f;
-    OnePoleFilter m_offsetSmoother;
+    simd::float_4 m_smoothedOffsets[4];
+    simd::float_4 m_freqmultips[4];
+    simd::float_4 m_phaseDevs[4];
+    simd::float_4 m_resetStates[4];
 };
 
 class XMultiMod : public rack::Module
@@ -71,6 +104,8 @@ public:
     {
         IN_RESET,
         IN_RATE_CV,
+        IN_OFFSET_CV,
+        IN_DEPTH_CV,
         IN_LAST
     };
     enum OUTPUTS
@@ -90,6 +125,11 @@ public:
         configParam(PAR_SHAPE,0.0f,1.0f,0.5f,"Shape");
         configParam(PAR_VALUEOFFSET,-1.0f,1.0f,0.0f,"Value offset");
         configParam(PAR_SMOOTHING,0.0f,1.0f,0.5f,"Smoothing");
+        configInput(IN_RESET,"Reset (polyphonic resets individual outputs)");
+        configInput(IN_RATE_CV,"Rate (polyphonic)");
+        configInput(IN_OFFSET_CV,"Phase offset (polyphonic)");
+        configInput(IN_DEPTH_CV,"Depth (polyphonic)");
+        configOutput(OUT_MODOUT,"Modulation");
     }
     void updateLFORateMultipliers(int numoutputs, float masterMultip)
     {
@@ -98,11 +138,11 @@ public:
             if (masterMultip>=0.0f)
             {
                 int f = 1.0+i*masterMultip;
-                m_lfos[i].setFrequencyMultiplier(f);
+                m_lfos.setFrequencyMultiplier(i,f);
             } else
             {
                 int f = 1.0+i*(1.0f+masterMultip);
-                m_lfos[i].setFrequencyMultiplier(1.0f/f);
+                m_lfos.setFrequencyMultiplier(i,1.0f/f);
             }
             
         }
@@ -120,24 +160,52 @@ public:
         outputs[OUT_MODOUT].setChannels(numoutputs);
         float offsetpar = params[PAR_VALUEOFFSET].getValue();
         float smoothing = params[PAR_SMOOTHING].getValue();
+        bool dosmoothing = smoothing>0.5f;
+        smoothing = (smoothing-0.5f)*2.0f;
+        float smoothgain = 1.0f-m_phase;
         if (m_phase == 0.0)
             updateLFORateMultipliers(numoutputs,fmult);
-        for (int i=0;i<numoutputs;++i)
+        bool resetconnected = inputs[IN_RESET].isConnected();
+        if (resetconnected && inputs[IN_RESET].isMonophonic())
+        {
+            if (m_resetTrigger.process(inputs[IN_RESET].getVoltage()))
+            {
+                m_phase = 0.0;
+                m_lfos.resetPhases();
+                updateLFORateMultipliers(numoutputs,fmult);
+            }
+            resetconnected = false;
+        }
+        bool rateconnected = inputs[IN_RATE_CV].isConnected();
+        bool offsetconnected = inputs[IN_OFFSET_CV].isConnected();
+        bool depthconnected = inputs[IN_DEPTH_CV].isConnected();
+        float ratecvamt = params[PAR_ATTN_RATE].getValue();
+        float masterdelta = args.sampleTime*rate;
+        alignas(16) float laneoffsets[16];
+        for (int i=0;i<16;++i)
+            laneoffsets[i] = offset*(1.0/numoutputs*i);
+        int numgroups = (numoutputs+3)/4;
+        for (int g=0;g<numgroups;++g)
         {
-            m_lfos[i].setSlope(slope);
-            m_lfos[i].setShape(shape);
-            m_lfos[i].setOffset(offset*(1.0/numoutputs*i));
-            float out = m_lfos[i].process(m_phase);
-            if (smoothing>0.5f)
+            simd::float_4 laneindex = simd::float_4(0.0f,1.0f,2.0f,3.0f)+g*4.0f;
+            simd::float_4 offs = simd::float_4::load(&laneoffsets[g*4]);
+            if (offsetconnected)
+                offs += inputs[IN_OFFSET_CV].getPolyVoltageSimd<simd::float_4>(g*4)*0.1f;
+            if (resetconnected)
+                m_lfos.processResets(g,m_phase,inputs[IN_RESET].getPolyVoltageSimd<simd::float_4>(g*4));
+            simd::float_4 out = m_lfos.process(g,m_phase,offs,slope,shape);
+            if (dosmoothing)
+                out = smoothgain*simd::sin(4.0f*smoothing*out*3.141592f);
+            if (depthconnected)
+                out *= simd::clamp(inputs[IN_DEPTH_CV].getPolyVoltageSimd<simd::float_4>(g*4)*0.1f,0.0f,1.0f);
+            simd::float_4 voffset = laneindex/(float)numoutputs*offsetpar;
+            out = simd::clamp(out+voffset,-1.0f,1.0f);
+            outputs[OUT_MODOUT].setVoltageSimd(5.0f*out,g*4);
+            if (rateconnected)
             {
-                smoothing-=0.5f;
-                smoothing*=2.0f;
-                float gain = 1.0f-m_phase;
-                out = gain*std::sin(4.0*smoothing*out*3.141592);
+                simd::float_4 ratecv = inputs[IN_RATE_CV].getPolyVoltageSimd<simd::float_4>(g*4);
+                m_lfos.advanceLanes(g,masterdelta,simd::pow(2.0f,ratecv*ratecvamt));
             }
-            float voffset = rescale(i,0,numoutputs,0.0f,offsetpar);
-            out = clamp(out+voffset,-1.0f,1.0f);
-            outputs[OUT_MODOUT].setVoltage(5.0f*out,i);
         }
         m_phase+=args.sampleTime*rate;
         if (m_phase>=1.0)
@@ -147,8 +215,9 @@ public:
         }
     }
 private:
-    XLFO m_lfos[16];
+    XLFOBank m_lfos;
     double m_phase = 0.0;
+    dsp::SchmittTrigger m_resetTrigger;
 };
 
 class XMultiModWidget : public ModuleWidget
@@ -174,6 +243,10 @@ public:
         addChild(new KnobInAttnWidget(this,"NUM OUTS",XMultiMod::PAR_NUMOUTPUTS,-1,-1,1,yoffs,true));
         addChild(new KnobInAttnWidget(this,"OUTPUT OFFSET",XMultiMod::PAR_VALUEOFFSET,-1,-1,82,yoffs));
         yoffs+=45.0f;
+        new PortWithBackGround(m,this,XMultiMod::OUT_MODOUT,1,yoffs,"MOD OUT",true);
+        new PortWithBackGround(m,this,XMultiMod::IN_RESET,42,yoffs,"RST",false);
+        new PortWithBackGround(m,this,XMultiMod::IN_OFFSET_CV,83,yoffs,"OFFS",false);
+        new PortWithBackGround(m,this,XMultiMod::IN_DEPTH_CV,124,yoffs,"DEPTH",false);
         /*
         PortWithBackGround<PJ301MPort>* port = nullptr;
         addOutput(port = createOutput<PortWithBackGround<PJ301MPort>>(Vec(4, yoffs+15), m, XMultiMod::OUT_MODOUT));
@@ -6,34 +6,139 @@
 #include <osdialog.h>
 #include "scalehelpers.h"
 
-inline int randomDiscrete(std::mt19937& rng,std::vector<float>& whs)
+// Batches the uniform draws from the Mersenne Twister, so that starting events
+// doesn't need to construct distribution objects or call into the generator for every value
+class StocRandom
 {
-    std::uniform_real_distribution<float> dist(0.0f,1.0f);
-    float accum = 0.0f;
-    for (int i=0;i<whs.size();++i)
-      accum+=whs[i];
-    // if all weights zero, just pick uniformly 
-    if (accum==0.0f)
-    {
-        std::uniform_int_distribution<int> idist(0,whs.size()-1);
-        return idist(rng);
+public:
+    StocRandom(unsigned int seed) : m_rng(seed) {}
+    void seed(unsigned int s)
+    {
+        m_rng = std::mt19937(s);
+        m_normdist.reset();
+        m_pos = m_buf.size();
     }
-    float scaler = 1.0f/accum;
-    float z = dist(rng);
-    int choice = -1;
-    accum = 0.0f;
-    for (int i=0;i<whs.size();++i)
+    inline float uniform()
     {
-        accum += whs[i] * scaler;
-        if (accum>=z)
+        if (m_pos == m_buf.size())
         {
-            choice = i;
-            break;
+            for (int i=0;i<(int)m_buf.size();++i)
+                m_buf[i] = (m_rng() >> 8) * (1.0f/16777216.0f);
+            m_pos = 0;
         }
-        
+        return m_buf[m_pos++];
     }
-    return choice;
-}
+    // inclusive range
+    inline int uniformInt(int minv, int maxv)
+    {
+        int r = minv + uniform() * (maxv-minv+1);
+        return std::min(r,maxv);
+    }
+    inline float normal()
+    {
+        return m_normdist(m_rng);
+    }
+private:
+    std::mt19937 m_rng;
+    std::normal_distribution<float> m_normdist{0.0f,1.0f};
+    std::array<float,64> m_buf;
+    size_t m_pos = 64;
+};
+
+// Walker/Vose alias table for O(1) weighted random choices, rebuilt only when the weights change
+template<int MaxSize>
+class AliasTable
+{
+public:
+    AliasTable()
+    {
+        std::fill(m_weights.begin(),m_weights.end(),-1.0f);
+    }
+    // returns true if the weights were different from before and the table was rebuilt
+    bool setWeights(const float* whs, int sz)
+    {
+        sz = std::min(sz,MaxSize);
+        bool changed = sz != m_size;
+        for (int i=0;i<sz;++i)
+        {
+            if (whs[i]!=m_weights[i])
+            {
+                changed = true;
+                break;
+            }
+        }
+        if (!changed)
+            return false;
+        m_size = sz;
+        float accum = 0.0f;
+        for (int i=0;i<sz;++i)
+        {
+            m_weights[i] = whs[i];
+            accum += std::max(whs[i],0.0f);
+        }
+        // if all weights zero, just pick uniformly 
+        std::array<float,MaxSize> scaled;
+        for (int i=0;i<sz;++i)
+        {
+            if (accum>0.0f)
+                scaled[i] = std::max(whs[i],0.0f) * sz / accum;
+            else
+                scaled[i] = 1.0f;
+        }
+        std::array<int,MaxSize> small;
+        std::array<int,MaxSize> large;
+        int numsmall = 0;
+        int numlarge = 0;
+        for (int i=0;i<sz;++i)
+        {
+            if (scaled[i]<1.0f)
+                small[numsmall++] = i;
+            else
+                large[numlarge++] = i;
+        }
+        while (numsmall>0 && numlarge>0)
+        {
+            int s = small[--numsmall];
+            int l = large[--numlarge];
+            m_prob[s] = scaled[s];
+            m_alias[s] = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+            if (scaled[l]<1.0f)
+                small[numsmall++] = l;
+            else
+                large[numlarge++] = l;
+        }
+        // leftovers are 1 within floating point error
+        while (numlarge>0)
+        {
+            int l = large[--numlarge];
+            m_prob[l] = 1.0f;
+            m_alias[l] = l;
+        }
+        while (numsmall>0)
+        {
+            int s = small[--numsmall];
+            m_prob[s] = 1.0f;
+            m_alias[s] = s;
+        }
+        return true;
+    }
+    // z0 and z1 are uniform random values in the 0..1 range
+    inline int choose(float z0, float z1) const
+    {
+        if (m_size == 0)
+            return 0;
+        int i = std::min((int)(z0*m_size),m_size-1);
+        if (z1<m_prob[i])
+            return i;
+        return m_alias[i];
+    }
+private:
+    std::array<float,MaxSize> m_weights;
+    std::array<float,MaxSize> m_prob;
+    std::array<int,MaxSize> m_alias;
+    int m_size = 0;
+};
 
 inline double quantize(double x, double step, double amount)
 {
@@ -86,12 +191,11 @@ public:
             m_Outs[i] = 0.0f;
         }
         std::fill(m_auxes.begin(),m_auxes.end(),0.0f);
-        m_quanScale.resize(4096);
     }
-    void setScale(std::vector<double> sc)
+    // Called from the audio thread with a scale acquired from the module's hand-off
+    void setScale(const QuantizeTable* sc)
     {
-        m_scaleToChangeTo = sc;
-        m_doScaleChange = true;
+        m_quanScale = sc;
     }
     void process(float deltatime)
     {
@@ -113,7 +217,7 @@ public:
             else
                 aenvphase = std::pow(normphase,rescale(m_amp_env_warp,0.0f,1.0f,1.0f,4.0f));
             */
-            float gain = m_amp_env->GetInterpolatedEnvelopeValue(aenvphase);
+            float gain = m_amp_cursor.valueAt(aenvphase);
             m_Outs[2] = rescale(gain,0.0f,1.0f,0.0f,10.0f);
         }
         
@@ -126,22 +230,17 @@ public:
             else
                 penvphase = std::pow(normphase,rescale(m_pitch_env_warp,0.0f,1.0f,1.0f,4.0f));
             */
-            if (m_doScaleChange == true)
-            {
-                m_quanScale = m_scaleToChangeTo;
-                m_doScaleChange = false;
-            }
-            float penvvalue = m_pitch_env.GetInterpolatedEnvelopeValue(penvphase);
+            float penvvalue = m_pitch_cursor.valueAt(penvphase);
             float qpitch = m_pitch;
-            if (mPitchQAmount>0.0f)
-                qpitch = quantize_to_grid(m_pitch,m_quanScale,mPitchQAmount);
+            if (mPitchQAmount>0.0f && m_quanScale)
+                qpitch = m_quanScale->quantize(m_pitch,mPitchQAmount);
             m_Outs[1] = reflect_value<float>(-60.0f,qpitch + penvvalue,60.0f);
         }
         for (int i=0;i<4;++i)
         {
             if (m_activeOuts[3+i])
             {
-                float env_val = m_aux_envs[i].GetInterpolatedEnvelopeValue(normphase);
+                float env_val = m_aux_cursors[i].valueAt(normphase);
                 m_Outs[3+i] = reflect_value<float>(-5.0f,m_auxes[i] + env_val ,5.0f); 
             }
         }
@@ -163,44 +262,39 @@ public:
     {
         return m_available;
     }
-    std::vector<double> m_quanScale;
-    std::vector<double> m_scaleToChangeTo;
-    std::atomic<bool> m_doScaleChange{false};
+    const QuantizeTable* m_quanScale = nullptr;
     void start(float dur, float centerpitch,float spreadpitch, breakpoint_envelope* ampenv,
         float glissprob, float gliss_spread, int penv, float aenvwspr, float penvwspr)
     {
-        std::uniform_real_distribution<float> dist(0.0f,1.0f);
-        std::uniform_int_distribution<int> shapedist(0,msnumtables-1);
-        std::normal_distribution<float> normdist(0.0f,1.0f);
         m_amp_env = ampenv;
         m_phase = 0.0;
         m_len = dur;
-        m_pitch = rescale(dist(*m_rng),0.0f,1.0f,centerpitch-spreadpitch,centerpitch+spreadpitch);
+        m_pitch = rescale(m_rng->uniform(),0.0f,1.0f,centerpitch-spreadpitch,centerpitch+spreadpitch);
         
         float glissdest = 0.0;
         auto& pt0 = m_pitch_env.GetNodeAtIndex(0);
         auto& pt1 = m_pitch_env.GetNodeAtIndex(1);
-        if (dist(*m_rng)<glissprob)
+        if (m_rng->uniform()<glissprob)
         {
             if (gliss_spread<0.0f)
             {
-                float kuma = Kumaraswamy(dist(*m_rng));
+                float kuma = Kumaraswamy(m_rng->uniform());
                 float spr = rescale(gliss_spread,-1.0f,0.0f,36.0f,0.0f);
                 glissdest = rescale(kuma,0.0f,1.0f,-spr,spr);
             }
             else if (gliss_spread<0.99)
             {
-                glissdest = normdist(*m_rng)*rescale(gliss_spread,0.0f,1.0f,0.0f,24.0f);
+                glissdest = m_rng->normal()*rescale(gliss_spread,0.0f,1.0f,0.0f,24.0f);
             }
             else
             {
-                float z = dist(*m_rng);
+                float z = m_rng->uniform();
                 float cauchy = std::tan(g_pi*(z-0.5));
                 glissdest = clamp(cauchy,-36.0f,36.0f);
             }
             int shap = penv;
             if (shap<0)
-                pt0.Shape = shapedist(*m_rng);
+                pt0.Shape = m_rng->uniformInt(0,msnumtables-1);
             else
                 pt0.Shape = shap;
         }
@@ -212,17 +306,17 @@ public:
             float auxy1 = 0.0f;
             if (m_aux_modes[i] == 0)
             {
-                auxy0 = rescale(dist(*m_rng),0.0f,1.0f,-5.0f,5.0f);
+                auxy0 = rescale(m_rng->uniform(),0.0f,1.0f,-5.0f,5.0f);
                 auxy1 = 0.0f;
             } else if (m_aux_modes[i] == 1)
             {
-                auxy0 = rescale(dist(*m_rng),0.0f,1.0f,-5.0f,5.0f);
-                auxy1 = rescale(dist(*m_rng),0.0f,1.0f,-5.0f,5.0f);
+                auxy0 = rescale(m_rng->uniform(),0.0f,1.0f,-5.0f,5.0f);
+                auxy1 = rescale(m_rng->uniform(),0.0f,1.0f,-5.0f,5.0f);
             } else if (m_aux_modes[i] == 2)
             {
-                float kuma = Kumaraswamy(dist(*m_rng));
+                float kuma = Kumaraswamy(m_rng->uniform());
                 auxy0 = rescale(kuma,0.0f,1.0f,-5.0f,5.0f);
-                kuma = Kumaraswamy(dist(*m_rng));
+                kuma = Kumaraswamy(m_rng->uniform());
                 auxy1 = rescale(kuma,0.0f,1.0f,-5.0f,5.0f);
             }
             m_auxes[i] = auxy0;
@@ -231,11 +325,21 @@ public:
 
         m_available = false;
         
-        m_amp_env_warp = normdist(*m_rng) * aenvwspr * 0.5f;
+        m_amp_env_warp = m_rng->normal() * aenvwspr * 0.5f;
         m_amp_env_warp = clamp(m_amp_env_warp,-1.0f,1.0f);
 
-        m_pitch_env_warp = normdist(*m_rng) * penvwspr * 0.5f;
+        m_pitch_env_warp = m_rng->normal() * penvwspr * 0.5f;
         m_pitch_env_warp = clamp(m_pitch_env_warp,-1.0f,1.0f);
+        // the envelope nodes were changed above, so the cursors need to start over
+        m_amp_cursor.setEnvelope(m_amp_env);
+        m_amp_cursor.reset(0.0);
+        m_pitch_cursor.setEnvelope(&m_pitch_env);
+        m_pitch_cursor.reset(0.0);
+        for (int i=0;i<4;++i)
+        {
+            m_aux_cursors[i].setEnvelope(&m_aux_envs[i]);
+            m_aux_cursors[i].reset(0.0);
+        }
     }
     void reset()
     {
@@ -244,7 +348,7 @@ public:
     }
     
     float m_startPos = 0.0f;
-    std::mt19937* m_rng = nullptr;
+    StocRandom* m_rng = nullptr;
     std::array<bool,7> m_activeOuts;
     std::array<float,7> m_Outs;
     int m_aux_modes[4] = {1,1,1,1};
@@ -256,6 +360,9 @@ private:
     breakpoint_envelope* m_amp_env = nullptr;
     
     std::array<breakpoint_envelope,4> m_aux_envs;
+    envelope_cursor m_amp_cursor;
+    envelope_cursor m_pitch_cursor;
+    std::array<envelope_cursor,4> m_aux_cursors;
     double m_phase = 0.0;
     double m_len = 0.5;
     float m_min_pitch = -24.0f;
@@ -334,11 +441,11 @@ public:
         auto thescale = Tunings::readSCLFile(fn);
         auto sc = semitonesFromScalaScale<double>(thescale,-60.0,60.0);
         for (int i=0;i<16;++i)
-        {
             m_voices[i].m_rng = &m_rng;
-            m_voices[i].setScale(sc);
-        }
+        // 0.01 semitone buckets over the pitch range
+        m_scaleHandoff.publish(std::make_shared<const QuantizeTable>(sc,-60.0f,60.0f,0.01f));
     }
+    ImmutableHandoff<QuantizeTable> m_scaleHandoff;
     XStochastic()
     {
         std::string dir = asset::plugin(pluginInstance, "res/scala_scales");
@@ -409,9 +516,6 @@ public:
         m_pitch_amp_response.AddNode({24.0f,1.0f,2});
         m_pitch_amp_response.AddNode({48.0f,0.05f,2});
         
-        ampEnvWhs.resize(16);
-        pitchEnvWhs.resize(16);
-
         config(PAR_LAST,IN_LAST,OUT_LAST);
         configParam(PAR_MASTER_MEANDUR,0.1,2.0,0.5,"Master mean duration");
         configParam(PAR_MASTER_GLISSPROB,0.0,1.0,0.5,"Master glissando probability");
@@ -449,7 +553,19 @@ public:
             getParamQuantity(PAR_AUXQUANT+i)->snapEnabled = true;
         }
 
-        m_rng = std::mt19937(256);
+        m_rng.seed(256);
+        m_weightsDivider.setDivision(64);
+        updateWeightTables();
+    }
+    void updateWeightTables()
+    {
+        float whs[16];
+        for (int i=0;i<m_numAmpEnvs;++i)
+            whs[i] = params[PAR_DISPLAY_WEIGHT+i].getValue();
+        m_ampEnvAlias.setWeights(whs,m_numAmpEnvs);
+        for (int i=0;i<msnumtables;++i)
+            whs[i] = params[PAR_DISPLAY_WEIGHT2+i].getValue();
+        m_pitchEnvAlias.setWeights(whs,msnumtables);
     }
     int m_curRandSeed = 256;
     int m_NumUsedVoices = 0;
@@ -463,13 +579,11 @@ public:
             
         }
         int numvoices = params[PAR_NUM_OUTPUTS].getValue();
+        if (m_weightsDivider.process())
+            updateWeightTables();
         if (m_phase >= m_nextEventPos)
         {
             //++m_eventCounter;
-            std::uniform_real_distribution<float> dist(0.0f,1.0f);
-            std::uniform_int_distribution<int> voicedist(0,numvoices-1);
-            std::uniform_int_distribution<int> vcadist(0,m_numAmpEnvs-1);
-            std::normal_distribution<float> durdist(0.0f,1.0f);
             float glissprob = params[PAR_MASTER_GLISSPROB].getValue();
             glissprob += inputs[IN_GLISS_PROB].getVoltage() * 0.1f * params[PAR_GLISSPROB_CV].getValue();
             glissprob = clamp(glissprob,0.0f,1.0f);
@@ -484,57 +598,49 @@ public:
             int numpitchcvchans = inputs[IN_PITCH_CENTER].getChannels();
             if (numpitchcvchans>0)
             {
-                std::uniform_int_distribution<int> pitchdist(0,inputs[IN_PITCH_CENTER].getChannels()-1);
-                int indx = pitchdist(m_rng);
+                int indx = m_rng.uniformInt(0,numpitchcvchans-1);
                 centerpitch += inputs[IN_PITCH_CENTER].getVoltage(indx)*12.0;
                 centerpitch = clamp(centerpitch,-60.0,60.0f);
             }
             float spreadpitch = params[PAR_MASTER_PITCH_SPREAD].getValue();
             spreadpitch += inputs[IN_PITCH_SPREAD].getVoltage() * 4.8f * params[PAR_PITCHSPREAD_CV].getValue();
             spreadpitch = clamp(spreadpitch,0.0f,48.0f);
-            int manual_amp_env = params[PAR_MASTER_AMP_ENV_TYPE].getValue();
-            for (int i=0;i<m_numAmpEnvs;++i)
-                ampEnvWhs[i] = params[PAR_DISPLAY_WEIGHT+i].getValue();
-            manual_amp_env = randomDiscrete(m_rng,ampEnvWhs);
+            int manual_amp_env = m_ampEnvAlias.choose(m_rng.uniform(),m_rng.uniform());
             if (manual_amp_env>=m_numAmpEnvs)
                 manual_amp_env = 0;
-            //int manual_pitch_env = params[PAR_MASTER_PITCH_ENV_TYPE].getValue();
-            for (int i=0;i<msnumtables;++i)
-                pitchEnvWhs[i] = params[PAR_DISPLAY_WEIGHT2+i].getValue();
-            int manual_pitch_env = randomDiscrete(m_rng,pitchEnvWhs);
+            int manual_pitch_env = m_pitchEnvAlias.choose(m_rng.uniform(),m_rng.uniform());
             if (manual_pitch_env>=msnumtables)
                 manual_pitch_env = 0;
             float aenvwarp = params[PAR_AMP_ENV_WARP_SPREAD].getValue();
             float pitchenvwarp = params[PAR_PITCH_ENV_WARP_SPREAD].getValue();
             
-            for (int i=0;i<numvoices;++i)
+            // rotate the free voices mask so that the search starts from the last allocated voice
+            uint32_t activemask = (1u << numvoices) - 1;
+            uint32_t freemask = m_freeVoices & activemask;
+            if (freemask != 0)
             {
-                int voiceIndex = (m_lastAllocatedVoice+i) % numvoices;
-                if (m_voices[voiceIndex].isAvailable())
+                int startvoice = m_lastAllocatedVoice % numvoices;
+                uint32_t rotated = ((freemask >> startvoice) | (freemask << (numvoices - startvoice))) & activemask;
+                int voiceIndex = (startvoice + __builtin_ctz(rotated)) % numvoices;
+                m_voices[voiceIndex].m_startPos = m_nextEventPos;
+                float evdur = meandur + m_rng.normal()*durdev;
+                evdur = clamp(evdur,0.05,8.0);
+                int ampenv = manual_amp_env;
+                for (int j=0;j<4;++j)
                 {
-                    m_voices[voiceIndex].m_startPos = m_nextEventPos;
-                    float evdur = meandur + durdist(m_rng)*durdev;
-                    evdur = clamp(evdur,0.05,8.0);
-                    //int ampenv = manual_amp_env - 1;
-                    //if (ampenv < 0)
-                    //    ampenv = vcadist(m_rng);
-                    int ampenv = manual_amp_env;
-                    for (int j=0;j<4;++j)
-                    {
-                        m_voices[voiceIndex].m_aux_modes[j] = params[PAR_AUXMODE+j].getValue();
-                        m_voices[voiceIndex].m_aux_quants[j] = params[PAR_AUXQUANT+j].getValue();
-                    }
-                    m_voices[voiceIndex].start(evdur,centerpitch,spreadpitch,
-                        &m_amp_envelopes[ampenv],glissprob,gliss_spread,manual_pitch_env,
-                        aenvwarp,pitchenvwarp);
-                    ++m_eventCounter;
-                    m_lastAllocatedVoice = voiceIndex;
-                    break;
+                    m_voices[voiceIndex].m_aux_modes[j] = params[PAR_AUXMODE+j].getValue();
+                    m_voices[voiceIndex].m_aux_quants[j] = params[PAR_AUXQUANT+j].getValue();
                 }
+                m_voices[voiceIndex].start(evdur,centerpitch,spreadpitch,
+                    &m_amp_envelopes[ampenv],glissprob,gliss_spread,manual_pitch_env,
+                    aenvwarp,pitchenvwarp);
+                m_freeVoices &= ~(1u << voiceIndex);
+                ++m_eventCounter;
+                m_lastAllocatedVoice = voiceIndex;
             }
             
             double qamt = params[PAR_RATE_QUAN_AMOUNT].getValue();
-            double deltatime = -log(dist(m_rng))/density;
+            double deltatime = -log(m_rng.uniform())/density;
             deltatime = clamp(deltatime,args.sampleTime,30.0f);
             double evpos = m_nextEventPos + deltatime;
             float qstep = std::pow(2.0f,params[PAR_RATE_QUAN_STEP].getValue());
@@ -567,13 +673,17 @@ public:
         outputs[OUT_AUX3].setChannels(numvoices);
         outputs[OUT_AUX4].setChannels(numvoices);
         float pqamt = params[PAR_PITCHQUANAMOUNT].getValue();
+        const QuantizeTable* curscale = m_scaleHandoff.acquire();
         for (int i=0;i<numvoices;++i)
         {
             std::array<float,7> vouts{0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f};
             if (m_voices[i].isAvailable()==false && m_phase>=m_voices[i].m_startPos)
             {
                 m_voices[i].setPitchQuantAount(pqamt);
+                m_voices[i].setScale(curscale);
                 m_voices[i].process(args.sampleTime);
+                if (m_voices[i].isAvailable())
+                    m_freeVoices |= 1u << i;
                 
                 //float aresp = m_pitch_amp_response.GetInterpolatedEnvelopeValue(vouts[1]); 
                 //vouts[2] *= m_voices[i].m_amp_resp_smoother.process(aresp); 
@@ -593,11 +703,18 @@ public:
             m_nextEventPos = 0.0;
             m_phase = 0.0;
             m_eventCounter = 0;
-            m_rng = std::mt19937(m_curRandSeed);
+            m_rng.seed(m_curRandSeed);
             for (int i=0;i<numvoices;++i)
             {
                 m_voices[i].reset();
             }
+            // the voices above the current count aren't reset, so those that are still busy stay allocated
+            m_freeVoices = 0;
+            for (int i=0;i<16;++i)
+            {
+                if (m_voices[i].isAvailable())
+                    m_freeVoices |= 1u << i;
+            }
         }
         m_phase += args.sampleTime;
     }
@@ -619,14 +736,17 @@ public:
         }
     }
     unsigned int m_randSeed = 1;
-    std::vector<float> ampEnvWhs;
-    std::vector<float> pitchEnvWhs;
     breakpoint_envelope m_amp_envelopes[16];
 private:
     double m_phase = 0.0f;
     double m_nextEventPos = 0.0f;
-    std::mt19937 m_rng{m_randSeed};
+    StocRandom m_rng{m_randSeed};
     StocVoice m_voices[16];
+    // bit set for each voice that is free to start a new event
+    uint32_t m_freeVoices = 0xffff;
+    AliasTable<16> m_ampEnvAlias;
+    AliasTable<16> m_pitchEnvAlias;
+    dsp::ClockDivider m_weightsDivider;
     
     breakpoint_envelope m_pitch_amp_response;
     dsp::SchmittTrigger m_resetTrigger;
@@ -4,21 +4,14 @@
 // #include "lualib.h"
 // #include "lauxlib.h"
 
-class TimeSeqEvent
-{
-public:
-    TimeSeqEvent() {}
-    TimeSeqEvent(double t, double d) : m_time(t), m_dur(d) {}
-    double m_time = 0.0;
-    double m_dur = 0.0;
-};
-
+// Generates the sequence events lazily in time order, so only the current and the next event
+// exist at any time. The random algorithm draws the uniform order statistics directly instead of
+// sorting, and parameter changes only affect the events that haven't been generated yet.
 class TimeSeqEngine
 {
 public:
     TimeSeqEngine()
     {
-        m_events.resize(65536);
     }
     void genrateLuaEvents()
     {
@@ -26,44 +19,18 @@ public:
         //luaL_openlibs (lua);
         //lua_close(lua);
     }
+    // Restarts the sequence from the beginning
     void generateEvents()
     {
-        int numevents = clamp((int)(m_dur * m_density),1,m_events.size());
-        m_num_events = numevents;
-        for (int i=0;i<numevents;++i)
-        {
-            float normtime = 0.0f;
-            if (m_algo == 0)
-            {
-                normtime = rescale((float)i,0,numevents,0.0f,1.0f);
-                if (m_par1<0.5f)
-                {
-                    float d = rescale(m_par1,0.0f,0.5f,4.0f,1.0f);
-                    normtime = std::pow(normtime,d);
-                } else
-                {
-                    float d = rescale(m_par1,0.5f,1.0f,1.0f,4.0f);
-                    normtime = 1.0f-std::pow(1.0f-normtime,d);
-                }
-            }
-                
-            else
-                normtime = rack::random::uniform();
-            normtime = rescale(normtime,0.0f,1.0f,m_start_time,m_end_time);
-            float t = m_dur * normtime;
-            m_events[i] = {t,0.0};
-        }
-        std::sort(m_events.begin(),m_events.begin()+numevents,
-            [](const TimeSeqEvent& a, const TimeSeqEvent& b){ return a.m_time<b.m_time; });
-        for (int i=0;i<numevents-1;++i)
-        {
-            double dur = m_events[i+1].m_time-m_events[i].m_time;
-            m_events[i].m_dur = dur;
-        }
-        m_events[numevents-1].m_dur = m_dur - m_events[numevents-1].m_time;
+        m_num_events = calcNumEvents();
+        m_gen_index = 0;
+        m_last_norm = 0.0f;
+        m_last_time = 0.0;
         m_cur_event = 0;
         m_seqphase = 0.0;
-        
+        m_cur_time = generateNextEventTime();
+        m_next_time = generateNextEventTime();
+        m_doUpdate = false;
     }
     void process(float deltatime,float& out,float& eoc)
     {
@@ -73,12 +40,10 @@ public:
             eoc = 0.0f;
             return;
         }
-            
-        auto& ev = m_events[m_cur_event];
-        double ph = ev.m_time - m_seqphase;
-        double ev_gate_end = ev.m_time+ev.m_dur*m_gatelen;
-        double ev_end = ev.m_time+ev.m_dur;
-        if (m_seqphase>=ev.m_time && m_seqphase<ev_gate_end)
+        double ev_dur = m_next_time - m_cur_time;
+        double ev_gate_end = m_cur_time+ev_dur*m_gatelen;
+        double ev_end = m_next_time;
+        if (m_seqphase>=m_cur_time && m_seqphase<ev_gate_end)
             out = 1.0f;
         else out = 0.0f;
         
@@ -86,25 +51,33 @@ public:
         eoc = 0.0f;
         if (m_seqphase>=ev_end)
         {
-            ++m_cur_event;
-            if (m_cur_event == m_num_events)
-                eoc = 1.0f;
             if (m_doUpdate)
             {
-                generateEvents();
+                // events already generated are kept, the changed parameters apply from the next one
+                m_num_events = std::max(calcNumEvents(),m_gen_index);
                 m_doUpdate = false;
             }
-                
+            ++m_cur_event;
+            if (m_cur_event == m_num_events)
+                eoc = 1.0f;
+            m_cur_time = m_next_time;
+            m_next_time = generateNextEventTime();
         }
         
     }
     void setDuration(float d)
     {
-        m_dur = clamp(d,0.5f,60.0f);
+        d = clamp(d,0.5f,60.0f);
+        if (d!=m_dur)
+            update();
+        m_dur = d;
     }
     void setDensity(float d)
     {
-        m_density = clamp(d,0.1f,32.0f);
+        d = clamp(d,0.1f,32.0f);
+        if (d!=m_density)
+            update();
+        m_density = d;
     }
     void setAlgo(int a)
     {
@@ -132,7 +105,44 @@ public:
         m_doUpdate = true;
     }
 //private:
-    std::vector<TimeSeqEvent> m_events;
+    int calcNumEvents() const
+    {
+        return clamp((int)(m_dur * m_density),1,65536);
+    }
+    // Returns the sequence duration when all the events have been generated
+    double generateNextEventTime()
+    {
+        if (m_gen_index>=m_num_events)
+            return m_dur;
+        float normtime = 0.0f;
+        if (m_algo == 0)
+        {
+            normtime = rescale((float)m_gen_index,0,m_num_events,0.0f,1.0f);
+            if (m_par1<0.5f)
+            {
+                float d = rescale(m_par1,0.0f,0.5f,4.0f,1.0f);
+                normtime = std::pow(normtime,d);
+            } else
+            {
+                float d = rescale(m_par1,0.5f,1.0f,1.0f,4.0f);
+                normtime = 1.0f-std::pow(1.0f-normtime,d);
+            }
+        }
+        else
+        {
+            // the smallest of the remaining uniform values above the previous one
+            int remaining = m_num_events-m_gen_index;
+            float u = rack::random::uniform();
+            normtime = 1.0f-(1.0f-m_last_norm)*std::pow(u,1.0f/remaining);
+        }
+        m_last_norm = normtime;
+        normtime = rescale(normtime,0.0f,1.0f,m_start_time,m_end_time);
+        float t = m_dur * normtime;
+        ++m_gen_index;
+        // parameter changes may not move new events before the already generated ones
+        m_last_time = std::max<double>(t,m_last_time);
+        return m_last_time;
+    }
     float m_dur = 5.0f;
     float m_density = 4.0f;
     float m_gatelen = 0.5f;
@@ -143,6 +153,11 @@ public:
     float m_par2 = 0.5f;
     int m_cur_event = 0;
     int m_num_events = 0;
+    int m_gen_index = 0;
+    float m_last_norm = 0.0f;
+    double m_last_time = 0.0;
+    double m_cur_time = 0.0;
+    double m_next_time = 0.0;
     double m_seqphase = 0.0;
     bool m_doUpdate = false;
 };
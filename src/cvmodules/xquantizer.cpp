@@ -7,52 +7,86 @@
 
 const int NUM_QUANTIZERS = 8;
 
+// Quantizer data built on the GUI thread and handed to the audio thread
+class QuantizerData
+{
+public:
+    QuantizerData(std::vector<float> g) : grid(std::move(g))
+    {
+        std::sort(grid.begin(),grid.end());
+        // the rotated voltages wrap around the -5..5 range, so the lookup table is built
+        // over one period with the neighbouring periods included
+        std::vector<float> extended;
+        for (int i=-1;i<2;++i)
+            for (auto& e : grid)
+                extended.push_back(e+i*10.0f);
+        table = QuantizeTable(extended,-5.0f,5.0f,0.001f);
+    }
+    std::vector<float> grid;
+    QuantizeTable table;
+};
+
 class Quantizer
 {
 public:
     Quantizer()
     {
         voltages = {-5.0f,0.0f,5.0f};
-        transFormedVoltages = voltages;
+        publishVoltages();
     }
     void sortVoltages()
     {
         std::sort(voltages.begin(),voltages.end());
 
     }
-    
+    // Called from the audio thread
     float process(float x, float strength)
     {
-        return quantize_to_grid(x,transFormedVoltages,strength);
-        
+        if (!m_data || m_data->grid.empty())
+            return x;
+        // the nearest point of the periodically rotated grid, if it falls outside the -5..5 range
+        // the nearest wrapped voltage is the lowest or highest one
+        float y = x - rotateAmount;
+        float period = std::floor((y+5.0f)*0.1f)*10.0f;
+        float p = m_data->table.nearest(y-period) + period + rotateAmount;
+        if (p>5.0f)
+            p = m_wrappedMax;
+        else if (p<-5.0f)
+            p = m_wrappedMin;
+        return x + strength * (p - x);
     }
     int getNumVoltages() { return voltages.size(); }
     float getVoltage(int index)
     {
         return voltages[index];
     }
+    // The voltage setters are called from the GUI thread
     void setVoltage(int index, float v)
     {
         voltages[index] = v;
+        publishVoltages();
     }
     float getTransformedVoltage(int index)
     {
-        return transFormedVoltages[index];
+        return wrap_value(-5.0f,voltages[index]+rotateAmount,5.0f);
     }
     void setVoltages(std::vector<float> newVoltages)
     {
         voltages = newVoltages;
-        updateTransfomedVoltages();
+        publishVoltages();
     }
     std::vector<float> getVoltages()
     {
         return voltages;
     }
+    // Called from the audio thread
     void setRotateAmount(float amt)
     {
-        if (amt!=rotateAmount)
+        const QuantizerData* data = m_handoff.acquire();
+        if (amt!=rotateAmount || data!=m_data)
         {
             rotateAmount = amt;
+            m_data = data;
             updateTransfomedVoltages();
         }
         
@@ -61,17 +95,26 @@ public:
     void updateTransfomedVoltages()
     {
         ++transformCount;
-        if (transFormedVoltages.size()!=voltages.size())
-            transFormedVoltages.resize(voltages.size());
-        for (int i=0;i<voltages.size();++i)
+        m_wrappedMin = 5.0f;
+        m_wrappedMax = -5.0f;
+        for (auto& e : m_data->grid)
         {
-            transFormedVoltages[i] = wrap_value(-5.0f,voltages[i]+rotateAmount,5.0f);
+            float v = wrap_value(-5.0f,e+rotateAmount,5.0f);
+            m_wrappedMin = std::min(m_wrappedMin,v);
+            m_wrappedMax = std::max(m_wrappedMax,v);
         }
     }
 private:
+    void publishVoltages()
+    {
+        m_handoff.publish(std::make_shared<const QuantizerData>(voltages));
+    }
     std::vector<float> voltages;
-    std::vector<float> transFormedVoltages;
     float rotateAmount = 0.0f;
+    ImmutableHandoff<QuantizerData> m_handoff;
+    const QuantizerData* m_data = nullptr;
+    float m_wrappedMin = -5.0f;
+    float m_wrappedMax = 5.0f;
 };
 
 class XQuantModule : public rack::Module
@@ -94,20 +137,15 @@ public:
         ENUMS(AMOUNT_PARAM, 8),
         ENUMS(ROTATE_PARAM, 8)
     };
-    std::vector<float> heldOutputs;
-    std::vector<float> triggerOutputs;
-    std::atomic<bool> shouldUpdate{false};
-    std::vector<float> swapVector;
-    int whichQToUpdate = -1;
+    float heldOutputs[NUM_QUANTIZERS][16];
     Quantizer quantizers[NUM_QUANTIZERS];
-    dsp::ClockDivider divider;
-    dsp::PulseGenerator triggerPulses[8];
+    dsp::PulseGenerator triggerPulses[NUM_QUANTIZERS][16];
     
     XQuantModule()
     {
-        divider.setDivision(128);
-        heldOutputs.resize(NUM_QUANTIZERS);
-        triggerOutputs.resize(NUM_QUANTIZERS,0.0f);
+        for (int i=0;i<NUM_QUANTIZERS;++i)
+            for (int j=0;j<16;++j)
+                heldOutputs[i][j] = 0.0f;
         config(16,NUM_INPUTS,NUMOUTPUTS);
         for (int i=0;i<8;++i)
         {
@@ -121,9 +159,7 @@ public:
     {
         if (dosort)
             std::sort(values.begin(),values.end());
-        swapVector = values;
-        whichQToUpdate = index;
-        shouldUpdate = true;
+        quantizers[index].setVoltages(values);
     }
     void updateSingleQuantizerValue(int quantizerindex, int index, float value)
     {
@@ -131,50 +167,43 @@ public:
     }
     void process(const ProcessArgs& args) override
     {
-        if (divider.process())
+        for (int i=0;i<8;++i)
         {
-            if (shouldUpdate)
-            {
-                shouldUpdate = false;
-                quantizers[whichQToUpdate].setVoltages(swapVector);
-                whichQToUpdate = -1;
-            }
+            float strength = params[AMOUNT_PARAM+i].getValue();
+            float rot = params[ROTATE_PARAM+i].getValue();
+            rot += inputs[FIRST_ROT_CV_INPUT+i].getVoltage();
+            rot = clamp(rot,-5.0f,5.0f);
+            quantizers[i].setRotateAmount(rot);
             
-            for (int i=0;i<8;++i)
+            if (outputs[i].isConnected())
             {
-                float strength = params[AMOUNT_PARAM+i].getValue();
-                float rot = params[ROTATE_PARAM+i].getValue();
-                rot += inputs[FIRST_ROT_CV_INPUT+i].getVoltage();
-                rot = clamp(rot,-5.0f,5.0f);
-                quantizers[i].setRotateAmount(rot);
-                
-                if (outputs[i].isConnected())
+                int numchans = std::max(1,inputs[i].getChannels());
+                outputs[i].setChannels(numchans);
+                bool gatesConnected = outputs[FIRSTGATEOUTPUT+i].isConnected();
+                if (gatesConnected)
+                    outputs[FIRSTGATEOUTPUT+i].setChannels(numchans);
+                for (int j=0;j<numchans;++j)
                 {
-                    float quanval = quantizers[i].process(inputs[i].getVoltage(),strength);
+                    float quanval = quantizers[i].process(inputs[i].getVoltage(j),strength);
                     bool outchanged = false;
-                    if (fabs(heldOutputs[i]-quanval)>0.04666)
+                    if (fabs(heldOutputs[i][j]-quanval)>0.04666)
                         outchanged = true;
-                    heldOutputs[i] = quanval;
-                    if (outputs[FIRSTGATEOUTPUT+i].isConnected() && outchanged)
+                    heldOutputs[i][j] = quanval;
+                    outputs[i].setVoltage(quanval,j);
+                    if (gatesConnected)
                     {
-                        if (triggerPulses[i].remaining>0.0)
-                            triggerPulses[i].reset();
-                        triggerPulses[i].trigger(0.002);
+                        if (outchanged)
+                        {
+                            if (triggerPulses[i][j].remaining>0.0)
+                                triggerPulses[i][j].reset();
+                            triggerPulses[i][j].trigger(0.002);
+                        }
+                        float triggerOut = triggerPulses[i][j].process(args.sampleTime);
+                        outputs[FIRSTGATEOUTPUT+i].setVoltage(triggerOut*10.0f,j);
                     }
                 }
             }
         }
-        for (int i=0;i<8;++i)
-        {
-            if (outputs[i].isConnected())
-            {
-                outputs[i].setVoltage(heldOutputs[i]);
-                float triggerOut = triggerPulses[i].process(args.sampleTime);
-                outputs[FIRSTGATEOUTPUT+i].setVoltage(triggerOut*10.0f);
-            }
-            
-        }
-        
     }
     json_t* dataToJson() override
     {
@@ -209,8 +238,8 @@ public:
                         float v = json_number_value(json_array_get(array2J,j));
                         volts.push_back(v);
                     }
+                    std::sort(volts.begin(),volts.end());
                     quantizers[i].setVoltages(volts);
-                    quantizers[i].sortVoltages();
                 }
             }
         }
@@ -594,7 +623,7 @@ public:
             nvgLineTo(args.vg,xcor,box.size.y);
             nvgStroke(args.vg);
         }
-        float xcor = rescale(qmod->heldOutputs[which_],-5.0f,5.0f,0.0,box.size.x);
+        float xcor = rescale(qmod->heldOutputs[which_][0],-5.0f,5.0f,0.0,box.size.x);
         nvgStrokeColor(args.vg,nvgRGB(255,0,0));
         nvgBeginPath(args.vg);
         nvgMoveTo(args.vg,xcor,box.size.y*0.75);
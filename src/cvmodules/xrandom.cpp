@@ -38,6 +38,67 @@ private:
     float m_cur_seed = 0.0f;
 };
 
+// xoshiro128** with the state initialized from the seed via SplitMix64.
+// Unlike the Mersenne Twister, the state is just 4 words, so reseeding is cheap
+// enough to be done with CV at the control rate.
+class Xoshiro128 final : public EntropySource
+{
+public:
+    Xoshiro128()
+    {
+        setSeed(0.0f,true);
+    }
+    std::string getName() override { return "Xoshiro128**"; }
+    void setSeed(float s, bool force) override
+    {
+        if (s!=m_cur_seed || force)
+        {
+            uint64_t sm = (uint64_t)(s*4294967296.0);
+            for (int i=0;i<2;++i)
+            {
+                uint64_t z = splitmix64(sm);
+                m_state[i*2] = z & 0xffffffff;
+                m_state[i*2+1] = z >> 32;
+            }
+            // all zeros state would only produce zeros
+            if ((m_state[0] | m_state[1] | m_state[2] | m_state[3]) == 0)
+                m_state[0] = 1;
+            m_cur_seed = s;
+        }
+    }
+    void generate(float* dest, int sz) override
+    {
+        for (int i=0;i<sz;++i)
+            dest[i] = (next() >> 8) * (1.0f/16777216.0f);
+    }
+private:
+    static inline uint64_t splitmix64(uint64_t& x)
+    {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    static inline uint32_t rotl(uint32_t x, int k)
+    {
+        return (x << k) | (x >> (32 - k));
+    }
+    inline uint32_t next()
+    {
+        const uint32_t result = rotl(m_state[1] * 5, 7) * 9;
+        const uint32_t t = m_state[1] << 9;
+        m_state[2] ^= m_state[0];
+        m_state[3] ^= m_state[1];
+        m_state[1] ^= m_state[2];
+        m_state[0] ^= m_state[3];
+        m_state[2] ^= t;
+        m_state[3] = rotl(m_state[3], 11);
+        return result;
+    }
+    uint32_t m_state[4];
+    float m_cur_seed = 0.0f;
+};
+
 class LogisticChaos final : public EntropySource 
 {
 public:
@@ -167,6 +228,122 @@ inline float BoxMullerNormal(float mu, float sigma,F&& EntropyFunc)
     return z0;
 }
 
+// Tabulated inverse cumulative distribution function, so that drawing a random value
+// is just a table lookup with linear interpolation of a uniform variate.
+// The first and last tailBins bins of the table are tabulated again on a grid that is logarithmic
+// in the distance of u from 0 or 1, so that the tails of the distributions with infinite
+// support follow the real distribution instead of a line over a huge range of values.
+class InverseCDFTable
+{
+public:
+    static const int tableSize = 4096;
+    static const int tailSize = 64;
+    static const int tailBins = 16;
+    InverseCDFTable()
+    {
+        std::fill(m_table.begin(),m_table.end(),0.0f);
+        std::fill(m_lowtail.begin(),m_lowtail.end(),0.0f);
+        std::fill(m_hightail.begin(),m_hightail.end(),0.0f);
+    }
+    // the uniform variable is kept away from 0 and 1 so that the distributions with infinite
+    // support still produce finite values at the ends of the table
+    template<typename F>
+    void buildFromQuantileFunction(F&& quantilefunc, double eps = 0.000001)
+    {
+        for (int i=0;i<tableSize+1;++i)
+        {
+            double u = std::min(std::max(1.0/tableSize*i,eps),1.0-eps);
+            m_table[i] = quantilefunc(u);
+        }
+        m_table[tableSize+1] = m_table[tableSize];
+        setTailGrid(eps);
+        for (int i=0;i<tailSize;++i)
+        {
+            double u = getTailU(i);
+            m_lowtail[i] = quantilefunc(u);
+            m_hightail[i] = quantilefunc(1.0-u);
+        }
+        m_lowtail[tailSize] = m_lowtail[tailSize-1];
+        m_hightail[tailSize] = m_hightail[tailSize-1];
+    }
+    // builds the table by numerically inverting the cumulative sum of a density
+    // sampled evenly between minx and maxx. works for any non-negative density,
+    // including ones that don't have a closed form quantile function
+    void buildFromDensity(const std::vector<float>& density, float minx, float maxx)
+    {
+        if (density.size()<2)
+            return;
+        std::vector<double> cdf(density.size());
+        cdf[0] = 0.0;
+        for (int i=1;i<(int)density.size();++i)
+            cdf[i] = cdf[i-1] + 0.5*(std::max(density[i-1],0.0f)+std::max(density[i],0.0f));
+        double total = cdf.back();
+        if (total<=0.0)
+        {
+            buildFromQuantileFunction([minx,maxx](double u){ return rescale((float)u,0.0f,1.0f,minx,maxx); });
+            return;
+        }
+        const double xstep = (maxx-minx)/(density.size()-1);
+        auto invert = [&cdf,total,minx,xstep](double u) -> double
+        {
+            double target = total*u;
+            int k = std::lower_bound(cdf.begin()+1,cdf.end()-1,target)-cdf.begin()-1;
+            double seglen = cdf[k+1]-cdf[k];
+            double frac = 0.0;
+            if (seglen>0.0)
+                frac = std::min((target-cdf[k])/seglen,1.0);
+            return minx+xstep*(k+frac);
+        };
+        for (int i=0;i<tableSize+1;++i)
+            m_table[i] = invert(1.0/tableSize*i);
+        m_table[tableSize+1] = m_table[tableSize];
+        // the density is only known to the resolution of its grid, so the tails don't need
+        // to go further out than that
+        setTailGrid(std::max(cdf[1]/total,1.0e-9));
+        for (int i=0;i<tailSize;++i)
+        {
+            double u = getTailU(i);
+            m_lowtail[i] = invert(u);
+            m_hightail[i] = invert(1.0-u);
+        }
+        m_lowtail[tailSize] = m_lowtail[tailSize-1];
+        m_hightail[tailSize] = m_hightail[tailSize-1];
+    }
+    inline float sample(float u) const
+    {
+        u = clamp(u,0.0f,1.0f);
+        float pos = u*tableSize;
+        if (pos<tailBins)
+            return sampleTail(m_lowtail,u);
+        if (pos>tableSize-tailBins)
+            return sampleTail(m_hightail,1.0f-u);
+        return interpolateLinear(m_table.data(),pos);
+    }
+private:
+    // the tail grid goes from eps to tailBins/tableSize, where the main table takes over
+    void setTailGrid(double eps)
+    {
+        m_taileps = eps;
+        m_taillogscale = (tailSize-1)/std::log((double)tailBins/(tableSize*eps));
+    }
+    double getTailU(int i) const
+    {
+        return m_taileps*std::pow((double)tailBins/(tableSize*m_taileps),(double)i/(tailSize-1));
+    }
+    inline float sampleTail(const std::array<float,tailSize+1>& tail, float d) const
+    {
+        d = std::max(d,m_taileps);
+        float pos = std::min(std::log(d/m_taileps)*m_taillogscale,tailSize-1.0f);
+        return interpolateLinear(tail.data(),pos);
+    }
+    // with guard points
+    std::array<float,tableSize+2> m_table;
+    std::array<float,tailSize+1> m_lowtail;
+    std::array<float,tailSize+1> m_hightail;
+    float m_taileps = 0.000001f;
+    float m_taillogscale = 0.0f;
+};
+
 class RandomEngine
 {
 public:
@@ -178,6 +355,7 @@ public:
         m_entsources.emplace_back(new LehmerRandom(41,401));
         m_entsources.emplace_back(new LehmerRandom(16807,2147483647));
         m_entsources.emplace_back(new LogisticChaos);
+        m_entsources.emplace_back(new Xoshiro128);
         
         for (int i=0;i<m_entbuf.size();++i)
             m_entbuf[i] = 0.0f;
@@ -223,13 +401,27 @@ public:
     }
     void setDistributionType(int t)
     {
-        m_distType = rack::math::clamp(t,0,D_LAST-1);
+        t = rack::math::clamp(t,0,D_LAST-1);
+        if (t==m_distType)
+            return;
+        m_distType = t;
+        updateLocationAndScale();
     }
     void setDistributionParameters(float p0, float p1)
     {
-        m_distpar0 = rack::math::clamp(p0,-1.0f,1.0f);
-        m_distpar1 = rack::math::clamp(p1,0.0f,1.0f);
+        p0 = rack::math::clamp(p0,-1.0f,1.0f);
+        p1 = rack::math::clamp(p1,0.0f,1.0f);
+        if (p0==m_distpar0 && p1==m_distpar1)
+            return;
+        m_distpar0 = p0;
+        m_distpar1 = p1;
+        updateLocationAndScale();
     }
+    void setTableSampling(bool b)
+    {
+        m_useTables = b;
+    }
+    bool getTableSampling() { return m_useTables; }
     void setOutputLimitMode(int m)
     {
         m_clipType = clamp(m,0,2);
@@ -263,6 +455,66 @@ public:
         D_TRIANGULAR,
         D_LAST
     };
+    // All the distributions are location-scale families, so the inverse CDF tables
+    // can be made for the standard forms once and shared by all the engine instances.
+    // The distribution parameters then only map to the location and scale applied to the table output.
+    static double standardQuantile(int dtype, double u)
+    {
+        if (dtype == D_UNIFORM)
+            return 2.0*u-1.0;
+        if (dtype == D_CAUCHY)
+            return std::tan(g_pi*(u-0.5));
+        if (dtype == D_UNIEXP)
+            return -std::log(1.0-u);
+        if (dtype == D_ARCSINE)
+            return std::sin(g_pi*(u-0.5));
+        if (dtype == D_BIEXP)
+        {
+            if (u<0.5)
+                return std::log(2.0*u);
+            return -std::log(2.0-2.0*u);
+        }
+        if (dtype == D_LINEAR)
+            return 1.0-std::sqrt(1.0-u);
+        if (dtype == D_TRIANGULAR)
+        {
+            if (u<0.5)
+                return -(1.0-std::sqrt(2.0*u));
+            return 1.0-std::sqrt(2.0-2.0*u);
+        }
+        if (dtype == D_HYPCOS)
+            return std::log(std::tan((g_pi*u)/2.0));
+        if (dtype == D_LOGISTIC)
+            return -std::log(1.0/u-1.0);
+        return u;
+    }
+    static const std::array<InverseCDFTable,D_LAST>& getInverseCDFTables()
+    {
+        // function local static, so the tables are built on first use by the first engine
+        // constructed, which happens on the UI thread when the module is created
+        static const std::array<InverseCDFTable,D_LAST> tables = []()
+        {
+            std::array<InverseCDFTable,D_LAST> result;
+            for (int i=0;i<D_LAST;++i)
+            {
+                if (i == D_GAUSS)
+                {
+                    // no closed form quantile for the normal distribution, so build from the density
+                    std::vector<float> density(16384);
+                    for (int j=0;j<(int)density.size();++j)
+                    {
+                        float x = rescale((float)j,0.0f,(float)density.size()-1,-7.0f,7.0f);
+                        density[j] = std::exp(-0.5f*x*x);
+                    }
+                    result[i].buildFromDensity(density,-7.0f,7.0f);
+                }
+                else
+                    result[i].buildFromQuantileFunction([i](double u){ return standardQuantile(i,u); });
+            }
+            return result;
+        }();
+        return tables;
+    }
     std::string getDistributionName(int index)
     {
         if (index == -1)
@@ -300,6 +552,8 @@ public:
     inline float getNextShaped()
     {
         float z = getNextEntropy();
+        if (m_useTables)
+            return m_dist_loc + m_dist_scale * m_invcdfs[m_distType].sample(z);
         if (m_distType == D_UNIFORM) // uniform
         {
             float eshift = rack::math::rescale(m_distpar0,-1.0f,1.0f,-5.0,5.0f);
@@ -471,6 +725,29 @@ public:
         
     }
     float getQuantizeStep() { return m_quantSteps; }
+    // location and scale for the table sampling, matching the parameter mappings in getNextShaped
+    void updateLocationAndScale()
+    {
+        float shift = rack::math::rescale(m_distpar0,-1.0f,1.0f,-5.0f,5.0f);
+        m_dist_loc = shift;
+        if (m_distType == D_UNIFORM || m_distType == D_ARCSINE || m_distType == D_LINEAR 
+            || m_distType == D_TRIANGULAR)
+            m_dist_scale = rack::math::rescale(m_distpar1,0.0f,1.0f,0.0f,5.0f);
+        else if (m_distType == D_GAUSS)
+            m_dist_scale = rack::math::rescale(m_distpar1,0.0f,1.0f,0.0f,3.0f);
+        else if (m_distType == D_CAUCHY)
+            m_dist_scale = rack::math::rescale(std::pow(m_distpar1,3.0f),0.0f,1.0f,0.0f,3.0f);
+        else if (m_distType == D_UNIEXP || m_distType == D_BIEXP)
+            m_dist_scale = 1.0f/rack::math::rescale(m_distpar1,0.0f,1.0f,0.0001f,5.0f);
+        else if (m_distType == D_HYPCOS)
+            m_dist_scale = rack::math::rescale(m_distpar1,0.0f,1.0f,0.0f,3.0f);
+        else if (m_distType == D_LOGISTIC)
+        {
+            float espread = rack::math::rescale(m_distpar1,0.0f,1.0f,0.05f,10.0f);
+            m_dist_loc = shift/espread;
+            m_dist_scale = 1.0f/espread;
+        }
+    }
     void reset()
     {
         m_phase = 0.0;
@@ -520,6 +797,10 @@ private:
     float m_rand_walk = 0.0f;
     int m_smoothingMode = E_LINEAR;
     std::normal_distribution<float> m_dist_normal{0.0,1.0};
+    const std::array<InverseCDFTable,D_LAST>& m_invcdfs = getInverseCDFTables();
+    bool m_useTables = false;
+    float m_dist_loc = 0.0f;
+    float m_dist_scale = 5.0f;
 };
 
 class XRandomModule : public Module
@@ -617,6 +898,7 @@ public:
                 m_eng[i].setDistributionParameters(dpar0,dpar1);
                 int dtype = params[PAR_DIST_TYPE].getValue();
                 m_eng[i].setDistributionType(dtype);
+                m_eng[i].setTableSampling(m_table_sampling);
                 int lmode = params[PAR_LIMIT_TYPE].getValue();
                 m_eng[i].setOutputLimitMode(lmode);
                 float lim_min = params[PAR_LIMIT_MIN].getValue();
@@ -633,7 +915,9 @@ public:
                 int smoothingmode = params[PAR_SMOOTHINGMODE].getValue();
                 m_eng[i].setSmoothingMode(smoothingmode);
                 float eseed = params[PAR_ENTROPY_SEED].getValue();
-                if (esource!=0) // Mersenne Twister is very expensive to initialize, might be a good idea to prevent CV control...
+                // Mersenne Twister is very expensive to initialize, so it doesn't get CV control,
+                // Xoshiro128** can be used instead when the seed needs to be modulated
+                if (esource!=0)
                     eseed += inputs[IN_SEED].getVoltage()*0.1f;
                 m_eng[i].setSeed(eseed);
             }
@@ -675,8 +959,21 @@ public:
         }
         
     }
+    json_t* dataToJson() override
+    {
+        json_t* resultJ = json_object();
+        json_object_set(resultJ,"tablesampling",json_boolean(m_table_sampling));
+        return resultJ;
+    }
+    void dataFromJson(json_t* root) override
+    {
+        if (auto j = json_object_get(root,"tablesampling")) m_table_sampling = json_boolean_value(j);
+    }
     RandomEngine m_eng[16];
     double m_tempo_estimate = 60.0;
+    // the table sampling is statistically the same but doesn't produce the same
+    // sequences as the direct formulas, so it's off by default to keep old patches as they were
+    bool m_table_sampling = false;
 private:
     dsp::SchmittTrigger m_reset_trig;
     dsp::SchmittTrigger m_tempo_trig;
@@ -707,6 +1004,15 @@ struct ParamEntry
 class XRandomModuleWidget : public ModuleWidget
 {
 public:
+    void appendContextMenu(Menu* menu) override
+    {
+        XRandomModule* m = dynamic_cast<XRandomModule*>(module);
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuItem([m]()
+        {
+            m->m_table_sampling = !m->m_table_sampling;
+        },"Table driven sampling (faster, different sequences)", CHECKMARK(m->m_table_sampling)));
+    }
     XRandomModuleWidget(XRandomModule *m)
     {
         using XR = XRandomModule;
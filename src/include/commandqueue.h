@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Bounded lock-free queue for sending small commands to the audio thread. Any number of
+// threads can push and one thread pops. The storage has a fixed size, so neither side
+// allocates. Based on Dmitry Vyukov's bounded MPMC queue, each cell has a sequence number
+// that tells whether it's free for the writers or ready for the reader.
+template<typename T, int Capacity>
+class CommandQueue
+{
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+public:
+    CommandQueue()
+    {
+        for (int i=0;i<Capacity;++i)
+            m_cells[i].sequence.store(i,std::memory_order_relaxed);
+    }
+    // Returns false and counts an overflow if the queue is full
+    bool push(const T& item)
+    {
+        uint32_t pos = m_writepos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = m_cells[pos & (Capacity - 1)];
+            uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+            int32_t diff = (int32_t)(seq - pos);
+            if (diff == 0)
+            {
+                if (m_writepos.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed))
+                {
+                    cell.item = item;
+                    cell.sequence.store(pos+1,std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                m_overflows.fetch_add(1,std::memory_order_relaxed);
+                return false;
+            }
+            else
+                pos = m_writepos.load(std::memory_order_relaxed);
+        }
+    }
+    // Reader thread only
+    bool pop(T& item)
+    {
+        Cell& cell = m_cells[m_readpos & (Capacity - 1)];
+        uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+        if ((int32_t)(seq - (m_readpos+1)) < 0)
+            return false;
+        item = cell.item;
+        cell.sequence.store(m_readpos+Capacity,std::memory_order_release);
+        ++m_readpos;
+        return true;
+    }
+    // Reader thread only. Passes at most budget items to f and returns how many were handled.
+    // Items beyond the budget stay in the queue for the next call, which is counted.
+    template<typename F>
+    int drain(F f, int budget)
+    {
+        T item;
+        int count = 0;
+        while (count < budget && pop(item))
+        {
+            f(item);
+            ++count;
+        }
+        if (count == budget && !empty())
+            m_deferrals.fetch_add(1,std::memory_order_relaxed);
+        return count;
+    }
+    // Reader thread only
+    bool empty() const
+    {
+        const Cell& cell = m_cells[m_readpos & (Capacity - 1)];
+        uint32_t seq = cell.sequence.load(std::memory_order_acquire);
+        return (int32_t)(seq - (m_readpos+1)) < 0;
+    }
+    // Number of pushes that failed because the queue was full
+    int getOverflowCount() const { return m_overflows.load(std::memory_order_relaxed); }
+    // Number of drains that left items in the queue because of the budget
+    int getDeferralCount() const { return m_deferrals.load(std::memory_order_relaxed); }
+private:
+    struct Cell
+    {
+        std::atomic<uint32_t> sequence{0};
+        T item;
+    };
+    Cell m_cells[Capacity];
+    // the writer and reader positions on separate cache lines
+    char m_pad0[64];
+    std::atomic<uint32_t> m_writepos{0};
+    char m_pad1[64];
+    uint32_t m_readpos = 0;
+    std::atomic<int> m_overflows{0};
+    std::atomic<int> m_deferrals{0};
+};
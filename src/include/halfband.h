@@ -0,0 +1,237 @@
+#pragma once
+
+#include "mischelpers.h"
+#include <cmath>
+#include <vector>
+
+// Half-band FIR filters for oversampling nonlinearities, processing 4 channels in a float_4.
+// Every second coefficient of a half-band filter is zero and the center coefficient is 0.5,
+// so only the K unique nonzero side coefficients are stored, and the filters run in
+// polyphase form at the lower sample rate.
+
+// Windowed sinc half-band design with a Kaiser window. Returns the side coefficients for the
+// offsets 1,3,5...2K-1 from the center, normalized for unity gain at DC.
+inline std::vector<float> makeHalfBandCoefficients(int K, double beta)
+{
+    auto bessel0 = [](double x)
+    {
+        double sum = 1.0;
+        double term = 1.0;
+        for (int i=1;i<50;++i)
+        {
+            term *= (x/(2.0*i))*(x/(2.0*i));
+            sum += term;
+        }
+        return sum;
+    };
+    std::vector<double> temp(K);
+    double half = 2.0*K;
+    double sum = 0.0;
+    for (int j=0;j<K;++j)
+    {
+        double offs = 2*j+1;
+        double r = offs/half;
+        double w = bessel0(beta*std::sqrt(1.0-r*r))/bessel0(beta);
+        temp[j] = std::sin(M_PI*offs/2.0)/(M_PI*offs)*w;
+        sum += 2.0*temp[j];
+    }
+    std::vector<float> result(K);
+    for (int j=0;j<K;++j)
+        result[j] = temp[j]*0.5/sum;
+    return result;
+}
+
+// Doubles the sample rate, the output is delayed by K-0.5 input samples
+template<int K>
+class HalfBandUpsampler
+{
+public:
+    HalfBandUpsampler(double beta = 8.0)
+    {
+        auto c = makeHalfBandCoefficients(K,beta);
+        for (int j=0;j<K;++j)
+            m_coeffs[j] = 2.0f*c[j];
+        reset();
+    }
+    void reset()
+    {
+        for (auto& e : m_hist)
+            e = 0.0f;
+        m_pos = 0;
+    }
+    void process(simd::float_4 in, simd::float_4* out)
+    {
+        m_hist[m_pos] = in;
+        m_hist[m_pos+2*K] = in;
+        m_pos = (m_pos+1) % (2*K);
+        // oldest to newest input
+        const simd::float_4* h = &m_hist[m_pos];
+        simd::float_4 acc = 0.0f;
+        for (int j=0;j<K;++j)
+            acc += m_coeffs[j]*(h[K-1-j]+h[K+j]);
+        out[0] = acc;
+        out[1] = h[K];
+    }
+private:
+    simd::float_4 m_hist[4*K];
+    float m_coeffs[K];
+    int m_pos = 0;
+};
+
+// Halves the sample rate, the output is delayed by K-1 output samples
+template<int K>
+class HalfBandDecimator
+{
+public:
+    HalfBandDecimator(double beta = 8.0)
+    {
+        auto c = makeHalfBandCoefficients(K,beta);
+        for (int j=0;j<K;++j)
+            m_coeffs[j] = c[j];
+        reset();
+    }
+    void reset()
+    {
+        for (auto& e : m_odd)
+            e = 0.0f;
+        for (auto& e : m_even)
+            e = 0.0f;
+        m_pos = 0;
+    }
+    simd::float_4 process(const simd::float_4* in)
+    {
+        m_even[m_pos] = in[0];
+        m_even[m_pos+2*K] = in[0];
+        m_odd[m_pos] = in[1];
+        m_odd[m_pos+2*K] = in[1];
+        m_pos = (m_pos+1) % (2*K);
+        const simd::float_4* h = &m_odd[m_pos];
+        simd::float_4 acc = 0.5f*m_even[m_pos+K];
+        for (int j=0;j<K;++j)
+            acc += m_coeffs[j]*(h[K-1-j]+h[K+j]);
+        return acc;
+    }
+private:
+    simd::float_4 m_even[4*K];
+    simd::float_4 m_odd[4*K];
+    float m_coeffs[K];
+    int m_pos = 0;
+};
+
+// 1x, 2x, 4x, 8x or 16x oversampling of 4 channels with a cascade of 2x stages. The first
+// stage has the steepest filter, the later stages only need to remove the images above the
+// passband of the stages before them.
+class HalfBandOversampler
+{
+public:
+    static const int maxFactor = 16;
+    static const int maxStages = 4;
+    void setFactor(int f)
+    {
+        int stages = 0;
+        while (stages < maxStages && (2 << stages) <= f)
+            ++stages;
+        if (stages != m_stages)
+        {
+            m_stages = stages;
+            reset();
+        }
+    }
+    int getFactor() const { return 1 << m_stages; }
+    // Delay of upsample followed by downsample, in samples at the base rate. Each stage
+    // delays by K-0.5 of its lower rate samples up and K-1 down.
+    float getLatency() const
+    {
+        static const int ks[maxStages] = {12,6,4,3};
+        float result = 0.0f;
+        for (int i=0;i<m_stages;++i)
+            result += (2.0f*ks[i]-1.5f)/(1 << i);
+        return result;
+    }
+    void reset()
+    {
+        m_up1.reset();
+        m_up2.reset();
+        m_up3.reset();
+        m_up4.reset();
+        m_down1.reset();
+        m_down2.reset();
+        m_down3.reset();
+        m_down4.reset();
+    }
+    // Writes getFactor() samples
+    void upsample(simd::float_4 in, simd::float_4* out)
+    {
+        if (m_stages == 0)
+        {
+            out[0] = in;
+            return;
+        }
+        simd::float_4 temp[maxFactor];
+        const simd::float_4* src = &in;
+        int n = 1;
+        for (int i=0;i<m_stages;++i)
+        {
+            // the stages alternate between the buffers so that the last one writes to out
+            simd::float_4* dest = ((m_stages-1-i) & 1) ? temp : out;
+            if (i == 0)
+                upsampleStage(m_up1,src,n,dest);
+            else if (i == 1)
+                upsampleStage(m_up2,src,n,dest);
+            else if (i == 2)
+                upsampleStage(m_up3,src,n,dest);
+            else
+                upsampleStage(m_up4,src,n,dest);
+            src = dest;
+            n *= 2;
+        }
+    }
+    // Reads getFactor() samples
+    simd::float_4 downsample(const simd::float_4* in)
+    {
+        if (m_stages == 0)
+            return in[0];
+        // the last stage first, each stage halves the samples in place in temp
+        simd::float_4 temp[maxFactor/2];
+        const simd::float_4* src = in;
+        int n = getFactor()/2;
+        for (int i=m_stages-1;i>=0;--i)
+        {
+            if (i == 0)
+                decimateStage(m_down1,src,n,temp);
+            else if (i == 1)
+                decimateStage(m_down2,src,n,temp);
+            else if (i == 2)
+                decimateStage(m_down3,src,n,temp);
+            else
+                decimateStage(m_down4,src,n,temp);
+            src = temp;
+            n /= 2;
+        }
+        return temp[0];
+    }
+private:
+    template<int K>
+    static void upsampleStage(HalfBandUpsampler<K>& up, const simd::float_4* in, int n,
+        simd::float_4* out)
+    {
+        for (int i=0;i<n;++i)
+            up.process(in[i],&out[i*2]);
+    }
+    template<int K>
+    static void decimateStage(HalfBandDecimator<K>& down, const simd::float_4* in, int n,
+        simd::float_4* out)
+    {
+        for (int i=0;i<n;++i)
+            out[i] = down.process(&in[i*2]);
+    }
+    int m_stages = 0;
+    HalfBandUpsampler<12> m_up1;
+    HalfBandUpsampler<6> m_up2;
+    HalfBandUpsampler<4> m_up3;
+    HalfBandUpsampler<3> m_up4;
+    HalfBandDecimator<12> m_down1;
+    HalfBandDecimator<6> m_down2;
+    HalfBandDecimator<4> m_down3;
+    HalfBandDecimator<3> m_down4;
+};
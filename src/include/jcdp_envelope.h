@@ -23,6 +23,7 @@ www.gnu.org/licenses
 #include <vector>
 #include <memory>
 #include <functional>
+#include <limits>
 //#include <rack.hpp>
 //#include "plugin.hpp"
 #include "modulationshaper.h"
@@ -680,6 +681,162 @@ private:
 	
 };
 
+// Reads a breakpoint_envelope at increasing times without searching the nodes on every call.
+// The current segment is remembered, moving forward walks to the next segments and only
+// backward jumps use a binary search. The segment parameters are cached when a segment is entered,
+// so node edits are picked up at the next segment change or reset. Returns the same values as 
+// GetInterpolatedEnvelopeValue.
+class envelope_cursor
+{
+public:
+    envelope_cursor() {}
+    envelope_cursor(const breakpoint_envelope* env) : m_env(env) {}
+    void setEnvelope(const breakpoint_envelope* env)
+    {
+        m_env = env;
+        m_valid = false;
+    }
+    double reset(double t)
+    {
+        m_valid = false;
+        return valueAt(t);
+    }
+    double advance(double dt)
+    {
+        return valueAt(m_time+dt);
+    }
+    double valueAt(double t)
+    {
+        m_time = t;
+        if (!m_valid || !(t>m_t0 && t<=m_t1))
+            findSegment(t);
+        return evaluate(t);
+    }
+    // Renders n values starting from time t0 with dt increments, dt must be positive
+    void renderBlock(float* out, int n, double t0, double dt)
+    {
+        int i = 0;
+        double t = t0;
+        while (i<n)
+        {
+            if (!m_valid || !(t>m_t0 && t<=m_t1))
+                findSegment(t);
+            int start = i;
+            if (m_mode == 0)
+            {
+                for (;i<n && t<=m_t1;++i,t+=dt)
+                    out[i] = m_v0;
+            }
+            else if (m_mode == 1)
+            {
+                for (;i<n && t<=m_t1;++i,t+=dt)
+                    out[i] = m_v0 + m_vdelta * std::min((t-m_t0)*m_linscale,1.0);
+            } else
+            {
+                for (;i<n && t<=m_t1;++i,t+=dt)
+                    out[i] = m_v0 + m_vdelta * m_env->m_shaper.processNonMorph(m_shape,(t-m_t0)*m_invdur);
+            }
+            if (i == start) // only possible with a NaN time
+            {
+                out[i++] = m_v0;
+                t += dt;
+            }
+        }
+        m_time = t-dt;
+    }
+    double getTime() const { return m_time; }
+private:
+    double evaluate(double t) const
+    {
+        if (m_mode == 0)
+            return m_v0;
+        if (m_mode == 1)
+            return m_v0 + m_vdelta * std::min((t-m_t0)*m_linscale,1.0);
+        return m_v0 + m_vdelta * m_env->m_shaper.processNonMorph(m_shape,(t-m_t0)*m_invdur);
+    }
+    void setConstant(double v, double t0, double t1)
+    {
+        m_mode = 0;
+        m_v0 = v;
+        m_t0 = t0;
+        m_t1 = t1;
+    }
+    void findSegment(double t)
+    {
+        const double inf = std::numeric_limits<double>::infinity();
+        m_valid = true;
+        int numnodes = m_env ? m_env->GetNumPoints() : 0;
+        if (numnodes==0)
+        {
+            setConstant(m_env ? m_env->GetDefValue() : 0.0,-inf,inf);
+            return;
+        }
+        const envelope_point& first = m_env->GetNodeAtIndex(0);
+        const envelope_point& last = m_env->GetNodeAtIndex(numnodes-1);
+        if (numnodes==1)
+        {
+            setConstant(first.pt_y,-inf,inf);
+            return;
+        }
+        if (t<=first.pt_x)
+        {
+            setConstant(first.pt_y,-inf,first.pt_x);
+            return;
+        }
+        if (t>last.pt_x)
+        {
+            setConstant(last.pt_y,last.pt_x,inf);
+            return;
+        }
+        // the segment starts from the last node before t
+        int seg = m_segment;
+        if (seg<0 || seg>numnodes-2 || m_env->GetNodeAtIndex(seg).pt_x>=t)
+        {
+            int lo = 0;
+            int hi = numnodes-1;
+            while (hi-lo>1)
+            {
+                int mid = (lo+hi)/2;
+                if (m_env->GetNodeAtIndex(mid).pt_x<t)
+                    lo = mid;
+                else hi = mid;
+            }
+            seg = lo;
+        } else
+        {
+            while (m_env->GetNodeAtIndex(seg+1).pt_x<t)
+                ++seg;
+        }
+        m_segment = seg;
+        const envelope_point& pt0 = m_env->GetNodeAtIndex(seg);
+        const envelope_point& pt1 = m_env->GetNodeAtIndex(seg+1);
+        m_t0 = pt0.pt_x;
+        m_t1 = pt1.pt_x;
+        m_v0 = pt0.pt_y;
+        m_vdelta = pt1.pt_y-pt0.pt_y;
+        double tdelta = m_t1-m_t0;
+        if (tdelta<0.00001)
+            tdelta=0.00001;
+        m_invdur = 1.0/tdelta;
+        m_shape = pt0.Shape;
+        // the linear shaper table reaches 1.0 one table step before its end
+        m_linscale = m_invdur*mstablesize/(mstablesize-1);
+        m_mode = m_shape == 2 ? 1 : 2;
+    }
+    const breakpoint_envelope* m_env = nullptr;
+    bool m_valid = false;
+    int m_segment = -1;
+    int m_mode = 0; // 0 constant, 1 linear, 2 shaper table
+    int m_shape = 0;
+    double m_time = 0.0;
+    double m_t0 = 0.0;
+    double m_t1 = 0.0;
+    double m_v0 = 0.0;
+    double m_vdelta = 0.0;
+    double m_invdur = 1.0;
+    double m_linscale = 1.0;
+};
+
 template<typename F, typename... Args>
 inline double derivative(const F& f, double x, const Args&... func_args)
 {
@@ -9,6 +9,7 @@
 #include <array>
 #include <functional>
 #include <cmath>
+#include <cstring>
 
 
 #ifndef RAPIHEADLESS
@@ -93,6 +94,93 @@ private:
 
 };
 
+// Fast 2^x for the pitch and frequency modulation conversions. The integer part of the
+// exponent goes directly to the float exponent bits. The fractional part comes from an
+// interpolated table for scalars and from a polynomial for float_4. Both are accurate to
+// better than 0.01 cents for exponents in the -60..60 range.
+class Exp2Table
+{
+public:
+    static const int tableSize = 256;
+    Exp2Table()
+    {
+        for (int i=0;i<tableSize+1;++i)
+            m_table[i] = std::pow(2.0,(double)i/tableSize);
+    }
+    float operator()(float x) const
+    {
+        x = x < -60.0f ? -60.0f : (x > 60.0f ? 60.0f : x);
+        int xi = (int)x;
+        if ((float)xi>x)
+            --xi;
+        float pos = (x-xi)*tableSize;
+        // x-xi rounds to 1 for tiny negative x
+        int index = std::min((int)pos,tableSize-1);
+        float frac = pos-index;
+        float y0 = m_table[index];
+        float y1 = m_table[index+1];
+        return (y0+(y1-y0)*frac)*exponentScaler(xi);
+    }
+    static simd::float_4 exp2(simd::float_4 x)
+    {
+        x = simd::clamp(x,-60.0f,60.0f);
+        simd::int32_4 xi(x);
+        xi = xi - (simd::int32_4::cast(simd::float_4(xi)>x) & simd::int32_4(1));
+        // the polynomial is centered on the middle of the 0..1 range of the fractional part
+        simd::float_4 u = x-simd::float_4(xi)-0.5f;
+        simd::float_4 p = 1.0f+u*(0.69314718f+u*(0.24022651f+u*(0.05550411f+u*(0.00961813f+u*0.00133336f))));
+        simd::float_4 scaler = simd::float_4::cast((xi+simd::int32_4(127)) << 23);
+        return p*scaler*1.41421356f;
+    }
+private:
+    static float exponentScaler(int e)
+    {
+        uint32_t bits = (uint32_t)(e+127) << 23;
+        float result;
+        memcpy(&result,&bits,sizeof(float));
+        return result;
+    }
+    float m_table[tableSize+1];
+};
+
+// Shared by all users, built on first use
+inline const Exp2Table& getExp2Table()
+{
+    static Exp2Table table;
+    return table;
+}
+
+inline float fastExp2(float x)
+{
+    return getExp2Table()(x);
+}
+
+// 4 one-pole smoothers in parallel. The distance to the target is kept instead of the
+// filter output, so that the smoothing doesn't stall short of the target in float precision
+// when the amount is very close to 1.
+class SimdOnePoleFilter
+{
+public:
+    void setAmount(float x)
+    {
+        m_a = x;
+    }
+    void setTarget(simd::float_4 x)
+    {
+        m_err += m_target - x;
+        m_target = x;
+    }
+    inline simd::float_4 process()
+    {
+        m_err *= m_a;
+        return m_target + m_err;
+    }
+private:
+    simd::float_4 m_target = 0.0f;
+    simd::float_4 m_err = 0.0f;
+    simd::float_4 m_a = 0.99f;
+};
+
 inline std::pair<int, int> parseFractional(std::string& str)
 {
 	int pos = str.find('/');
@@ -220,6 +308,59 @@ inline T reflect_value(const T& minval, const T& val, const T& maxval)
 	return temp;
 }
 
+// Folds val into the range like reflect_value does, but without looping, so that it works
+// for 4 values at a time. The limits can't be the same.
+inline simd::float_4 reflect_value_simd(simd::float_4 minval, simd::float_4 val, simd::float_4 maxval)
+{
+	simd::float_4 w = maxval - minval;
+	simd::float_4 t = val - minval;
+	t = t - 2.0f * w * simd::floor(t / (2.0f * w));
+	t = simd::ifelse(t > w, 2.0f * w - t, t);
+	return minval + t;
+}
+
+// 4 independent xorshift32 generators
+class SimdXorShift32
+{
+public:
+	SimdXorShift32(uint32_t seed = 1)
+	{
+		setSeed(seed);
+	}
+	void setSeed(uint32_t seed)
+	{
+		int32_t lanes[4];
+		for (int i=0;i<4;++i)
+		{
+			// scramble so that nearby seeds give unrelated sequences
+			uint32_t z = seed + 0x9e3779b9u * (i + 1);
+			z = (z ^ (z >> 16)) * 0x85ebca6bu;
+			z = (z ^ (z >> 13)) * 0xc2b2ae35u;
+			z ^= z >> 16;
+			lanes[i] = z == 0 ? 1 : z;
+		}
+		m_state = simd::int32_4::load(lanes);
+	}
+	simd::int32_4 nextBits()
+	{
+		simd::int32_4 x = m_state;
+		x = x ^ (x << 13);
+		// masked so that the shift is logical
+		x = x ^ ((x >> 17) & simd::int32_4(0x7fff));
+		x = x ^ (x << 5);
+		m_state = x;
+		return x;
+	}
+	// Uniform in [0,1)
+	simd::float_4 nextFloat()
+	{
+		simd::int32_4 mantissa = (nextBits() >> 9) & simd::int32_4(0x7fffff);
+		return simd::float_4::cast(mantissa | simd::int32_4(0x3f800000)) - 1.0f;
+	}
+private:
+	simd::int32_4 m_state;
+};
+
 // safe version that handles the case where limits are the same and the loop has an iteration limit
 // if iteration limit is reached, returns value between the limits
 template<typename T>
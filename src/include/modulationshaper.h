@@ -4,6 +4,9 @@
 
 #include <random.hpp>
 #include <math.hpp>
+#include <memory>
+#include <random>
+#include <cmath>
 
 using namespace rack;
 using namespace rack::math;
@@ -58,14 +61,24 @@ inline float easeInElastic(float x)
 const int msnumtables = 16;
 const int mstablesize = 1024;
 
-class ModulationShaper
+// The shaper tables are the same for every user, so they are built once, from a fixed seed,
+// and shared read-only.
+class ModulationShaperTables
 {
 public:
-    ModulationShaper()
+    ModulationShaperTables()
     {
         float randvalues[1024];
-        for (int i=0;i<1024;++i)
-            randvalues[i]=random::normal()*0.1f;
+        // Box-Muller from a fixed seed mt19937, so that the tables are the same on every platform
+        std::mt19937 rng(9001);
+        for (int i=0;i<1024;i+=2)
+        {
+            double u0 = (rng()+1.0)/4294967297.0;
+            double u1 = (rng()+1.0)/4294967297.0;
+            double r = std::sqrt(-2.0*std::log(u0));
+            randvalues[i] = r*std::cos(2.0*M_PI*u1)*0.1f;
+            randvalues[i+1] = r*std::sin(2.0*M_PI*u1)*0.1f;
+        }
         for (int i=0;i<mstablesize;++i)
         {
             float norm = 1.0/(mstablesize-1)*i;
@@ -104,11 +117,40 @@ public:
         for (int i=0;i<mstablesize;++i)
             m_tables[msnumtables][i]=m_tables[msnumtables-1][i];
     }
-	float processNonMorph(int tableindex, float input)
+    static std::shared_ptr<const ModulationShaperTables> getShared()
+    {
+        // built on first use, function local static initialization is thread safe
+        static std::shared_ptr<const ModulationShaperTables> tables = 
+            std::make_shared<const ModulationShaperTables>();
+        return tables;
+    }
+    float m_tables[msnumtables+1][mstablesize+1];
+};
+
+class ModulationShaper
+{
+public:
+    ModulationShaper() : m_shared(ModulationShaperTables::getShared()), m_tables(m_shared->m_tables)
+    {
+        
+    }
+    ModulationShaper(const ModulationShaper& other) : m_shared(other.m_shared), m_tables(m_shared->m_tables) {}
+    ModulationShaper& operator=(const ModulationShaper& other)
+    {
+        m_shared = other.m_shared;
+        m_tables = m_shared->m_tables;
+        return *this;
+    }
+    // Row of mstablesize+1 values, for callers doing their own (vectorized) lookups
+    const float* getTable(int tableindex) const
+    {
+        return m_tables[tableindex];
+    }
+	float processNonMorph(int tableindex, float input) const
 	{
 		return interpolateLinear(m_tables[tableindex],input*mstablesize);
 	}
-    float process(float morph, float input)
+    float process(float morph, float input) const
     {
         float z = morph*(msnumtables-1);
         int xindex0 = morph*(msnumtables-1);
@@ -127,7 +169,7 @@ public:
         
     }
 private:
-    
-    float m_tables[msnumtables+1][mstablesize+1];
-
+    std::shared_ptr<const ModulationShaperTables> m_shared;
+    // cached from m_shared to avoid the extra indirection
+    const float (*m_tables)[mstablesize+1] = nullptr;
 };
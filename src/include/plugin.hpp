@@ -30,3 +30,5 @@ extern Model* modelHistogram;
 extern Model* modelReducer;
 extern Model* modelCubeSymSeq;
 extern Model* modelTimeSeq;
+extern Model* modelXSpatializer;
+extern Model* modelXAudioStretch;
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 //#include "plugin.hpp"
 #include <Tunings.h>
 #include "mischelpers.h"
@@ -169,3 +173,191 @@ inline std::vector<float> loadScala(std::string path,
 	else std::cout << "could not open file\n";
     return {};
 }
+// Scale pitches with a bucket index for fast lookups. Instances are built on a non-audio 
+// thread and never modified afterwards, so the audio thread can read them through a plain
+// pointer handed over with ImmutableHandoff.
+class QuantizeScale
+{
+public:
+    QuantizeScale() {}
+    QuantizeScale(std::vector<double> p) : m_pitches(std::move(p))
+    {
+        std::sort(m_pitches.begin(),m_pitches.end());
+        if (m_pitches.size()<2)
+            return;
+        m_minpitch = m_pitches.front();
+        double range = m_pitches.back() - m_minpitch;
+        if (range<=0.0)
+            return;
+        // about 4 buckets per scale step, so that a lookup only scans a step or two
+        size_t numbuckets = std::min<size_t>(m_pitches.size()*4,65536);
+        m_bucketscale = numbuckets/range;
+        m_buckets.resize(numbuckets+1);
+        for (size_t i=0;i<m_buckets.size();++i)
+        {
+            double bstart = m_minpitch + i/m_bucketscale;
+            m_buckets[i] = std::lower_bound(m_pitches.begin(),m_pitches.end(),bstart)-m_pitches.begin();
+        }
+    }
+    const std::vector<double>& pitches() const { return m_pitches; }
+    bool empty() const { return m_pitches.empty(); }
+    size_t size() const { return m_pitches.size(); }
+    double operator[](size_t i) const { return m_pitches[i]; }
+    // Same results as std::lower_bound and std::upper_bound over the pitches
+    size_t lowerBound(double x) const
+    {
+        size_t i = bucketStart(x);
+        while (i>0 && m_pitches[i-1]>=x)
+            --i;
+        while (i<m_pitches.size() && m_pitches[i]<x)
+            ++i;
+        return i;
+    }
+    size_t upperBound(double x) const
+    {
+        size_t i = bucketStart(x);
+        while (i>0 && m_pitches[i-1]>x)
+            --i;
+        while (i<m_pitches.size() && m_pitches[i]<=x)
+            ++i;
+        return i;
+    }
+    // Equivalent of quantize_to_grid(x,pitches(),amount)
+    double quantize(double x, double amount=1.0) const
+    {
+        if (m_pitches.empty())
+            return x;
+        size_t i1 = lowerBound(x);
+        if (i1<m_pitches.size())
+        {
+            size_t i0 = i1 > 0 ? i1-1 : 0;
+            const double gridvalue = fabs(m_pitches[i0] - x) < fabs(m_pitches[i1] - x) ? m_pitches[i0] : m_pitches[i1];
+            return x + amount * (gridvalue - x);
+        }
+        return x + amount * (m_pitches.back() - x);
+    }
+private:
+    size_t bucketStart(double x) const
+    {
+        if (m_buckets.empty())
+            return 0;
+        double b = (x - m_minpitch) * m_bucketscale;
+        if (b<=0.0)
+            return 0;
+        if (b>=m_buckets.size()-1)
+            return m_buckets.back();
+        return m_buckets[(size_t)b];
+    }
+    std::vector<double> m_pitches;
+    std::vector<uint32_t> m_buckets;
+    double m_minpitch = 0.0;
+    double m_bucketscale = 0.0;
+};
+
+// Quantization lookup over uniformly spaced buckets. Each bucket stores the grid value nearest
+// to the bucket center, so quantizing is a single load and an interpolation. Results can only 
+// differ from quantize_to_grid within half a bucket of the points where the nearest grid value 
+// changes. Inputs outside the table range use the nearest edge bucket, which is exact as long as 
+// the grid itself lies within the range.
+class QuantizeTable
+{
+public:
+    QuantizeTable() {}
+    // grid must be sorted
+    template<typename Grid>
+    QuantizeTable(const Grid& grid, float minx = -10.0f, float maxx = 10.0f, float resolution = 0.001f)
+        : m_minx(minx), m_invres(1.0f/resolution)
+    {
+        if (std::begin(grid)==std::end(grid))
+            return;
+        size_t numbuckets = (size_t)((maxx-minx)*m_invres+0.5f)+1;
+        m_table.resize(numbuckets);
+        auto t1 = std::begin(grid);
+        for (size_t i=0;i<numbuckets;++i)
+        {
+            double x = minx + i*(double)resolution;
+            while (t1!=std::end(grid) && *t1<x)
+                ++t1;
+            if (t1==std::end(grid))
+            {
+                m_table[i] = *(std::end(grid)-1);
+                continue;
+            }
+            auto t0 = t1;
+            if (t1>std::begin(grid))
+                t0 = t1-1;
+            m_table[i] = fabs(*t0 - x) < fabs(*t1 - x) ? *t0 : *t1;
+        }
+    }
+    bool empty() const { return m_table.empty(); }
+    float nearest(float x) const
+    {
+        float index = (x-m_minx)*m_invres+0.5f;
+        if (index<=0.0f)
+            return m_table.front();
+        if (index>=m_table.size()-1)
+            return m_table.back();
+        return m_table[(size_t)index];
+    }
+    // Equivalent of quantize_to_grid(x,grid,amount)
+    float quantize(float x, float amount=1.0f) const
+    {
+        if (m_table.empty())
+            return x;
+        return x + amount * (nearest(x) - x);
+    }
+private:
+    std::vector<float> m_table;
+    float m_minx = 0.0f;
+    float m_invres = 1.0f;
+};
+
+// Hands immutable objects from non-audio threads to a single audio thread without locking
+// or allocating on the audio side. The audio thread advertises the pointer it is using 
+// (a hazard pointer), published objects are kept alive by the publishing side until they are 
+// neither pending nor in use, so they are always destroyed outside the audio thread.
+template<typename T>
+class ImmutableHandoff
+{
+public:
+    // Call from non-audio threads only
+    void publish(std::shared_ptr<const T> obj)
+    {
+        std::lock_guard<std::mutex> locker(m_publish_mutex);
+        m_pending.store(obj.get());
+        m_alive.push_back(std::move(obj));
+        const T* inuse = m_inuse.load();
+        for (size_t i=0;i<m_alive.size();)
+        {
+            const T* ptr = m_alive[i].get();
+            if (ptr!=m_pending.load() && ptr!=inuse)
+            {
+                m_alive[i] = std::move(m_alive.back());
+                m_alive.pop_back();
+            } else ++i;
+        }
+    }
+    // Call from the audio thread only. The returned object stays valid until the next call.
+    const T* acquire()
+    {
+        const T* ptr = m_pending.load();
+        if (ptr == m_current)
+            return m_current;
+        while (true)
+        {
+            m_inuse.store(ptr);
+            const T* check = m_pending.load();
+            if (check == ptr)
+                break;
+            ptr = check;
+        }
+        m_current = ptr;
+        return m_current;
+    }
+private:
+    std::atomic<const T*> m_pending{nullptr};
+    std::atomic<const T*> m_inuse{nullptr};
+    const T* m_current = nullptr;
+    std::mutex m_publish_mutex;
+    std::vector<std::shared_ptr<const T>> m_alive;
+};
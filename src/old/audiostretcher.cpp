@@ -1,37 +1,192 @@
 #include "audiostretcher.h"
+#include "mischelpers.h"
 #include <fstream>
 
 #ifdef RBMODULE
 
-extern std::shared_ptr<Font> g_font;
+StretchVoice::StretchVoice()
+{
+    m_in.reset(64);
+    m_out.reset(256);
+    m_st.reset(
+        new RubberBand::RubberBandStretcher(44100,1,
+        RubberBand::RubberBandStretcher::Option::OptionProcessRealTime
+        |RubberBand::RubberBandStretcher::Option::OptionPitchHighConsistency
+        |RubberBand::RubberBandStretcher::Option::OptionThreadingNever));
+    m_st->setMaxProcessSize(blockSize);
+}
+
+void StretchVoice::reset()
+{
+    ++m_generation;
+    m_latestGeneration.store(m_generation);
+    m_inPos = 0;
+    m_outPos = blockSize;
+    m_playing = false;
+}
+
+float StretchVoice::process(float input, float pitchScale, int latency)
+{
+    m_inBlock.data[m_inPos] = input;
+    ++m_inPos;
+    if (m_inPos == blockSize)
+    {
+        m_inBlock.pitchScale = pitchScale;
+        m_inBlock.generation = m_generation;
+        if (!m_in.push(m_inBlock))
+            ++m_dropouts;
+        m_inPos = 0;
+    }
+    if (!m_playing)
+    {
+        // drop the output from before a reset, so that only the current blocks count
+        // toward the latency budget. The blocks after the first current one are current too.
+        while (m_outPos == blockSize && m_out.pop(m_outBlock))
+        {
+            if (m_outBlock.generation == m_generation)
+                m_outPos = 0;
+        }
+        // wait until the look-ahead covers the latency budget
+        if (getQueuedOutput() < latency)
+            return 0.0f;
+        m_playing = true;
+    }
+    if (m_outPos == blockSize)
+    {
+        bool gotblock = false;
+        while (m_out.pop(m_outBlock))
+        {
+            if (m_outBlock.generation == m_generation)
+            {
+                gotblock = true;
+                break;
+            }
+        }
+        if (!gotblock)
+        {
+            // the worker fell behind, refill the look-ahead before playing again
+            ++m_dropouts;
+            m_playing = false;
+            return 0.0f;
+        }
+        m_outPos = 0;
+    }
+    float result = m_outBlock.data[m_outPos];
+    ++m_outPos;
+    return result;
+}
+
+bool StretchVoice::work()
+{
+    if (!m_in.pop(m_workBlock))
+        return false;
+    // input from before the latest reset would only produce output that gets dropped
+    if (m_workBlock.generation != m_latestGeneration.load())
+        return true;
+    auto t0 = std::chrono::steady_clock::now();
+    if (m_workBlock.generation != m_workGeneration)
+    {
+        m_workGeneration = m_workBlock.generation;
+        m_st->reset();
+        m_resultPos = 0;
+    }
+    if (m_workBlock.pitchScale != m_workPitchScale)
+    {
+        m_workPitchScale = m_workBlock.pitchScale;
+        m_st->setPitchScale(m_workPitchScale);
+    }
+    const float* inbuf[1] = {m_workBlock.data};
+    m_st->process(inbuf,blockSize,false);
+    int avail = 0;
+    while ((avail = m_st->available())>0)
+    {
+        int toretrieve = std::min(avail,blockSize-m_resultPos);
+        float* outbuf[1] = {&m_resultBlock.data[m_resultPos]};
+        m_st->retrieve(outbuf,toretrieve);
+        m_resultPos += toretrieve;
+        if (m_resultPos == blockSize)
+        {
+            m_resultBlock.generation = m_workGeneration;
+            // the output is only full if the voice isn't being played, the block can be dropped then
+            m_out.push(m_resultBlock);
+            m_resultPos = 0;
+        }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    m_busyTime += std::chrono::duration<double>(t1-t0).count();
+    m_busySamples += blockSize;
+    if (m_busySamples >= 11025)
+    {
+        m_load.store(m_busyTime/(m_busySamples/44100.0));
+        m_busyTime = 0.0;
+        m_busySamples = 0;
+    }
+    return true;
+}
+
+StretchWorkerPool::StretchWorkerPool(StretchVoice* voices, int numVoices)
+    : m_voices(voices), m_numVoices(numVoices)
+{
+    int numthreads = clamp((int)std::thread::hardware_concurrency()/2,1,4);
+    for (int i=0;i<numthreads;++i)
+        m_threads.emplace_back([this,i](){ run(i); });
+}
+
+StretchWorkerPool::~StretchWorkerPool()
+{
+    m_quit.store(true);
+    for (auto& th : m_threads)
+        th.join();
+}
+
+void StretchWorkerPool::run(int index)
+{
+    int numthreads = m_threads.size();
+    while (!m_quit.load())
+    {
+        bool didwork = false;
+        for (int i=index;i<m_numVoices;i+=numthreads)
+        {
+            while (m_voices[i].work())
+                didwork = true;
+        }
+        if (!didwork)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
 
 AudioStretchModule::AudioStretchModule()
 {
     config(PAR_LAST,INPUT_LAST,OUTPUT_LAST);
-    configParam(PAR_PITCH_SHIFT,-12.0f,12.0f,0.0f);
-    configParam(PAR_RESET,0,1,0);
+    configParam(PAR_PITCH_SHIFT,-12.0f,12.0f,0.0f,"Pitch shift"," semitones");
+    configParam(PAR_RESET,0,1,0,"Reset");
+    configInput(INPUT_AUDIO_IN,"Audio");
+    configInput(INPUT_PITCH_IN,"Pitch shift CV");
+    configOutput(OUTPUT_AUDIO_OUT,"Audio");
+    configOutput(OUTPUT_BUFFERAMOUNT,"Queued output");
     m_paramdiv.setDivision(16);
     m_lastnumchans = 0;
-    RubberBand::RubberBandStretcher::setDefaultDebugLevel(0);
     for (int i=0;i<16;++i)
-    {
-        m_procinbufs[i].resize(m_procbufsize);
-        m_procoutbufs[i].resize(m_procbufsize);
-        m_st[i].reset(
-            new RubberBand::RubberBandStretcher(44100,1,
-            RubberBand::RubberBandStretcher::Option::OptionProcessRealTime
-            |RubberBand::RubberBandStretcher::Option::OptionPitchHighConsistency));
-        //m_st[i]->setMaxProcessSize(1);
-    }
-    
+        m_pitchScales[i] = 1.0f;
+    m_pool.reset(new StretchWorkerPool(m_voices,16));
+}
+
+json_t* AudioStretchModule::dataToJson()
+{
+    json_t* resultJ = json_object();
+    json_object_set(resultJ,"latency",json_integer(m_latency.load()));
+    return resultJ;
+}
+
+void AudioStretchModule::dataFromJson(json_t* root)
+{
+    if (auto j = json_object_get(root,"latency"))
+        m_latency.store(clamp((int)json_integer_value(j),256,8192));
 }
 
 void AudioStretchModule::process(const ProcessArgs& args)
 {
-    if (m_st[0]==nullptr)
-        return;
     float insample = inputs[INPUT_AUDIO_IN].getVoltageSum();
-    float* procinbuf[1] = {&insample};
     int numpolychans = std::max(1,inputs[INPUT_PITCH_IN].getChannels());
     if (m_paramdiv.process())
     {
@@ -42,42 +197,32 @@ void AudioStretchModule::process(const ProcessArgs& args)
             m_lastnumchans = numpolychans;
             for (int i=0;i<16;++i)
             {
-                m_st[i]->reset();
+                m_voices[i].reset();
             }
         }
-        float semitones = params[PAR_PITCH_SHIFT].getValue();
         for (int i=0;i<numpolychans;++i)
         {
+            float semitones = params[PAR_PITCH_SHIFT].getValue();
             semitones += rescale(inputs[INPUT_PITCH_IN].getVoltage(i),-5.0f,5.0f,-12.0f,12.0f);
             semitones = clamp(semitones,-36.0f,36.0f);
-            m_st[i]->setPitchScale(pow(2.0,semitones/12.0));
+            m_pitchScales[i] = std::pow(2.0f,semitones/12.0f);
         }
+        m_numActiveVoices.store(numpolychans);
         outputs[OUTPUT_AUDIO_OUT].setChannels(numpolychans);
         outputs[OUTPUT_BUFFERAMOUNT].setChannels(numpolychans);
     }
-    float retrbuf[1024];
+    int latency = m_latency.load();
     for (int i=0;i<numpolychans;++i)
     {
-        m_st[i]->process(procinbuf,1,false);
-        float outsample = 0.0f;
-        float bufvolt = rescale(m_st[i]->available(),0,16384,0.0f,10.0f);
+        float outsample = m_voices[i].process(insample,m_pitchScales[i],latency);
+        outputs[OUTPUT_AUDIO_OUT].setVoltage(outsample,i);
+        float bufvolt = rescale(m_voices[i].getQueuedOutput(),0,16384,0.0f,10.0f);
         outputs[OUTPUT_BUFFERAMOUNT].setVoltage(bufvolt,i);
-        if (m_st[i]->available()>=1024)
-        {
-            float* procoutbuf[1] = {&outsample};
-            m_st[i]->retrieve(procoutbuf,1);
-            outputs[OUTPUT_AUDIO_OUT].setVoltage(outsample,i);
-        }
-        
-        
     }
-    
 }
 
 AudioStretchWidget::AudioStretchWidget(AudioStretchModule* m)
 {
-    if (!g_font)
-    	g_font = APP->window->loadFont(asset::plugin(pluginInstance, "res/sudo/Sudo.ttf"));
     setModule(m);
     box.size.x = 255;
     addParam(createParam<RoundHugeBlackKnob>(Vec(20, 20), module, AudioStretchModule::PAR_PITCH_SHIFT));
@@ -100,19 +245,55 @@ void AudioStretchWidget::draw(const DrawArgs &args)
     nvgFill(args.vg);
 
     nvgFontSize(args.vg, 15);
-    nvgFontFaceId(args.vg, g_font->handle);
+    nvgFontFaceId(args.vg, getDefaultFont(1)->handle);
     nvgTextLetterSpacing(args.vg, -1);
     nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
     auto rbmod = dynamic_cast<AudioStretchModule*>(module);
     if (rbmod)
     {
         char buf[1024];
-        sprintf(buf,"AudioStretcher %d",rbmod->m_rbAvailableOutput);
+        int dropouts = 0;
+        for (int i=0;i<16;++i)
+            dropouts += rbmod->m_voices[i].getDropouts();
+        sprintf(buf,"AudioStretcher dropouts %d",dropouts);
         nvgText(args.vg, 3 , 10, buf, NULL);
+        // worker thread time used by each voice relative to the duration of the audio
+        int numvoices = rbmod->m_numActiveVoices.load();
+        for (int i=0;i<numvoices;++i)
+        {
+            float load = rbmod->m_voices[i].getLoad();
+            float ypos = 140.0f+i*12.0f;
+            nvgBeginPath(args.vg);
+            nvgFillColor(args.vg, nvgRGBA(0x00, 0xa0, 0x00, 0xff));
+            if (load>0.5f)
+                nvgFillColor(args.vg, nvgRGBA(0xc0, 0x00, 0x00, 0xff));
+            nvgRect(args.vg,60.0f,ypos,std::min(load,1.0f)*(w-70.0f),10.0f);
+            nvgFill(args.vg);
+            nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
+            sprintf(buf,"%d %.1f%%",i+1,load*100.0f);
+            nvgText(args.vg, 3 , ypos+10.0f, buf, NULL);
+        }
     }
     
     nvgText(args.vg, 3 , h-11, "Xenakios", NULL);
     nvgRestore(args.vg);
     ModuleWidget::draw(args);
 }
+
+void AudioStretchWidget::appendContextMenu(Menu *menu)
+{
+    auto rbmod = dynamic_cast<AudioStretchModule*>(module);
+    if (!rbmod)
+        return;
+    menu->addChild(createSubmenuItem("Latency","",[=](Menu* submenu)
+    {
+        for (int lat : {256,512,1024,2048,4096,8192})
+        {
+            submenu->addChild(createMenuItem([=](){ rbmod->m_latency.store(lat); },
+                std::to_string(lat)+" samples",CHECKMARK(rbmod->m_latency.load()==lat)));
+        }
+    }));
+}
+
+Model* modelXAudioStretch = createModel<AudioStretchModule,AudioStretchWidget>("XAudioStretch");
 #endif
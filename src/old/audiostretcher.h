@@ -5,6 +5,9 @@
 #include <rack.hpp>
 #include "plugin.hpp"
 #include "RubberBandStretcher.h"
+#include "choc_SingleReaderSingleWriterFIFO.h"
+#include <thread>
+#include <atomic>
 
 template<typename T>
 class QeueuBuf
@@ -51,6 +54,71 @@ private:
     std::vector<T> m_buf;
 };
 
+// A RubberBand stretcher run by a worker thread. The audio thread sends the input in blocks
+// through one FIFO and receives the stretched output in blocks through another, keeping
+// enough output queued to cover the latency budget.
+class StretchVoice
+{
+public:
+    static const int blockSize = 64;
+    struct Block
+    {
+        float data[blockSize];
+        float pitchScale = 1.0f;
+        // blocks from before a reset are discarded
+        uint32_t generation = 0;
+    };
+    StretchVoice();
+    // Call from the worker thread, returns true if there was input to process
+    bool work();
+    // Call from the audio thread
+    float process(float input, float pitchScale, int latency);
+    void reset();
+    int getQueuedOutput() const
+    {
+        return m_out.getUsedSlots()*blockSize+blockSize-m_outPos;
+    }
+    float getLoad() const { return m_load.load(); }
+    int getDropouts() const { return m_dropouts.load(); }
+private:
+    std::unique_ptr<RubberBand::RubberBandStretcher> m_st;
+    choc::fifo::SingleReaderSingleWriterFIFO<Block> m_in;
+    choc::fifo::SingleReaderSingleWriterFIFO<Block> m_out;
+    // audio thread state
+    Block m_inBlock;
+    Block m_outBlock;
+    int m_inPos = 0;
+    int m_outPos = blockSize;
+    uint32_t m_generation = 0;
+    // m_generation published for the worker, so that it can skip the input from before a reset
+    std::atomic<uint32_t> m_latestGeneration{0};
+    bool m_playing = false;
+    std::atomic<int> m_dropouts{0};
+    // worker thread state
+    Block m_workBlock;
+    Block m_resultBlock;
+    int m_resultPos = 0;
+    uint32_t m_workGeneration = 0;
+    float m_workPitchScale = 1.0f;
+    double m_busyTime = 0.0;
+    int m_busySamples = 0;
+    std::atomic<float> m_load{0.0f};
+};
+
+// Fixed set of threads running the stretcher voices, voice i is always run by thread i % numThreads
+class StretchWorkerPool
+{
+public:
+    StretchWorkerPool(StretchVoice* voices, int numVoices);
+    ~StretchWorkerPool();
+private:
+    void run(int index);
+    StretchVoice* m_voices = nullptr;
+    int m_numVoices = 0;
+    std::vector<std::thread> m_threads;
+    std::atomic<bool> m_quit{false};
+};
+
 class AudioStretchModule : public rack::Module
 {
 public:
@@ -74,16 +142,17 @@ public:
     };
     AudioStretchModule();
     void process(const ProcessArgs& args) override;
-    int m_rbAvailableOutput = 0;
+    json_t* dataToJson() override;
+    void dataFromJson(json_t* root) override;
+    StretchVoice m_voices[16];
+    std::atomic<int> m_numActiveVoices{0};
+    // samples of output kept queued ahead of the playback
+    std::atomic<int> m_latency{2048};
 private:
-    std::unique_ptr<RubberBand::RubberBandStretcher> m_st[16];
-    
-    std::vector<float> m_procinbufs[16];
-    std::vector<float> m_procoutbufs[16];
+    std::unique_ptr<StretchWorkerPool> m_pool;
+    float m_pitchScales[16];
     dsp::ClockDivider m_paramdiv;
     int m_lastnumchans = 0;
-    int m_procbufsize = 128;
-    int m_procbufcounter = 0;
     bool m_lastreset = false;
 };
 
@@ -92,6 +161,6 @@ class AudioStretchWidget : public ModuleWidget
 public:
     AudioStretchWidget(AudioStretchModule* m);
     void draw(const DrawArgs &args) override;
-    
+    void appendContextMenu(Menu *menu) override;
 };
 #endif
@@ -1,7 +1,9 @@
 //#include "plugin.hpp"
 #include "mischelpers.h"
 #include <random>
+#include <thread>
 #include "../wdl/resample.h"
+#include "choc_SingleReaderSingleWriterFIFO.h"
 
 struct WaveSegment
 {
@@ -80,26 +82,32 @@ struct JohnsonTrotterState_
 
 const float pi = 3.141592653;
 
+inline std::vector<WaveSegment> makePermutationSegments()
+{
+    std::mt19937 gen;
+    std::uniform_real_distribution<float> dist(-1.0, 1.0);
+    std::vector<WaveSegment> segments;
+    segments.emplace_back(150, [](float x) { return 0.0f; });
+    segments.emplace_back(64, [](float x) { return sin(x * pi); });
+    segments.emplace_back(64, [](float x) { return cos(x * pi / 2.0); });
+    segments.emplace_back(64, [](float x) { return -1.0 + 2.0 * x; });
+    segments.emplace_back(7, [](float x) { return -x; });
+    segments.emplace_back(128, [](float x) { return x; });
+    segments.emplace_back(240, [](float x) { return sin(x * pi * 2.0); });
+    segments.emplace_back(64, [&gen, &dist](float x) { return dist(gen); });
+    segments.emplace_back(31, [](float x) { return fmod(x * 5.0, 1.0); });
+    segments.emplace_back(300, [](float x) { return sin(x * pi * 2) * sin(x * pi * 15.13); });
+    segments.emplace_back(400, [](float x) { return sin(x * pi * 13) * sin(x * pi * 15.13); });
+    segments.emplace_back(150, [&gen, &dist](float x) { return sin(x * pi) * dist(gen); });
+    return segments;
+}
+
 class PermutationOscillator
 {
 public:
     PermutationOscillator()
     {
-        std::mt19937 gen;
-        std::uniform_real_distribution<float> dist(-1.0, 1.0);
-        
-        segments.emplace_back(150, [](float x) { return 0.0f; });
-        segments.emplace_back(64, [](float x) { return sin(x * pi); });
-        segments.emplace_back(64, [](float x) { return cos(x * pi / 2.0); });
-        segments.emplace_back(64, [](float x) { return -1.0 + 2.0 * x; });
-        segments.emplace_back(7, [](float x) { return -x; });
-        segments.emplace_back(128, [](float x) { return x; });
-        segments.emplace_back(240, [](float x) { return sin(x * pi * 2.0); });
-        segments.emplace_back(64, [&gen, &dist](float x) { return dist(gen); });
-        segments.emplace_back(31, [](float x) { return fmod(x * 5.0, 1.0); });
-        segments.emplace_back(300, [](float x) { return sin(x * pi * 2) * sin(x * pi * 15.13); });
-        segments.emplace_back(400, [](float x) { return sin(x * pi * 13) * sin(x * pi * 15.13); });
-        segments.emplace_back(150, [&gen, &dist](float x) { return sin(x * pi) * dist(gen); });
+        segments = makePermutationSegments();
         rsOutBuf.resize(4);
     }
     int curoffs_ = 0;
@@ -164,6 +172,364 @@ private:
     std::vector<float> rsOutBuf;
 };
 
+// One permutation step of the oscillator rendered into a table, with mip levels that are
+// lowpass filtered and decimated by 2 from the previous level.
+// The key holds the number of elements and the segment index of each element, 4 bits each.
+class PermutationTable
+{
+public:
+    static const int maxLevels = 6;
+    static int keyNumElements(uint64_t key) { return key >> 48; }
+    static int keySegment(uint64_t key, int index) { return (key >> (4*index)) & 15; }
+    static uint64_t makeKey(const JohnsonTrotterState_& jt, int numelems, int offs, int numsegments)
+    {
+        uint64_t key = (uint64_t)numelems << 48;
+        for (int i=0;i<numelems;++i)
+        {
+            uint64_t segIndex = (jt.values_[i] - 1 + offs) % numsegments;
+            key |= segIndex << (4*i);
+        }
+        return key;
+    }
+    // Doesn't allocate if data already has enough capacity
+    void render(const std::vector<WaveSegment>& segments, uint64_t key_, int maxlevels)
+    {
+        key = key_;
+        int numelems = keyNumElements(key);
+        int len = 0;
+        for (int i=0;i<numelems;++i)
+            len += segments[keySegment(key,i)].data.size();
+        numLevels = 1;
+        lengths[0] = len;
+        offsets[0] = 0;
+        int total = len;
+        while (numLevels<maxlevels && lengths[numLevels-1]>8)
+        {
+            offsets[numLevels] = total;
+            lengths[numLevels] = (lengths[numLevels-1]+1)/2;
+            total += lengths[numLevels];
+            ++numLevels;
+        }
+        data.resize(total);
+        int pos = 0;
+        for (int i=0;i<numelems;++i)
+        {
+            auto& seg = segments[keySegment(key,i)].data;
+            std::copy(seg.begin(),seg.end(),data.begin()+pos);
+            pos += seg.size();
+        }
+        // windowed sinc half band filter
+        static const float coeffs[7] = {0.5f,0.3083f,0.0f,-0.0700f,0.0f,0.0117f,0.0f};
+        for (int lev=1;lev<numLevels;++lev)
+        {
+            const float* src = &data[offsets[lev-1]];
+            int srclen = lengths[lev-1];
+            float* dest = &data[offsets[lev]];
+            for (int i=0;i<lengths[lev];++i)
+            {
+                int c = 2*i;
+                float acc = coeffs[0]*src[c];
+                for (int j=1;j<7;++j)
+                {
+                    if (coeffs[j] == 0.0f)
+                        continue;
+                    acc += coeffs[j]*(src[std::max(c-j,0)]+src[std::min(c+j,srclen-1)]);
+                }
+                dest[i] = acc;
+            }
+        }
+    }
+    // p is in samples of the level
+    float read(int level, double p) const
+    {
+        int len = lengths[level];
+        int i = std::min((int)p,len-1);
+        float frac = p-i;
+        const float* d = &data[offsets[level]];
+        float y0 = d[i];
+        float y1 = d[std::min(i+1,len-1)];
+        return y0+(y1-y0)*frac;
+    }
+    uint64_t key = 0;
+    std::vector<float> data;
+    int offsets[maxLevels];
+    int lengths[maxLevels];
+    int numLevels = 0;
+};
+
+// Tables of the permutation steps, shared by all the voices. The audio thread requests tables
+// through a FIFO and a worker thread renders them into a 4-way set associative cache, which the
+// audio thread reads without locking. Each voice publishes the table it plays as a hazard pointer,
+// tables replaced in the cache are deleted only when no voice is using them.
+class PermutationTableCache
+{
+public:
+    static const int numSlots = 1024;
+    static const int numWays = 4;
+    static const int maxVoices = 16;
+    PermutationTableCache()
+    {
+        m_segments = makePermutationSegments();
+        for (auto& e : m_hazards)
+            e.store(nullptr);
+        m_requests.reset(1024);
+        m_thread = std::thread([this](){ run(); });
+    }
+    ~PermutationTableCache()
+    {
+        m_quit.store(true);
+        m_thread.join();
+        for (auto& e : m_slots)
+            delete e.table.load();
+        for (auto& e : m_retired)
+            delete e;
+    }
+    const std::vector<WaveSegment>& getSegments() const { return m_segments; }
+    // Call from the audio thread
+    void request(uint64_t key)
+    {
+        m_requests.push(key);
+    }
+    // Call from the audio thread, returns nullptr if the table isn't ready yet. The table stays
+    // valid until the next call for the same voice.
+    const PermutationTable* acquire(int voice, uint64_t key)
+    {
+        int set = setIndex(key);
+        for (int i=0;i<numWays;++i)
+        {
+            Slot& slot = m_slots[set+i];
+            if (slot.key.load() != key)
+                continue;
+            const PermutationTable* t = slot.table.load();
+            m_hazards[voice].store(t);
+            if (t != nullptr && slot.key.load() == key && slot.table.load() == t)
+                return t;
+        }
+        m_hazards[voice].store(nullptr);
+        return nullptr;
+    }
+    void release(int voice)
+    {
+        m_hazards[voice].store(nullptr);
+    }
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> key{0};
+        std::atomic<const PermutationTable*> table{nullptr};
+        // when the worker last saw a request for the table
+        uint64_t stamp = 0;
+    };
+    // Returns the first slot of the set for the key
+    static int setIndex(uint64_t key)
+    {
+        key ^= key >> 30;
+        key *= 0xbf58476d1ce4e5b9ULL;
+        key ^= key >> 27;
+        key *= 0x94d049bb133111ebULL;
+        key ^= key >> 31;
+        return (key & (numSlots/numWays-1))*numWays;
+    }
+    bool isInUse(const PermutationTable* t) const
+    {
+        for (auto& e : m_hazards)
+            if (e.load() == t)
+                return true;
+        return false;
+    }
+    void run()
+    {
+        while (!m_quit.load())
+        {
+            uint64_t key = 0;
+            bool didwork = false;
+            while (m_requests.pop(key))
+            {
+                didwork = true;
+                ++m_stamp;
+                int set = setIndex(key);
+                Slot* victim = &m_slots[set];
+                bool found = false;
+                for (int i=0;i<numWays;++i)
+                {
+                    Slot& e = m_slots[set+i];
+                    if (e.key.load() == key)
+                    {
+                        e.stamp = m_stamp;
+                        found = true;
+                        break;
+                    }
+                    if (e.stamp<victim->stamp)
+                        victim = &e;
+                }
+                if (found)
+                    continue;
+                Slot& slot = *victim;
+                slot.stamp = m_stamp;
+                auto table = new PermutationTable;
+                table->render(m_segments,key,PermutationTable::maxLevels);
+                const PermutationTable* old = slot.table.load();
+                slot.table.store(nullptr);
+                slot.key.store(key);
+                slot.table.store(table);
+                if (old)
+                    m_retired.push_back(old);
+            }
+            for (size_t i=0;i<m_retired.size();)
+            {
+                if (!isInUse(m_retired[i]))
+                {
+                    delete m_retired[i];
+                    m_retired[i] = m_retired.back();
+                    m_retired.pop_back();
+                } else ++i;
+            }
+            if (!didwork)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+    Slot m_slots[numSlots];
+    std::atomic<const PermutationTable*> m_hazards[maxVoices];
+    std::vector<const PermutationTable*> m_retired;
+    std::vector<WaveSegment> m_segments;
+    choc::fifo::SingleReaderSingleWriterFIFO<uint64_t> m_requests;
+    uint64_t m_stamp = 0;
+    std::atomic<bool> m_quit{false};
+    std::thread m_thread;
+};
+
+const double g_levelscales[PermutationTable::maxLevels] = {1.0,0.5,0.25,0.125,0.0625,0.03125};
+
+// Plays the permutation steps from the table cache, rendering blocks of samples at a time.
+// The Johnson-Trotter state runs ahead of the playback so the tables of the coming steps can
+// be requested in advance. If a table isn't ready when needed, the step is rendered without
+// the mip levels into a table owned by the voice.
+class PermutationTableVoice
+{
+public:
+    static const int blockSize = 16;
+    static const int lookAhead = 8;
+    void init(PermutationTableCache* cache, int index)
+    {
+        m_cache = cache;
+        m_index = index;
+        int maxlen = 0;
+        for (auto& e : cache->getSegments())
+            maxlen += e.data.size();
+        m_fallback.data.reserve(maxlen);
+    }
+    float process(float pitch, float fold, int numelems, int offs)
+    {
+        if (m_bufpos == blockSize)
+        {
+            renderBlock(pitch,fold,numelems,offs);
+            m_bufpos = 0;
+        }
+        return m_buf[m_bufpos++];
+    }
+    void release()
+    {
+        if (m_cache)
+            m_cache->release(m_index);
+        m_table = nullptr;
+        m_numElements = 0;
+    }
+private:
+    void restart(int numelems, int offs)
+    {
+        m_numElements = numelems;
+        m_curoffs = offs;
+        m_jt.reset(numelems);
+        for (int i=0;i<lookAhead;++i)
+        {
+            if (i>0)
+                advanceJT();
+            m_keys[i] = makeKey();
+            m_cache->request(m_keys[i]);
+        }
+        m_head = 0;
+        m_pos = 0.0;
+        fetchTable();
+    }
+    uint64_t makeKey()
+    {
+        return PermutationTable::makeKey(m_jt,m_numElements,m_curoffs,m_cache->getSegments().size());
+    }
+    void advanceJT()
+    {
+        ++m_jt;
+        if (m_jt.IsComplete())
+            m_jt.reset(m_numElements);
+    }
+    void nextStep()
+    {
+        advanceJT();
+        m_keys[m_head] = makeKey();
+        m_cache->request(m_keys[m_head]);
+        m_head = (m_head+1) % lookAhead;
+        fetchTable();
+    }
+    void fetchTable()
+    {
+        uint64_t key = m_keys[m_head];
+        m_table = m_cache->acquire(m_index,key);
+        if (m_table == nullptr)
+        {
+            m_fallback.render(m_cache->getSegments(),key,1);
+            m_table = &m_fallback;
+            m_cache->request(key);
+        }
+    }
+    void renderBlock(float pitch, float fold, int numelems, int offs)
+    {
+        if (numelems<3)
+            numelems = 3;
+        if (numelems != m_numElements || offs != m_curoffs)
+            restart(numelems,offs);
+        double ratio = std::pow(2.0,pitch/12.0);
+        // crossfade between the 2 mip levels around the playback ratio
+        float lr = std::max(0.0f,(float)std::log2(ratio));
+        int lev0 = lr;
+        float levfrac = lr-lev0;
+        for (int i=0;i<blockSize;++i)
+        {
+            int l0 = std::min(lev0,m_table->numLevels-1);
+            int l1 = std::min(lev0+1,m_table->numLevels-1);
+            float y0 = m_table->read(l0,m_pos*g_levelscales[l0]);
+            float y1 = l1 == l0 ? y0 : m_table->read(l1,m_pos*g_levelscales[l1]);
+            float sample = y0+(y1-y0)*levfrac;
+            m_buf[i] = reflectUnit(sample * fold);
+            m_pos += ratio;
+            while (m_pos>=m_table->lengths[0])
+            {
+                m_pos -= m_table->lengths[0];
+                nextStep();
+            }
+        }
+    }
+    // Same as reflect_value(-1.0f,x,1.0f) without iterating, the reflections have a period of 4
+    static float reflectUnit(float x)
+    {
+        if (x>=-1.0f && x<=1.0f)
+            return x;
+        float t = x+1.0f;
+        t -= 4.0f*std::floor(t*0.25f);
+        return t<=2.0f ? t-1.0f : 3.0f-t;
+    }
+    PermutationTableCache* m_cache = nullptr;
+    int m_index = 0;
+    const PermutationTable* m_table = nullptr;
+    PermutationTable m_fallback;
+    JohnsonTrotterState_ m_jt{12};
+    uint64_t m_keys[lookAhead];
+    int m_head = 0;
+    int m_numElements = 0;
+    int m_curoffs = 0;
+    double m_pos = 0.0;
+    float m_buf[blockSize];
+    int m_bufpos = blockSize;
+};
+
 class XPSynth : public rack::Module
 {
 public:
@@ -181,20 +547,56 @@ public:
         configParam(FOLD_PARAM, 0.0f, 1.0f, 0.0f, "Fold");
         configParam(NUMELEMS_PARAM, 3.0f, 12.f, 6.0f, "Number of elements");
         configParam(ELEMOFFSET_PARAM, 0.0f, 11.f, 1.0f, "Element offset");
+        for (int i=0;i<16;++i)
+            m_voices[i].init(&m_tablecache,i);
     }
     void process(const ProcessArgs& args) override
     {
-        float pitch = params[FREQ_PARAM].getValue();
-        pitch += inputs[0].getVoltage()*12.0;
-        pitch = clamp(pitch,-48.0,48.0);
         float fold = 1.0+63.0*std::pow(3.0,params[FOLD_PARAM].getValue());
         int offs = params[ELEMOFFSET_PARAM].getValue();
         int numelems = params[NUMELEMS_PARAM].getValue();
-        float sample = osc.process(args.sampleRate,pitch,fold,numelems,offs);
-        outputs[0].setVoltage(sample*5.0f);
+        int numchans = std::max(1,inputs[0].getChannels());
+        if (numchans != m_numchans)
+        {
+            for (int i=numchans;i<16;++i)
+                m_voices[i].release();
+            m_numchans = numchans;
+        }
+        for (int i=0;i<numchans;++i)
+        {
+            float pitch = params[FREQ_PARAM].getValue();
+            pitch += inputs[0].getPolyVoltage(i)*12.0;
+            pitch = clamp(pitch,-48.0,48.0);
+            float sample = 0.0f;
+            if (m_useTables)
+                sample = m_voices[i].process(pitch,fold,numelems,offs);
+            else
+                sample = m_oscs[i].process(args.sampleRate,pitch,fold,numelems,offs);
+            outputs[0].setVoltage(sample*5.0f,i);
+        }
+        outputs[0].setChannels(numchans);
     }
+    json_t* dataToJson() override
+    {
+        json_t* resultJ = json_object();
+        json_object_set(resultJ,"usetables",json_boolean(m_useTables));
+        return resultJ;
+    }
+    void dataFromJson(json_t* root) override
+    {
+        // patches from before the table playback keep the direct playback they were made with
+        if (auto j = json_object_get(root,"usetables"))
+            m_useTables = json_boolean_value(j);
+        else
+            m_useTables = false;
+    }
+    // new instances use the tables
+    bool m_useTables = true;
 private:
-    PermutationOscillator osc;
+    PermutationTableCache m_tablecache;
+    PermutationTableVoice m_voices[16];
+    PermutationOscillator m_oscs[16];
+    int m_numchans = 0;
 };
 
 class XPSynthWidget : public ModuleWidget
@@ -218,6 +620,15 @@ public:
         addParam(knob);
         
     }
+    void appendContextMenu(Menu* menu) override
+    {
+        XPSynth* xm = dynamic_cast<XPSynth*>(module);
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuItem([xm]()
+        {
+            xm->m_useTables = !xm->m_useTables;
+        },"Band limited wavetable playback",CHECKMARK(xm->m_useTables)));
+    }
     void draw(const DrawArgs &args) override
     {
         nvgSave(args.vg);
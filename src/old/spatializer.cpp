@@ -1,32 +1,121 @@
 #include "mischelpers.h"
+#include "scalehelpers.h"
 #include <array>
 
-float table_sqrt[1024];
-
-inline float distance2d(float x0, float y0, float x1, float y1)
-{
-	float temp0 = (x1-x0)*(x1-x0);
-	float temp1 = (y1-y0)*(y1-y0);
-	float temp2 = temp0+temp1;
-	return std::sqrt(temp2);
-}
-
 const float pi = 3.14159265359;
 const float pi2 = pi*2.0f;
 
-const float speaker_positions[4][2]={
-			{-1.0f,-1.0f},
-			{1.0f,-1.0f},
-			{-1.0f,1.0f},
-			{1.0f,1.0f}};
-
-inline void multippair(std::pair<float,float>& p, float multip)
+// 2D vector base amplitude panning speaker layout. Speakers are given as azimuths in degrees,
+// clockwise from the front, in output order. Adjacent speakers around the ring form pairs
+// whose inverted base matrices are precomputed, gaps of 180 degrees or more are filled with
+// phantom speakers whose gain is shared equally by the gap's neighbours.
+class SpeakerLayout
 {
-	p.first*=multip;
-	p.second*=multip;
-}
+public:
+    static const int maxSpeakers = 16;
+    static const int maxPairs = 2*maxSpeakers;
+    struct Pair
+    {
+        float inv[2][2];
+        // where the 2 pair gains end up, phantom speaker gains go to 2 real speakers
+        int numcontribs = 0;
+        int cspeaker[3];
+        int cend[3];
+        float cweight[3];
+        void addContrib(int spk, int end, float w)
+        {
+            cspeaker[numcontribs] = spk;
+            cend[numcontribs] = end;
+            cweight[numcontribs] = w;
+            ++numcontribs;
+        }
+    };
+    SpeakerLayout(std::vector<float> azis)
+    {
+        if (azis.empty())
+            azis.push_back(0.0f);
+        if ((int)azis.size()>maxSpeakers)
+            azis.resize(maxSpeakers);
+        azimuths = azis;
+        numspeakers = azis.size();
+        if (numspeakers<2)
+            return;
+        std::vector<std::pair<float,int>> sorted;
+        for (int i=0;i<numspeakers;++i)
+        {
+            float a = std::fmod(azis[i],360.0f);
+            if (a<0.0f)
+                a += 360.0f;
+            sorted.push_back({a,i});
+        }
+        std::sort(sorted.begin(),sorted.end());
+        for (int i=0;i<numspeakers;++i)
+        {
+            auto& s0 = sorted[i];
+            auto& s1 = sorted[(i+1) % numspeakers];
+            float gap = s1.first-s0.first;
+            if (gap<=0.0f)
+                gap += 360.0f;
+            if (gap<179.0f)
+            {
+                Pair p;
+                if (!initPair(p,s0.first,s1.first))
+                    continue;
+                p.addContrib(s0.second,0,1.0f);
+                p.addContrib(s1.second,1,1.0f);
+                pairs[numpairs++] = p;
+            } else
+            {
+                float phantom = s0.first+gap*0.5f;
+                float w = 1.0f/std::sqrt(2.0f);
+                Pair p0;
+                if (initPair(p0,s0.first,phantom))
+                {
+                    p0.addContrib(s0.second,0,1.0f);
+                    p0.addContrib(s0.second,1,w);
+                    p0.addContrib(s1.second,1,w);
+                    pairs[numpairs++] = p0;
+                }
+                Pair p1;
+                if (initPair(p1,phantom,s1.first))
+                {
+                    p1.addContrib(s0.second,0,w);
+                    p1.addContrib(s1.second,0,w);
+                    p1.addContrib(s1.second,1,1.0f);
+                    pairs[numpairs++] = p1;
+                }
+            }
+        }
+    }
+    // Unit vector of the azimuth in the coordinates the sources use, front is y -1
+    static void azimuthToVector(float azi, float& x, float& y)
+    {
+        float rad = azi/360.0f*pi2;
+        x = std::sin(rad);
+        y = -std::cos(rad);
+    }
+    std::vector<float> azimuths;
+    int numspeakers = 0;
+    Pair pairs[maxPairs];
+    int numpairs = 0;
+private:
+    bool initPair(Pair& p, float azi0, float azi1)
+    {
+        float x0, y0, x1, y1;
+        azimuthToVector(azi0,x0,y0);
+        azimuthToVector(azi1,x1,y1);
+        float det = x0*y1-y0*x1;
+        if (std::fabs(det)<1e-4f)
+            return false;
+        p.inv[0][0] = y1/det;
+        p.inv[0][1] = -y0/det;
+        p.inv[1][0] = -x1/det;
+        p.inv[1][1] = x0/det;
+        return true;
+    }
+};
 
-class MyModule : public rack::Module
+class XSpatializer : public rack::Module
 {
 public:
 	enum paramids
@@ -40,150 +129,265 @@ public:
 		MASTERVOL,
 		LASTPAR
 	};
+	enum INPUTS
+	{
+		IN_AUDIO,
+		IN_X,
+		IN_Y,
+		IN_LAST
+	};
+	enum OUTPUTS
+	{
+		ENUMS(OUT_SPEAKER,16),
+		OUT_POLY,
+		OUT_LAST
+	};
 	std::array<std::pair<float,float>,16> m_positions;
-	std::array<float,1024> m_sintable;
-	float m_previous_x = 0.0f;
-	float m_previous_y = 0.0f;
-	float m_previous_rot = 0.0f;
-	float m_previous_spread = 0.0f;
-	float m_previous_size = 0.0f;
-	int m_previous_max_chans = 0;
-	float m_speaker_gains[16][4];
-	int m_lazy_update_counter = 0;
-	int m_lazy_update_interval = 44100;
-	int m_samples_processed = 0;
-	int m_updates_processed = 0;
-	double m_update_freq = 0.0;
-	MyModule()
+	std::atomic<int> m_numsources{0};
+	XSpatializer()
 	{
-		config(LASTPAR, 16, 4, 0);
-		// source orientation
-		// source size
-		// source aperture
-		configParam(0, -1.0f, 1.0f, 0.0f, "X pos", "", 0, 1.0);
-		configParam(1, -1.0f, 1.0f, 0.0f, "Y pos", "", 0, 1.0);
-		configParam(2, 0.0, 360.0, 0.0, "Rotate", "Degrees", 0, 1.0);
-		configParam(3, 0.0, 2.0, 0.0, "Spread", "", 0, 1.0);
-		configParam(4, 0.0, 1.0, 0.0, "Size", "", 0, 1.0);
-		configParam(5, 1.0, 16.0, 16.0, "Max inputs to process", "", 0, 1.0);
-		configParam(6, 0.0, 2.0, 0.125, "Master volume", "%", 0, 1.0);
-		int tabsize = m_sintable.size();
-		for (int i=0;i<tabsize;++i)
-		{
-			m_sintable[i]=sinf(pi2/tabsize*i);
-		}
-		updatePositions(16);
-		updateSpeakerGains(16);
+		config(LASTPAR, IN_LAST, OUT_LAST, 0);
+		configParam(POS_X, -1.0f, 1.0f, 0.0f, "X pos", "", 0, 1.0);
+		configParam(POS_Y, -1.0f, 1.0f, 0.0f, "Y pos", "", 0, 1.0);
+		configParam(ROTATE, 0.0, 360.0, 0.0, "Rotate", "Degrees", 0, 1.0);
+		configParam(SPREAD, 0.0, 2.0, 0.0, "Spread", "", 0, 1.0);
+		configParam(SIZE, 0.0, 1.0, 0.0, "Size", "", 0, 1.0);
+		configParam(MAXCHANS, 1.0, 16.0, 16.0, "Max sources to process", "", 0, 1.0);
+		getParamQuantity(MAXCHANS)->snapEnabled = true;
+		configParam(MASTERVOL, 0.0, 2.0, 0.125, "Master volume", "%", 0, 1.0);
+		configInput(IN_AUDIO,"Sources audio");
+		configInput(IN_X,"Sources X position CV");
+		configInput(IN_Y,"Sources Y position CV");
+		for (int i=0;i<16;++i)
+			configOutput(OUT_SPEAKER+i,"Speaker "+std::to_string(i+1));
+		configOutput(OUT_POLY,"All speakers");
+		for (auto& e : m_positions)
+			e = {0.0f,0.0f};
+		for (auto& g : m_gains)
+			for (auto& e : g)
+				e = 0.0f;
+		for (auto& g : m_target_gains)
+			for (auto& e : g)
+				e = 0.0f;
+		m_update_divider.setDivision(16);
+		setSpeakerAzimuths({-45.0f,45.0f,-135.0f,135.0f});
+		m_layout = m_layoutHandoff.acquire();
 	}
-	void updateSpeakerGains(int numchans)
+	// Call from the GUI thread
+	void setSpeakerAzimuths(std::vector<float> azis)
 	{
-		for (int i=0;i<numchans;++i)
+		auto layout = std::make_shared<const SpeakerLayout>(azis);
+		m_layout_azimuths = layout->azimuths;
+		m_layoutHandoff.publish(layout);
+	}
+	std::vector<float> getSpeakerAzimuths() const
+	{
+		return m_layout_azimuths;
+	}
+	json_t* dataToJson() override
+	{
+		json_t* resultJ = json_object();
+		json_t* arr = json_array();
+		for (auto& e : m_layout_azimuths)
+			json_array_append_new(arr,json_real(e));
+		json_object_set_new(resultJ,"speakers",arr);
+		return resultJ;
+	}
+	void dataFromJson(json_t* root) override
+	{
+		json_t* arr = json_object_get(root,"speakers");
+		if (arr && json_array_size(arr)>0)
 		{
-			if (!inputs[i].isConnected())
-				continue;
-			float input_x = m_positions[i].first;
-			float input_y = m_positions[i].second;
-
-			for (int j=0;j<4;++j)
-			{
-				float distance = 0.5*distance2d(input_x,input_y,speaker_positions[j][0],speaker_positions[j][1]);
-				float gain = clamp(1.0f-distance,0.0f,1.0f);
-				m_speaker_gains[i][j]=gain;
-			}
+			std::vector<float> azis;
+			for (size_t i=0;i<json_array_size(arr);++i)
+				azis.push_back(json_number_value(json_array_get(arr,i)));
+			setSpeakerAzimuths(azis);
 		}
 	}
 	void updatePositions(int numchans)
 	{
-		//float spread = params[paramids::SPREAD].getValue();
 		float rotphase = pi2/360.0*params[paramids::ROTATE].getValue();
 		float dist_from_center = params[paramids::SIZE].getValue();
 		float pos_x = params[paramids::POS_X].getValue();
 		float pos_y = params[paramids::POS_Y].getValue();
 		for (int i=0;i<numchans;++i)
 		{
-			if (!inputs[i].isConnected())
-				continue;
-			float sinphase = pi2/numchans*i+rotphase;
-			float cosphase = pi/2.0-sinphase;
-			int tabindex = (int)(m_sintable.size()/pi2*cosphase) & 1023;
-			m_positions[i].first=pos_x + dist_from_center*m_sintable[tabindex];
-			tabindex = (int)(m_sintable.size()/pi2*sinphase) & 1023;
-			m_positions[i].second=pos_y + dist_from_center*m_sintable[tabindex];
-			m_positions[i].first = clamp(m_positions[i].first,-1.0f,1.0f);
-			m_positions[i].second = clamp(m_positions[i].second,-1.0f,1.0f);
+			float phase = pi2/numchans*i+rotphase;
+			float x = pos_x + dist_from_center*std::cos(phase)+inputs[IN_X].getPolyVoltage(i)*0.2f;
+			float y = pos_y + dist_from_center*std::sin(phase)+inputs[IN_Y].getPolyVoltage(i)*0.2f;
+			m_positions[i].first = clamp(x,-1.0f,1.0f);
+			m_positions[i].second = clamp(y,-1.0f,1.0f);
 		}
 	}
-	bool areParametersDirty()
-	{
-		return params[paramids::POS_X].getValue()!=m_previous_x
-		|| params[paramids::POS_Y].getValue()!=m_previous_y
-		|| params[paramids::SPREAD].getValue()!=m_previous_spread
-		|| params[paramids::SIZE].getValue()!=m_previous_size
-		|| params[paramids::ROTATE].getValue()!=m_previous_rot
-		|| (int)params[paramids::MAXCHANS].getValue()!=m_previous_max_chans;
-	}
-	void process(const ProcessArgs& args) override
+	// Computes the target gains for 4 sources at a time
+	void updateGains(const SpeakerLayout& layout, int numchans)
 	{
-		for (int i=0;i<4;++i)
-			outputs[i].setVoltage(0.0f);
-		++m_samples_processed;
-		++m_lazy_update_counter;
-		int maxinchans = params[paramids::MAXCHANS].getValue();
-		if (areParametersDirty() || m_lazy_update_counter>=m_lazy_update_interval)
+		float spread = params[paramids::SPREAD].getValue()*0.5f;
+		float uniform = 1.0f/std::sqrt((float)layout.numspeakers);
+		// speakers beyond a smaller layout must start from silence if a larger layout comes back
+		for (int g=0;g<4;++g)
 		{
-			updatePositions(maxinchans);
-			updateSpeakerGains(maxinchans);
-			m_previous_x = params[paramids::POS_X].getValue();
-			m_previous_y = params[paramids::POS_Y].getValue();
-			m_previous_size = params[paramids::SIZE].getValue();
-			m_previous_rot = params[paramids::ROTATE].getValue();
-			m_previous_spread = params[paramids::SPREAD].getValue();
-			m_previous_max_chans = maxinchans;
-			m_lazy_update_counter = 0;
-			++m_updates_processed;
+			for (int i=layout.numspeakers;i<16;++i)
+			{
+				m_gains[g][i] = 0.0f;
+				m_target_gains[g][i] = 0.0f;
+			}
 		}
-		for (int i=0;i<maxinchans;++i)
+		for (int g=0;g<(numchans+3)/4;++g)
 		{
-			if (!inputs[i].isConnected())
+			simd::float_4* targets = m_target_gains[g];
+			for (int i=0;i<layout.numspeakers;++i)
+				targets[i] = 0.0f;
+			// the last group can have lanes above the number of sources, those are muted
+			simd::float_4 lane = simd::float_4(0.0f,1.0f,2.0f,3.0f)+(float)(g*4);
+			simd::float_4 active = lane<(float)numchans;
+			simd::float_4 px, py;
+			for (int i=0;i<4;++i)
+			{
+				px[i] = m_positions[g*4+i].first;
+				py[i] = m_positions[g*4+i].second;
+			}
+			simd::float_4 dist = simd::sqrt(px*px+py*py);
+			simd::float_4 invdist = 1.0f/simd::fmax(dist,1e-6f);
+			px *= invdist;
+			py *= invdist;
+			if (layout.numpairs == 0)
+			{
+				targets[0] = simd::ifelse(active,1.0f,0.0f);
 				continue;
-			for (int j=0;j<4;++j)
+			}
+			// the pair where the smaller gain is the largest contains the source direction
+			simd::float_4 bestmin = -1e9f;
+			simd::float_4 bestpair = 0.0f;
+			simd::float_4 bestg0 = 0.0f;
+			simd::float_4 bestg1 = 0.0f;
+			for (int i=0;i<layout.numpairs;++i)
 			{
-				float gain = m_speaker_gains[i][j];
-				float outv = outputs[j].getVoltage()+gain*inputs[i].getVoltage();
-				outputs[j].setVoltage(outv);
+				const SpeakerLayout::Pair& p = layout.pairs[i];
+				simd::float_4 g0 = px*p.inv[0][0]+py*p.inv[1][0];
+				simd::float_4 g1 = px*p.inv[0][1]+py*p.inv[1][1];
+				simd::float_4 gmin = simd::fmin(g0,g1);
+				simd::float_4 better = gmin>bestmin;
+				bestmin = simd::ifelse(better,gmin,bestmin);
+				bestpair = simd::ifelse(better,(float)i,bestpair);
+				bestg0 = simd::ifelse(better,g0,bestg0);
+				bestg1 = simd::ifelse(better,g1,bestg1);
 			}
+			bestg0 = simd::fmax(bestg0,0.0f);
+			bestg1 = simd::fmax(bestg1,0.0f);
+			for (int i=0;i<layout.numpairs;++i)
+			{
+				const SpeakerLayout::Pair& p = layout.pairs[i];
+				simd::float_4 mask = bestpair==(float)i;
+				for (int j=0;j<p.numcontribs;++j)
+				{
+					simd::float_4 gain = p.cend[j] == 0 ? bestg0 : bestg1;
+					targets[p.cspeaker[j]] += simd::ifelse(mask,gain*p.cweight[j],0.0f);
+				}
+			}
+			// sources near the center and spread sources are also sent to all speakers
+			simd::float_4 blend = simd::clamp(1.0f-dist+spread,0.0f,1.0f);
+			simd::float_4 power = 0.0f;
+			for (int i=0;i<layout.numspeakers;++i)
+				power += targets[i]*targets[i];
+			simd::float_4 norm = (1.0f-blend)/simd::fmax(simd::sqrt(power),1e-6f);
+			power = 0.0f;
+			for (int i=0;i<layout.numspeakers;++i)
+			{
+				targets[i] = targets[i]*norm+blend*uniform;
+				power += targets[i]*targets[i];
+			}
+			norm = simd::ifelse(active,1.0f/simd::fmax(simd::sqrt(power),1e-6f),0.0f);
+			for (int i=0;i<layout.numspeakers;++i)
+				targets[i] *= norm;
+		}
+	}
+	void process(const ProcessArgs& args) override
+	{
+		if (m_update_divider.process())
+		{
+			m_layout = m_layoutHandoff.acquire();
+			int maxinchans = params[paramids::MAXCHANS].getValue();
+			m_numchans = std::min(maxinchans,inputs[IN_AUDIO].getChannels());
+			updatePositions(m_numchans);
+			updateGains(*m_layout,m_numchans);
+			m_numsources.store(m_numchans);
+			m_smooth_coeff = 1.0f-std::exp(-1.0f/(0.02f*args.sampleRate));
+		}
+		int numspeakers = m_layout->numspeakers;
+		int numgroups = (m_numchans+3)/4;
+		simd::float_4 audio[4];
+		for (int g=0;g<numgroups;++g)
+		{
+			audio[g] = inputs[IN_AUDIO].getVoltageSimd<simd::float_4>(g*4);
+			for (int i=0;i<numspeakers;++i)
+				m_gains[g][i] += (m_target_gains[g][i]-m_gains[g][i])*m_smooth_coeff;
 		}
 		float mastergain = params[paramids::MASTERVOL].getValue();
-		for (int i=0;i<4;++i)
+		for (int i=0;i<numspeakers;++i)
 		{
-			outputs[i].setVoltage(mastergain*outputs[i].getVoltage());
+			simd::float_4 acc = 0.0f;
+			for (int g=0;g<numgroups;++g)
+				acc += m_gains[g][i]*audio[g];
+			float outv = mastergain*(acc[0]+acc[1]+acc[2]+acc[3]);
+			outputs[OUT_SPEAKER+i].setVoltage(outv);
+			outputs[OUT_POLY].setVoltage(outv,i);
 		}
-		m_update_freq = (float)m_samples_processed/m_updates_processed;
+		for (int i=numspeakers;i<16;++i)
+			outputs[OUT_SPEAKER+i].setVoltage(0.0f);
+		outputs[OUT_POLY].setChannels(numspeakers);
 	}
+private:
+	ImmutableHandoff<SpeakerLayout> m_layoutHandoff;
+	const SpeakerLayout* m_layout = nullptr;
+	std::vector<float> m_layout_azimuths;
+	// gains for 4 sources at a time, for each speaker
+	simd::float_4 m_gains[4][16];
+	simd::float_4 m_target_gains[4][16];
+	float m_smooth_coeff = 0.0f;
+	int m_numchans = 0;
+	dsp::ClockDivider m_update_divider;
 };
 
 class SpatWidget : public TransparentWidget
 {
 public:
-	SpatWidget(MyModule* m) : m_mod(m) 
+	SpatWidget(XSpatializer* m) : m_mod(m)
 	{}
 	void draw(const DrawArgs &args) override
 	{
 		if (m_mod == nullptr)
 			return;
 		nvgSave(args.vg);
-		
+
 		float w = box.size.x;
 		float h = box.size.y;
 		nvgBeginPath(args.vg);
 		nvgFillColor(args.vg, nvgRGBA(0x00, 0x00, 0x00, 0xff));
 		nvgRect(args.vg,0.0f,0.0f,w,h);
 		nvgFill(args.vg);
-		int numchans = m_mod->params[MyModule::MAXCHANS].getValue();
+		nvgFontSize(args.vg, 13);
+		nvgFontFaceId(args.vg, getDefaultFont(1)->handle);
+		nvgTextLetterSpacing(args.vg, -2);
+		char buf[10];
+		auto azis = m_mod->getSpeakerAzimuths();
+		for (int i=0;i<(int)azis.size();++i)
+		{
+			float x, y;
+			SpeakerLayout::azimuthToVector(azis[i],x,y);
+			float xcor = rescale(x,-1.0f,1.0f,0.0f,w);
+			float ycor = rescale(y,-1.0f,1.0f,0.0f,h);
+			nvgBeginPath(args.vg);
+			nvgFillColor(args.vg, nvgRGBA(0xff, 0x80, 0x00, 0xff));
+			nvgRect(args.vg,xcor-4.0f,ycor-4.0f,8.0f,8.0f);
+			nvgFill(args.vg);
+			nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
+			sprintf(buf,"S%d",i+1);
+			nvgText(args.vg, xcor-6.0f , ycor-6.0f , buf, NULL);
+		}
+		int numchans = m_mod->m_numsources.load();
 		for (int i=0;i<numchans;++i)
 		{
-			if (!m_mod->inputs[i].isConnected())
-				continue;
 			float x = m_mod->m_positions[i].first;
 			float y = m_mod->m_positions[i].second;
 			float xcor = rescale(x,-1.0f,1.0f,0.0f,w); //w/2.0*(x+1.0);
@@ -192,27 +396,23 @@ public:
 			nvgFillColor(args.vg, nvgRGBA(0x00, 0xff, 0x00, 0xff));
 			nvgCircle(args.vg,xcor,ycor,5.0f);
 			nvgFill(args.vg);
-			
-			nvgFontSize(args.vg, 13);
-			nvgFontFaceId(args.vg, getDefaultFont(1)->handle);
-			nvgTextLetterSpacing(args.vg, -2);
+
 			nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
-			char buf[10];
 			sprintf(buf,"%d",i+1);
 			nvgText(args.vg, xcor , ycor+15.0f , buf, NULL);
 		}
 		nvgRestore(args.vg);
 	}
 private:
-	MyModule* m_mod = nullptr;
+	XSpatializer* m_mod = nullptr;
 };
 
-class MyModuleWidget : public ModuleWidget
+class XSpatializerWidget : public ModuleWidget
 {
 public:
-	SpatWidget* m_spatWidget = nullptr;	
-	
-	MyModuleWidget(MyModule* module)
+	SpatWidget* m_spatWidget = nullptr;
+
+	XSpatializerWidget(XSpatializer* module)
 	{
 		setModule(module);
 		box.size.x = 500;
@@ -220,35 +420,66 @@ public:
 		m_spatWidget->box.pos = Vec(5,90);
 		m_spatWidget->box.size = Vec(150,150);
 		addChild(m_spatWidget);
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(8.099, 86.025)), module, XSpatializer::IN_AUDIO));
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(18.099, 86.025)), module, XSpatializer::IN_X));
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(28.099, 86.025)), module, XSpatializer::IN_Y));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(38.099, 86.025)), module, XSpatializer::OUT_POLY));
 		for (int i=0;i<16;++i)
 		{
-			addInput(createInputCentered<PJ301MPort>(mm2px(Vec(8.099+10.0*i, 96.025)), module, i));
+			addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(8.099+10.0*i, 106.025)), module, XSpatializer::OUT_SPEAKER+i));
 		}
-		for (int i=0;i<4;++i)
+		addParam(createParam<RoundHugeBlackKnob>(Vec(3, 30), module, XSpatializer::POS_X));
+		addParam(createParam<RoundHugeBlackKnob>(Vec(63, 30), module, XSpatializer::POS_Y));
+		addParam(createParam<RoundHugeBlackKnob>(Vec(123, 30), module, XSpatializer::ROTATE));
+		addParam(createParam<RoundHugeBlackKnob>(Vec(183, 30), module, XSpatializer::SPREAD));
+		addParam(createParam<RoundHugeBlackKnob>(Vec(243, 30), module, XSpatializer::SIZE));
+		addParam(createParam<RoundHugeBlackKnob>(Vec(303, 30), module, XSpatializer::MAXCHANS));
+		addParam(createParam<RoundHugeBlackKnob>(Vec(363, 30), module, XSpatializer::MASTERVOL));
+	}
+	void appendContextMenu(Menu* menu) override
+	{
+		XSpatializer* sm = dynamic_cast<XSpatializer*>(module);
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createMenuItem([sm]()
 		{
-			addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(8.099+10.0*i, 106.025)), module, i));
-		}
-		addParam(createParam<RoundHugeBlackKnob>(Vec(3, 30), module, MyModule::POS_X));
-		addParam(createParam<RoundHugeBlackKnob>(Vec(63, 30), module, MyModule::POS_Y));
-		addParam(createParam<RoundHugeBlackKnob>(Vec(123, 30), module, MyModule::ROTATE));
-		addParam(createParam<RoundHugeBlackKnob>(Vec(183, 30), module, MyModule::SPREAD));
-		addParam(createParam<RoundHugeBlackKnob>(Vec(243, 30), module, MyModule::SIZE));
-		addParam(createParam<RoundHugeBlackKnob>(Vec(303, 30), module, MyModule::MAXCHANS));
-		addParam(createParam<RoundHugeBlackKnob>(Vec(363, 30), module, MyModule::MASTERVOL));
+			sm->setSpeakerAzimuths({-30.0f,30.0f});
+		},"Stereo speakers"));
+		menu->addChild(createMenuItem([sm]()
+		{
+			sm->setSpeakerAzimuths({-45.0f,45.0f,-135.0f,135.0f});
+		},"Quad speakers"));
+		menu->addChild(createMenuItem([sm]()
+		{
+			sm->setSpeakerAzimuths({-30.0f,30.0f,0.0f,-110.0f,110.0f});
+		},"5.0 speakers"));
+		auto ringmenu = createSubmenuItem("Speaker ring","",[=](Menu* m)
+		{
+			for (int n=2;n<=16;++n)
+			{
+				m->addChild(createMenuItem([=]()
+				{
+					std::vector<float> azis;
+					for (int i=0;i<n;++i)
+						azis.push_back(360.0f/n*i);
+					sm->setSpeakerAzimuths(azis);
+				},std::to_string(n)+" speakers",CHECKMARK((int)sm->getSpeakerAzimuths().size()==n)));
+			}
+		});
+		menu->addChild(ringmenu);
 	}
 	void draw(const DrawArgs &args) override
 	{
-		
+
 		nvgSave(args.vg);
-		
+
 		float w = box.size.x;
 		float h = box.size.y;
 		nvgBeginPath(args.vg);
 		nvgFillColor(args.vg, nvgRGBA(0x80, 0x80, 0x80, 0xff));
 		nvgRect(args.vg,0.0f,0.0f,w,h);
 		nvgFill(args.vg);
-		
-		auto mod = dynamic_cast<MyModule*>(this->module);
+
+		auto mod = dynamic_cast<XSpatializer*>(this->module);
 		if (mod)
 		{
 			nvgFontSize(args.vg, 13);
@@ -256,10 +487,12 @@ public:
 			nvgTextLetterSpacing(args.vg, -2);
 			nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
 			char buf[200];
-			sprintf(buf,"SPATIALIZER (%d param updates)",mod->m_updates_processed);
+			sprintf(buf,"SPATIALIZER (%d speakers)",(int)mod->getSpeakerAzimuths().size());
 			nvgText(args.vg, 3 , 10, buf, NULL);
 		}
 		nvgRestore(args.vg);
 		ModuleWidget::draw(args);
 	}
 };
+
+Model* modelXSpatializer = createModel<XSpatializer,XSpatializerWidget>("XSpatializer");
@@ -203,8 +203,17 @@ public:
         static const char* algonames[]={"Add","Avg","Mult","Min","Max","And","Or","Xor","Diff","RR"};
         return algonames[algo];
     }
+    static ReduceFunc4 getReduceFunc(int algo)
+    {
+        static const ReduceFunc4 funcs[]={reduce_add_simd,reduce_average_simd,reduce_mult_simd,
+            reduce_min_simd,reduce_max_simd,reduce_and_simd,reduce_or_simd,reduce_xor_simd,
+            reduce_difference_simd,reduce_selected_simd};
+        return funcs[clamp(algo,0,ALGO_LAST-1)];
+    }
 private:
     RoundRobin m_rr;  
+    int m_cur_algo = -1;
+    ReduceFunc4 m_reducefunc = nullptr;
 };
 
 class ReducerWidget : public ModuleWidget
@@ -227,30 +236,41 @@ ReducerModule::ReducerModule()
 void ReducerModule::process(const ProcessArgs& args)
 {
     int algo = params[PAR_ALGO].getValue();
+    if (algo != m_cur_algo)
+    {
+        m_reducefunc = getReduceFunc(algo);
+        m_cur_algo = algo;
+    }
     float p_a = params[PAR_A].getValue();
     //float p_b = params[PAR_B].getValue();
-    float r = 0.0f;
-    if (algo == ALGO_ADD)
-        r = reduce_add(inputs,0.0f,0.0f);
-    else if (algo == ALGO_AVG)
-        r = reduce_average(inputs,0.0f,0.0f);
-    else if (algo == ALGO_MULT)
-        r = reduce_mult(inputs,p_a,0.0f);
-    else if (algo == ALGO_MIN)
-        r = reduce_min(inputs,0.0f,1.0f);
-    else if (algo == ALGO_MAX)
-        r = reduce_max(inputs,0.0f,1.0f);
-    else if (algo == ALGO_ROUNDROBIN)
-        r = m_rr.process(inputs);
-    else if (algo == ALGO_AND)
-        r = reduce_and(inputs,0.0f,0.0f);
-    else if (algo == ALGO_OR)
-        r = reduce_or(inputs,0.0f,0.0f);
-    else if (algo == ALGO_XOR)
-        r = reduce_xor(inputs,0.0f,0.0f);
-    else if (algo == ALGO_DIFFERENCE)
-        r = reduce_difference(inputs,p_a,0.0f);
-    outputs[0].setVoltage(clamp(r,-10.0f,10.0f));
+    int connected[8];
+    int numconnected = 0;
+    int numchans = 1;
+    for (int i=0;i<8;++i)
+    {
+        if (inputs[i].isConnected())
+        {
+            connected[numconnected++] = i;
+            numchans = std::max(numchans,inputs[i].getChannels());
+        }
+    }
+    int rrindex = -1;
+    if (algo == ALGO_ROUNDROBIN)
+        rrindex = m_rr.nextInput(inputs);
+    ReduceFrame frame;
+    frame.numins = numconnected;
+    frame.firstrest = (numconnected>0 && connected[0] == 0) ? 1 : 0;
+    for (int c=0;c<numchans;c+=4)
+    {
+        frame.first = inputs[0].getPolyVoltageSimd<simd::float_4>(c);
+        for (int i=0;i<numconnected;++i)
+            frame.ins[i] = inputs[connected[i]].getPolyVoltageSimd<simd::float_4>(c);
+        if (rrindex>=0)
+            frame.selected = inputs[rrindex].getPolyVoltageSimd<simd::float_4>(c);
+        simd::float_4 r = m_reducefunc(frame,p_a);
+        outputs[0].setVoltageSimd(simd::clamp(r,-10.0f,10.0f),c);
+    }
+    outputs[0].setChannels(numchans);
 }
 
 ReducerWidget::ReducerWidget(ReducerModule* m)
@@ -294,20 +314,77 @@ void ReducerWidget::draw(const DrawArgs &args)
 
 Model* modelReducer = createModel<ReducerModule,ReducerWidget>("Reduce");
 
+// The histogram the GUI draws. The audio thread fills in the snapshot the GUI isn't
+// reading and then flips the front index, the bins are relaxed atomics so that a
+// snapshot being overwritten while it is drawn is only a visual glitch.
+class HistogramSnapshot
+{
+public:
+    HistogramSnapshot()
+    {
+        for (auto& e : bins)
+            e.store(0,std::memory_order_relaxed);
+    }
+    std::atomic<uint32_t> bins[4096];
+    std::atomic<int> numbins{0};
+    std::atomic<uint32_t> maxcount{0};
+};
+
 class HistogramModule : public rack::Module
 {
 public:
+    enum PARAMS
+    {
+        PAR_SCALE,
+        PAR_PERCENTILE,
+        PAR_LAST
+    };
+    enum INPUTS
+    {
+        IN_VOLTAGE,
+        IN_RESET,
+        IN_LAST
+    };
+    enum OUTPUTS
+    {
+        OUT_MEAN,
+        OUT_DEVIATION,
+        OUT_PERCENTILE,
+        OUT_LAST
+    };
     HistogramModule();
     void process(const ProcessArgs& args) override;
-    std::vector<int>* getData()
+    json_t* dataToJson() override;
+    void dataFromJson(json_t* root) override;
+    // Returns the snapshot most recently published by the audio thread
+    const HistogramSnapshot& getSnapshot() const
     {
-        return &m_data;
+        return m_snapshots[m_front_snapshot.load(std::memory_order_acquire)];
     }
+    int getNumBins() const { return m_numbins_request.load(); }
+    void setNumBins(int n) { m_numbins_request.store(clamp(n,2,m_max_bins)); }
+    int m_decimation = 1;
+    static const int m_max_bins = 4096;
 private:
-    std::vector<int> m_data;
-    int m_data_size = 128;
+    void resetData();
+    void publishSnapshot();
+    std::vector<uint32_t> m_data;
+    int m_numbins = 128;
+    std::atomic<int> m_numbins_request{128};
     float m_volt_min = -10.0f;
     float m_volt_max = 10.0f;
+    int m_decim_counter = 0;
+    // streaming statistics of the accumulated values, with Welford's update so that the
+    // deviation doesn't suffer from cancellation with large offsets or long runs
+    uint64_t m_count = 0;
+    double m_runmean = 0.0;
+    double m_m2 = 0.0;
+    float m_mean = 0.0f;
+    float m_deviation = 0.0f;
+    float m_percentile = 0.0f;
+    HistogramSnapshot m_snapshots[2];
+    std::atomic<int> m_front_snapshot{0};
+    dsp::ClockDivider m_publish_divider;
     dsp::SchmittTrigger m_reset_trig;
 };
 
@@ -327,6 +404,34 @@ class HistogramModuleWidget : public ModuleWidget
 public:
     HistogramModuleWidget(HistogramModule* mod);
     void draw(const DrawArgs &args) override;
+    void appendContextMenu(Menu* menu) override
+    {
+        HistogramModule* hm = dynamic_cast<HistogramModule*>(module);
+        menu->addChild(new MenuSeparator);
+        auto binsmenu = createSubmenuItem("Number of bins","",[=](Menu* m)
+        {
+            for (int n=32;n<=HistogramModule::m_max_bins;n*=2)
+            {
+                m->addChild(createMenuItem([=]()
+                {
+                    hm->setNumBins(n);
+                },std::to_string(n),CHECKMARK(hm->getNumBins()==n)));
+            }
+        });
+        menu->addChild(binsmenu);
+        auto decimmenu = createSubmenuItem("Accumulate every","",[=](Menu* m)
+        {
+            for (int n=1;n<=64;n*=2)
+            {
+                std::string txt = n == 1 ? "sample" : std::to_string(n)+" samples";
+                m->addChild(createMenuItem([=]()
+                {
+                    hm->m_decimation = n;
+                },txt,CHECKMARK(hm->m_decimation==n)));
+            }
+        });
+        menu->addChild(decimmenu);
+    }
     
 private:
     HistogramWidget* m_hwid = nullptr;
@@ -334,26 +439,121 @@ private:
 
 HistogramModule::HistogramModule()
 {
-    m_data.resize(m_data_size);
-    config(1,2,0,0);
-    configParam(0,0.0f,1.0f,0.0f);
+    m_data.resize(m_max_bins);
+    config(PAR_LAST,IN_LAST,OUT_LAST,0);
+    configParam(PAR_SCALE,0.0f,1.0f,0.0f,"Manual vertical scale");
+    configParam(PAR_PERCENTILE,0.0f,1.0f,0.5f,"Percentile"," %",0.0f,100.0f);
+    configInput(IN_VOLTAGE,"Voltage (all channels are accumulated)");
+    configInput(IN_RESET,"Reset");
+    configOutput(OUT_MEAN,"Mean");
+    configOutput(OUT_DEVIATION,"Standard deviation");
+    configOutput(OUT_PERCENTILE,"Percentile");
+    m_publish_divider.setDivision(256);
+}
+
+void HistogramModule::resetData()
+{
+    std::fill(m_data.begin(),m_data.end(),0);
+    m_count = 0;
+    m_runmean = 0.0;
+    m_m2 = 0.0;
+}
+
+void HistogramModule::publishSnapshot()
+{
+    int backindex = 1-m_front_snapshot.load(std::memory_order_relaxed);
+    HistogramSnapshot& snap = m_snapshots[backindex];
+    uint32_t maxcount = 0;
+    for (int i=0;i<m_numbins;++i)
+    {
+        snap.bins[i].store(m_data[i],std::memory_order_relaxed);
+        maxcount = std::max(maxcount,m_data[i]);
+    }
+    snap.numbins.store(m_numbins,std::memory_order_relaxed);
+    snap.maxcount.store(maxcount,std::memory_order_relaxed);
+    m_front_snapshot.store(backindex,std::memory_order_release);
+
+    if (m_count == 0)
+    {
+        m_mean = 0.0f;
+        m_deviation = 0.0f;
+        m_percentile = 0.0f;
+        return;
+    }
+    m_mean = m_runmean;
+    m_deviation = std::sqrt(m_m2/m_count);
+    uint64_t target = params[PAR_PERCENTILE].getValue()*m_count;
+    uint64_t accum = 0;
+    int bin = m_numbins-1;
+    for (int i=0;i<m_numbins;++i)
+    {
+        accum += m_data[i];
+        if (accum>target)
+        {
+            bin = i;
+            break;
+        }
+    }
+    // center of the bin
+    float binwidth = (m_volt_max-m_volt_min)/(m_numbins-1);
+    m_percentile = clamp(m_volt_min+binwidth*(bin+0.5f),m_volt_min,m_volt_max);
 }
 
 void HistogramModule::process(const ProcessArgs& args) 
 {
-    if (m_reset_trig.process(inputs[1].getVoltage()))
+    int numbins = m_numbins_request.load(std::memory_order_relaxed);
+    if (numbins != m_numbins)
     {
-        std::fill(m_data.begin(),m_data.end(),0);
+        m_numbins = numbins;
+        resetData();
     }
-    if (inputs[0].isConnected())
+    if (m_reset_trig.process(inputs[IN_RESET].getVoltage()))
     {
-        float v = inputs[0].getVoltage();
-        if (v>=m_volt_min && v<=m_volt_max)
+        resetData();
+    }
+    if (inputs[IN_VOLTAGE].isConnected())
+    {
+        ++m_decim_counter;
+        if (m_decim_counter>=m_decimation)
         {
-            int index = rescale(v,m_volt_min,m_volt_max,0,m_data.size()-1);
-            ++m_data[index];
+            m_decim_counter = 0;
+            int numchans = inputs[IN_VOLTAGE].getChannels();
+            for (int i=0;i<numchans;++i)
+            {
+                float v = inputs[IN_VOLTAGE].getVoltage(i);
+                if (v>=m_volt_min && v<=m_volt_max)
+                {
+                    int index = rescale(v,m_volt_min,m_volt_max,0,m_numbins-1);
+                    ++m_data[index];
+                    ++m_count;
+                    double delta = v-m_runmean;
+                    m_runmean += delta/m_count;
+                    m_m2 += delta*(v-m_runmean);
+                }
+            }
         }
     }
+    if (m_publish_divider.process())
+        publishSnapshot();
+    outputs[OUT_MEAN].setVoltage(m_mean);
+    outputs[OUT_DEVIATION].setVoltage(m_deviation);
+    outputs[OUT_PERCENTILE].setVoltage(m_percentile);
+}
+
+json_t* HistogramModule::dataToJson()
+{
+    json_t* resultJ = json_object();
+    json_object_set(resultJ,"numbins",json_integer(getNumBins()));
+    json_object_set(resultJ,"decimation",json_integer(m_decimation));
+    return resultJ;
+}
+
+void HistogramModule::dataFromJson(json_t* root)
+{
+    if (auto j = json_object_get(root,"numbins"))
+        setNumBins(json_integer_value(j));
+    if (auto j = json_object_get(root,"decimation"))
+        m_decimation = clamp((int)json_integer_value(j),1,64);
 }
 
 void HistogramWidget::draw(const DrawArgs &args) 
@@ -368,28 +568,32 @@ void HistogramWidget::draw(const DrawArgs &args)
 		nvgRect(args.vg,0.0f,0.0f,w,h);
 		nvgFill(args.vg);
         
-        auto data = m_mod->getData();
-        auto maxe = *std::max_element(data->begin(),data->end());
+        const HistogramSnapshot& snap = m_mod->getSnapshot();
+        int numbins = snap.numbins.load(std::memory_order_relaxed);
+        uint32_t maxe = snap.maxcount.load(std::memory_order_relaxed);
+        if (numbins<2 || maxe == 0)
+        {
+            nvgRestore(args.vg);
+            return;
+        }
         float yscaler = h/maxe;
-        float manualscale = m_mod->params[0].getValue();
+        float manualscale = m_mod->params[HistogramModule::PAR_SCALE].getValue();
         if (manualscale>0.0f)
             yscaler = h/10000.0f*manualscale;
-        float barwidth = w/data->size();
-        for (int i=0;i<(int)data->size();++i)
+        float barwidth = w/numbins;
+        nvgBeginPath(args.vg);
+        nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
+        for (int i=0;i<numbins;++i)
         {
-            float xcor = rescale(i,0,data->size()-1,0,w-barwidth);
-            float y = (*data)[i]*yscaler;
+            float xcor = rescale(i,0,numbins-1,0,w-barwidth);
+            float y = snap.bins[i].load(std::memory_order_relaxed)*yscaler;
             y = clamp(y,0.0f,h);
             if (y>=1.0f)
             {
-                nvgBeginPath(args.vg);
-                nvgFillColor(args.vg, nvgRGBA(0xff, 0xff, 0xff, 0xff));
                 nvgRect(args.vg,xcor,h-y,barwidth,y);
-                nvgFill(args.vg);
             }
-            
-            
         }
+        nvgFill(args.vg);
         nvgRestore(args.vg);
     }
 
@@ -397,9 +601,13 @@ HistogramModuleWidget::HistogramModuleWidget(HistogramModule* mod_)
 {
     box.size.x = 500;
     setModule(mod_);
-    addInput(createInput<PJ301MPort>(Vec(5, 20), module, 0));
-    addInput(createInput<PJ301MPort>(Vec(35, 20), module, 1));
-    addParam(createParam<RoundBlackKnob>(Vec(65, 17), module, 0));    
+    addInput(createInput<PJ301MPort>(Vec(5, 20), module, HistogramModule::IN_VOLTAGE));
+    addInput(createInput<PJ301MPort>(Vec(35, 20), module, HistogramModule::IN_RESET));
+    addParam(createParam<RoundBlackKnob>(Vec(65, 17), module, HistogramModule::PAR_SCALE));    
+    addParam(createParam<RoundBlackKnob>(Vec(100, 17), module, HistogramModule::PAR_PERCENTILE));    
+    addOutput(createOutput<PJ301MPort>(Vec(135, 20), module, HistogramModule::OUT_MEAN));
+    addOutput(createOutput<PJ301MPort>(Vec(165, 20), module, HistogramModule::OUT_DEVIATION));
+    addOutput(createOutput<PJ301MPort>(Vec(195, 20), module, HistogramModule::OUT_PERCENTILE));
     m_hwid = new HistogramWidget(mod_);
     
     m_hwid->box.pos = Vec(5,50);
@@ -132,24 +132,135 @@ inline float reduce_xor(std::vector<Input>& in, float par_a, float par_b)
     return rescale(result,0,maxi,-10.0f,10.0f);
 }
 
+// Polyphonic versions of the reductions, processing 4 channels at a time.
+// The inputs of the frame are gathered once per sample and the reduction
+// function is selected only when the algorithm changes.
+struct ReduceFrame
+{
+    // The first input is used as the starting value by some algorithms even if it isn't connected
+    simd::float_4 first = 0.0f;
+    // The connected inputs, first input included
+    simd::float_4 ins[8];
+    int numins = 0;
+    // The connected inputs after the first input
+    int firstrest = 0;
+    // The input chosen by the round robin algorithm
+    simd::float_4 selected = 0.0f;
+};
+
+typedef simd::float_4 (*ReduceFunc4)(const ReduceFrame& f, float par_a);
+
+inline simd::float_4 reduce_add_simd(const ReduceFrame& f, float par_a)
+{
+    simd::float_4 result = 0.0f;
+    for (int i=0;i<f.numins;++i)
+        result += f.ins[i];
+    return result;
+}
+
+inline simd::float_4 reduce_mult_simd(const ReduceFrame& f, float par_a)
+{
+    simd::float_4 result = 1.0f;
+    for (int i=0;i<f.numins;++i)
+        result *= f.ins[i]*par_a;
+    return result;
+}
+
+inline simd::float_4 reduce_average_simd(const ReduceFrame& f, float par_a)
+{
+    if (f.numins == 0)
+        return 0.0f;
+    return reduce_add_simd(f,par_a)/(float)f.numins;
+}
+
+inline simd::float_4 reduce_min_simd(const ReduceFrame& f, float par_a)
+{
+    simd::float_4 result = f.first;
+    for (int i=f.firstrest;i<f.numins;++i)
+        result = simd::fmin(result,f.ins[i]);
+    return result;
+}
+
+inline simd::float_4 reduce_max_simd(const ReduceFrame& f, float par_a)
+{
+    simd::float_4 result = f.first;
+    for (int i=f.firstrest;i<f.numins;++i)
+        result = simd::fmax(result,f.ins[i]);
+    return result;
+}
+
+inline simd::float_4 reduce_difference_simd(const ReduceFrame& f, float par_a)
+{
+    simd::float_4 result = f.first;
+    for (int i=f.firstrest;i<f.numins;++i)
+        result = simd::abs(result-f.ins[i]);
+    return result*par_a*2.0f-10.0f;
+}
+
+inline simd::int32_4 reduce_to_bits_simd(simd::float_4 v)
+{
+    const float maxi = 65535.0f;
+    return simd::int32_4(simd::clamp((v+10.0f)/20.0f*maxi,0.0f,maxi));
+}
+
+inline simd::float_4 reduce_from_bits_simd(simd::int32_4 v)
+{
+    return simd::float_4(v)/65535.0f*20.0f-10.0f;
+}
+
+inline simd::float_4 reduce_and_simd(const ReduceFrame& f, float par_a)
+{
+    simd::int32_4 result = reduce_to_bits_simd(f.first);
+    for (int i=f.firstrest;i<f.numins;++i)
+        result = result & reduce_to_bits_simd(f.ins[i]);
+    return reduce_from_bits_simd(result);
+}
+
+inline simd::float_4 reduce_or_simd(const ReduceFrame& f, float par_a)
+{
+    simd::int32_4 result = reduce_to_bits_simd(f.first);
+    for (int i=f.firstrest;i<f.numins;++i)
+        result = result | reduce_to_bits_simd(f.ins[i]);
+    return reduce_from_bits_simd(result);
+}
+
+inline simd::float_4 reduce_xor_simd(const ReduceFrame& f, float par_a)
+{
+    simd::int32_4 result = reduce_to_bits_simd(f.first);
+    for (int i=f.firstrest;i<f.numins;++i)
+        result = result ^ reduce_to_bits_simd(f.ins[i]);
+    return reduce_from_bits_simd(result);
+}
+
+inline simd::float_4 reduce_selected_simd(const ReduceFrame& f, float par_a)
+{
+    return f.selected;
+}
+
 class RoundRobin
 {
 public:
     RoundRobin() {}
     inline float process(std::vector<Input>& in)
     {
-        float r = 0.0f;
+        int index = nextInput(in);
+        if (index>=0)
+            return in[index].getVoltage();
+        return 0.0f;
+    }
+    // Returns the index of the next connected input or -1 if none are connected
+    inline int nextInput(std::vector<Input>& in)
+    {
         for (int i=0;i<(int)in.size();++i)
         {
             int index = (m_curinput+i) % in.size();
             if (in[index].isConnected())
             {
-                r = in[index].getVoltage();
                 m_curinput = index+1;
-                break;
+                return index;
             }
         }
-        return r;
+        return -1;
     }
     int m_counter = 0;
     int m_curinput = 0;
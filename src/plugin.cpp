@@ -15,7 +15,6 @@ std::shared_ptr<rack::Font> getDefaultFont(int which)
 
 void init(Plugin *p) {
 	pluginInstance = p;
-	//p->addModel(createModel<MyModule,MyModuleWidget>("Spatializer"));
 	p->addModel(modelWeightGate);
 	p->addModel(modelHistogram);
 	
@@ -28,7 +27,7 @@ void init(Plugin *p) {
 	p->addModel(modelXRandom);
 	//p->addModel(modelXDerivator);
 #ifdef RBMODULE
-	p->addModel(createModel<AudioStretchModule,AudioStretchWidget>("XAudioStretch"));
+	p->addModel(modelXAudioStretch);
 #endif
 
 	p->addModel(modelXQuantizer);
@@ -45,5 +44,6 @@ void init(Plugin *p) {
 	p->addModel(modelXScaleOscillator);
 	p->addModel(modelCubeSymSeq);
 	p->addModel(modelTimeSeq);
+	p->addModel(modelXSpatializer);
 	
 }